@@ -0,0 +1,202 @@
+// Offscreen test application for measuring what hooks.so costs. Renders a
+// rotating heightfield with depth testing into an EGL pbuffer and prints
+// frame and swap time statistics as JSON on stdout.
+//
+//   bench_app [width] [height] [frames] [grid]
+//
+// Run it with EGL_PLATFORM=surfaceless to render without a display server,
+// LIBGL_ALWAYS_SOFTWARE=1 picks llvmpipe.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <EGL/egl.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#define WARMUP_FRAMES 10
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank on a sorted array
+static double percentile(const double* sorted, const int count,
+                         const double p) {
+    int rank = (int) ceil(p / 100.0 * count) - 1;
+    if (rank < 0) {
+        rank = 0;
+    }
+    return sorted[rank];
+}
+
+static void print_stats(const char* name, double* samples, const int count,
+                        const bool last) {
+    double total = 0.0;
+    for (int j = 0; j < count; j++) {
+        total += samples[j];
+    }
+    qsort(samples, count, sizeof(double), compare_doubles);
+    printf("  \"%s\": {\"mean\": %.4f, \"p50\": %.4f, \"p99\": %.4f, "
+           "\"max\": %.4f, \"total\": %.4f}%s\n", name, total / count,
+           percentile(samples, count, 50.0), percentile(samples, count, 99.0),
+           samples[count - 1], total, last ? "" : ",");
+}
+
+// A grid x grid heightfield of triangle pairs with per-vertex colors, so
+// both the color and the depth buffer have something to capture
+static GLuint create_scene(const int grid, GLsizei* vertex_count) {
+    const int quads = grid * grid;
+    float* vertices = malloc(sizeof(float) * quads * 6 * 6);
+    float* out = vertices;
+    for (int y = 0; y < grid; y++) {
+        for (int x = 0; x < grid; x++) {
+            static const int corners[6][2] = {
+                {0, 0}, {1, 0}, {1, 1}, {0, 0}, {1, 1}, {0, 1}
+            };
+            for (int k = 0; k < 6; k++) {
+                const float u = (float) (x + corners[k][0]) / grid;
+                const float v = (float) (y + corners[k][1]) / grid;
+                const float h = 0.15f * sinf(u * 12.0f) * cosf(v * 9.0f);
+                *(out++) = u * 2.0f - 1.0f;
+                *(out++) = h;
+                *(out++) = v * 2.0f - 1.0f;
+                *(out++) = u;
+                *(out++) = 0.5f + h * 3.0f;
+                *(out++) = v;
+            }
+        }
+    }
+
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * quads * 6 * 6, vertices,
+                 GL_STATIC_DRAW);
+    free(vertices);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 6 * sizeof(float), (void*) 0);
+    glColorPointer(3, GL_FLOAT, 6 * sizeof(float),
+                   (void*) (3 * sizeof(float)));
+    *vertex_count = quads * 6;
+    return buffer;
+}
+
+int main(int argc, char** argv) {
+    const int width = argc > 1 ? atoi(argv[1]) : 1280;
+    const int height = argc > 2 ? atoi(argv[2]) : 720;
+    const int frames = argc > 3 ? atoi(argv[3]) : 300;
+    const int grid = argc > 4 ? atoi(argv[4]) : 256;
+    if (width <= 0 || height <= 0 || frames <= 0 || grid <= 0) {
+        fprintf(stderr, "usage: %s [width] [height] [frames] [grid]\n",
+                argv[0]);
+        return 1;
+    }
+
+    EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (!eglInitialize(display, NULL, NULL)) {
+        fprintf(stderr, "Can't initialize EGL\n");
+        return 1;
+    }
+    const EGLint config_attributes[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configs = 0;
+    eglChooseConfig(display, config_attributes, &config, 1, &configs);
+    if (configs == 0) {
+        fprintf(stderr, "No EGL config with a depth buffer\n");
+        return 1;
+    }
+    const EGLint surface_attributes[] = {
+        EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE
+    };
+    EGLSurface surface = eglCreatePbufferSurface(display, config,
+                                                 surface_attributes);
+    eglBindAPI(EGL_OPENGL_API);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT,
+                                          NULL);
+    if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT ||
+            !eglMakeCurrent(display, surface, surface, context)) {
+        fprintf(stderr, "Can't create an EGL context\n");
+        return 1;
+    }
+
+    GLsizei vertex_count;
+    GLuint scene = create_scene(grid, &vertex_count);
+    glViewport(0, 0, width, height);
+    glEnable(GL_DEPTH_TEST);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glFrustum(-0.1 * width / height, 0.1 * width / height, -0.1, 0.1,
+              0.1, 10.0);
+    glMatrixMode(GL_MODELVIEW);
+
+    double* frame_ms = malloc(sizeof(double) * frames);
+    double* swap_ms = malloc(sizeof(double) * frames);
+    double start = 0.0;
+    double previous = now_ms();
+    const double warmup_start = previous;
+    for (int j = -WARMUP_FRAMES; j < frames; j++) {
+        if (j == 0) {
+            start = previous;
+        }
+        glClearColor(0.1f, 0.1f, 0.2f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glLoadIdentity();
+        glTranslatef(0.0f, -0.3f, -2.2f);
+        glRotatef(25.0f, 1.0f, 0.0f, 0.0f);
+        glRotatef(j * 0.5f, 0.0f, 1.0f, 0.0f);
+        glDrawArrays(GL_TRIANGLES, 0, vertex_count);
+
+        const double before_swap = now_ms();
+        eglSwapBuffers(display, surface);
+        const double after_swap = now_ms();
+        if (j >= 0) {
+            frame_ms[j] = after_swap - previous;
+            swap_ms[j] = after_swap - before_swap;
+        }
+        previous = after_swap;
+    }
+    const double end = now_ms();
+
+    printf("{\n");
+    printf("  \"width\": %d,\n  \"height\": %d,\n", width, height);
+    printf("  \"frames\": %d,\n  \"triangles\": %d,\n", frames,
+           vertex_count / 3);
+    printf("  \"renderer\": \"%s\",\n",
+           (const char*) glGetString(GL_RENDERER));
+    printf("  \"warmup_frames\": %d,\n", WARMUP_FRAMES);
+    printf("  \"elapsed_s\": %.4f,\n", (end - start) / 1e3);
+    // Including the warmup frames, which the hook captures as well
+    printf("  \"total_s\": %.4f,\n", (end - warmup_start) / 1e3);
+    print_stats("frame_ms", frame_ms, frames, false);
+    print_stats("swap_ms", swap_ms, frames, true);
+    printf("}\n");
+    fflush(stdout);
+
+    glDeleteBuffers(1, &scene);
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglDestroySurface(display, surface);
+    eglTerminate(display);
+    free(frame_ms);
+    free(swap_ms);
+    return 0;
+}
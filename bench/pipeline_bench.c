@@ -0,0 +1,457 @@
+// Pushes frames through the frame queue, the consumer threads and the
+// frame writer without a GL context, so the encoders, queue policies, disk
+// backends and the thread count can be tuned without running a game.
+// Prints throughput, per-stage latency and CPU use as JSON on stdout.
+//
+//   pipeline_bench [threads] [width] [height] [frames] [source]
+//                  [output_dir] [pace]
+//
+// source is "synthetic" for generated frames, or a session directory or
+// frames.dua archive captured earlier, whose frames are replayed in
+// capture order and whose size overrides width and height. frames is how
+// many to push, looping over the source; 0 pushes every source frame
+// once. Recorded frames are decoded up front, up to
+// DEPTH_UPSAMPLE_REPLAY_MB (default 1024) of them, so decoding doesn't
+// count towards the results. pace is one of
+//   fast     - push as fast as the queue takes frames (default)
+//   original - at the recorded capture times, 60 fps for synthetic frames
+//   <fps>    - at a fixed rate
+// How late pushes were against that schedule is reported as replay_lag.
+//
+// Output goes to output_dir, a new directory in /tmp by default. Encoders,
+// queue and output are configured with the same variables as hooks.so:
+// DEPTH_UPSAMPLE_OUTPUT, DEPTH_UPSAMPLE_QUEUE_POLICY,
+// DEPTH_UPSAMPLE_COLOR_FORMAT, DEPTH_UPSAMPLE_DEPTH_FORMAT,
+// DEPTH_UPSAMPLE_PNG_LEVEL, DEPTH_UPSAMPLE_SHM and so on.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "pipe.h"
+#include "frame_consumer.h"
+#include "frame_queue.h"
+#include "frame_replay.h"
+#include "png_encode.h"
+#include "depth_encode.h"
+#include "config.h"
+#include "trace.h"
+
+#define MAX_THREADS 64
+// Distinct synthetic frames cycled through, enough that the encoders
+// don't keep seeing the same image in cache
+#define SYNTHETIC_FRAMES 8
+#define SYNTHETIC_INTERVAL_NS 16666667ull
+#define REPLAY_DEFAULT_MB 1024
+#define DRAIN_TIMEOUT_MS 60000
+
+typedef struct {
+    int width;
+    int height;
+    int count;
+    replay_frame* frames;
+    // From the first frame to where a second loop over them starts
+    uint64_t period;
+} frame_source;
+
+typedef struct {
+    consumer_context context;
+    pthread_t thread;
+    double cpu_s;
+} consumer;
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu_s(const int who) {
+    struct rusage usage;
+    getrusage(who, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+// A smooth lit surface with a little noise on top, which deflates roughly
+// like a rendered frame rather than like a flat color or random bytes
+static void synthesize(frame_source* source, const int width,
+                       const int height) {
+    source->width = width;
+    source->height = height;
+    source->count = SYNTHETIC_FRAMES;
+    source->frames = calloc(SYNTHETIC_FRAMES, sizeof(replay_frame));
+    source->period = SYNTHETIC_FRAMES * SYNTHETIC_INTERVAL_NS;
+    unsigned int seed = 1;
+    for (int k = 0; k < SYNTHETIC_FRAMES; k++) {
+        unsigned char* color = malloc((size_t) width * height * 3);
+        uint16_t* depth = malloc((size_t) width * height * 2);
+        const float phase = k * 0.4f;
+        for (int y = 0; y < height; y++) {
+            const float v = (float) y / height;
+            for (int x = 0; x < width; x++) {
+                const float u = (float) x / width;
+                const float h = 0.5f + 0.25f * sinf(u * 12.0f + phase) *
+                                cosf(v * 9.0f);
+                const size_t j = (size_t) y * width + x;
+                seed = seed * 1103515245u + 12345u;
+                const int noise = (int) ((seed >> 16) & 3) - 2;
+                const int r = (int) (u * 255.0f) + noise;
+                const int g = (int) (h * 255.0f) + noise;
+                const int b = (int) (v * 255.0f) + noise;
+                color[3 * j] = r < 0 ? 0 : r > 255 ? 255 : r;
+                color[3 * j + 1] = g < 0 ? 0 : g > 255 ? 255 : g;
+                color[3 * j + 2] = b < 0 ? 0 : b > 255 ? 255 : b;
+                depth[j] = (uint16_t) (30000.0f + 20000.0f * v +
+                                       8000.0f * (h - 0.5f));
+            }
+        }
+        replay_frame* frame = &(source->frames[k]);
+        frame->ID = k + 1;
+        frame->width = width;
+        frame->height = height;
+        frame->timestamp = k * SYNTHETIC_INTERVAL_NS;
+        frame->color_image = color;
+        frame->depth_image = (unsigned char*) depth;
+    }
+}
+
+// Loose files are stamped when a consumer finished writing them, so a later
+// ID may carry an earlier time than the first frame
+static uint64_t since_first(const frame_source* source,
+                            const replay_frame* frame) {
+    const int64_t offset = (int64_t) (frame->timestamp -
+                                      source->frames[0].timestamp);
+    return offset > 0 ? (uint64_t) offset : 0;
+}
+
+// Decodes up to max_frames frames of the first frame's size, within the
+// DEPTH_UPSAMPLE_REPLAY_MB budget
+static bool load_recording(frame_source* source, const char* path,
+                           const int max_frames) {
+    frame_replay replay;
+    if (!frame_replay_open(&replay, path)) {
+        return false;
+    }
+    const size_t budget = (size_t) config_get_int("DEPTH_UPSAMPLE_REPLAY_MB",
+                                                  REPLAY_DEFAULT_MB) << 20;
+    memset(source, 0, sizeof(frame_source));
+    source->frames = calloc(replay.count ? replay.count : 1,
+                            sizeof(replay_frame));
+    size_t loaded_bytes = 0;
+    replay_frame frame;
+    while ((max_frames <= 0 || source->count < max_frames) &&
+            frame_replay_next(&replay, &frame)) {
+        const size_t frame_bytes = (size_t) frame.width * frame.height * 5;
+        if (source->count > 0 && (frame.width != source->width ||
+                                  frame.height != source->height)) {
+            fprintf(stderr, "Skipping frame %u, it's %dx%d\n", frame.ID,
+                    frame.width, frame.height);
+            replay_frame_free(&frame);
+            continue;
+        }
+        if (source->count > 0 && loaded_bytes + frame_bytes > budget) {
+            fprintf(stderr, "Replaying the first %d frames, the rest don't "
+                    "fit in DEPTH_UPSAMPLE_REPLAY_MB\n", source->count);
+            replay_frame_free(&frame);
+            break;
+        }
+        source->width = frame.width;
+        source->height = frame.height;
+        source->frames[source->count++] = frame;
+        loaded_bytes += frame_bytes;
+    }
+    frame_replay_close(&replay);
+    if (source->count == 0) {
+        fprintf(stderr, "%s has no frames to replay\n", path);
+        return false;
+    }
+
+    // A loop takes as long as the recording plus one average interval
+    uint64_t span = 0;
+    for (int j = 0; j < source->count; j++) {
+        const uint64_t offset = since_first(source, &(source->frames[j]));
+        span = offset > span ? offset : span;
+    }
+    source->period = source->count > 1 ?
+                     span + span / (source->count - 1) :
+                     SYNTHETIC_INTERVAL_NS;
+    return true;
+}
+
+// When push j is due, relative to the start
+static uint64_t push_time(const frame_source* source, const int j,
+                          const bool original, const double fps) {
+    if (original) {
+        const replay_frame* frame = &(source->frames[j % source->count]);
+        return (uint64_t) (j / source->count) * source->period +
+               since_first(source, frame);
+    }
+    return fps > 0.0 ? (uint64_t) (j * 1e9 / fps) : 0;
+}
+
+static void* run_consumer(void* consumer_ptr) {
+    consumer* self = (consumer*) consumer_ptr;
+    frame_consumer_thread(&(self->context));
+    self->cpu_s = cpu_s(RUSAGE_THREAD);
+    return NULL;
+}
+
+static size_t output_bytes;
+
+static int count_file(const char* path, const struct stat* st, int type,
+                      struct FTW* ftw) {
+    (void) path;
+    (void) ftw;
+    if (type == FTW_F) {
+        output_bytes += st->st_size;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const int threads = argc > 1 ? atoi(argv[1]) : 8;
+    const int width = argc > 2 ? atoi(argv[2]) : 1280;
+    const int height = argc > 3 ? atoi(argv[3]) : 720;
+    const int requested_frames = argc > 4 ? atoi(argv[4]) : 200;
+    const char* source_name = argc > 5 ? argv[5] : "synthetic";
+    const char* pace = argc > 7 ? argv[7] : "fast";
+    const bool synthetic = strcmp(source_name, "synthetic") == 0;
+    const bool original = strcmp(pace, "original") == 0;
+    const double fps = original || strcmp(pace, "fast") == 0 ? 0.0 :
+                       atof(pace);
+    if (threads <= 0 || threads > MAX_THREADS || requested_frames < 0 ||
+            (synthetic && (width <= 0 || height <= 0)) ||
+            (!original && strcmp(pace, "fast") != 0 && fps <= 0.0)) {
+        fprintf(stderr, "usage: %s [threads] [width] [height] [frames] "
+                "[synthetic|session|frames.dua] [output_dir] "
+                "[fast|original|fps]\n", argv[0]);
+        return 1;
+    }
+
+    frame_source source;
+    if (synthetic) {
+        synthesize(&source, width, height);
+    } else if (!load_recording(&source, source_name, requested_frames)) {
+        return 1;
+    }
+    const int frames = requested_frames > 0 ? requested_frames :
+                       source.count;
+
+    char output_dir[WRITE_PATH_SIZE];
+    if (argc > 6) {
+        snprintf(output_dir, sizeof(output_dir), "%s/", argv[6]);
+    } else {
+        char template[] = "/tmp/pipeline_bench_XXXXXX";
+        if (!mkdtemp(template)) {
+            fprintf(stderr, "Can't create an output directory\n");
+            return 1;
+        }
+        snprintf(output_dir, sizeof(output_dir), "%s/", template);
+    }
+
+    // Same setup as init_hook_info() in hooks.c
+    trace_enabled = true;
+    pipe_t* pipe = pipe_new(sizeof(buffer_element), 0);
+    frame_pool pool;
+    frame_pool_init(&pool, (size_t) config_get_int(
+                        "DEPTH_UPSAMPLE_QUEUE_MB",
+                        FRAME_POOL_DEFAULT_MB) << 20);
+    frame_queue queue;
+    frame_queue_init(&queue, &pool, pipe);
+
+    const char* output_mode = config_get_str("DEPTH_UPSAMPLE_OUTPUT",
+                                             "files");
+    frame_archive archive;
+    frame_archive* output = NULL;
+    char archive_path[WRITE_PATH_SIZE + sizeof(ARCHIVE_FILE_NAME)];
+    snprintf(archive_path, sizeof(archive_path), "%s%s", output_dir,
+             ARCHIVE_FILE_NAME);
+    if (strcmp(output_mode, "archive") == 0 &&
+            frame_archive_open(&archive, archive_path,
+                               config_get_int("DEPTH_UPSAMPLE_DIRECT_IO",
+                                              0))) {
+        output = &archive;
+    }
+    frame_share share;
+    const bool share_only = strcmp(output_mode, "shm") == 0;
+    frame_share* shared = frame_share_open(&share, share_only) ? &share :
+                          NULL;
+    frame_writer writer;
+    frame_writer_init(&writer);
+    consumer* consumers = calloc(threads, sizeof(consumer));
+    sample_shard* samples = calloc(threads, sizeof(sample_shard));
+    for (int j = 0; j < threads; j++) {
+        consumers[j].context.consumer = pipe_consumer_new(pipe);
+        consumers[j].context.archive = output;
+        consumers[j].context.half_archive = NULL;
+        consumers[j].context.samples = NULL;
+        consumers[j].context.share = shared;
+        consumers[j].context.share_only = share_only && shared;
+        if (strcmp(output_mode, "samples") == 0) {
+            sample_shard_init(&(samples[j]), &writer, output_dir, j);
+            consumers[j].context.samples = &(samples[j]);
+        }
+        consumers[j].context.output_dir = output_dir;
+        consumers[j].context.writer = &writer;
+    }
+    pipe_free(pipe);
+    png_encoder_init();
+
+    size_t input_bytes = 0;
+    const double start = now_s();
+    const double start_cpu = cpu_s(RUSAGE_SELF);
+    for (int j = 0; j < threads; j++) {
+        pthread_create(&(consumers[j].thread), NULL, run_consumer,
+                       &(consumers[j]));
+    }
+
+    const bool paced = original || fps > 0.0;
+    const uint64_t start_ns = trace_now_ns();
+    for (int j = 0; j < frames; j++) {
+        const uint64_t due = push_time(&source, j, original, fps);
+        if (paced) {
+            const uint64_t target = start_ns + due;
+            const struct timespec until = {
+                (time_t) (target / 1000000000ull),
+                (long) (target % 1000000000ull)
+            };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until,
+                                   NULL) == EINTR);
+        }
+
+        bool degraded;
+        frame_buffer* frame;
+        {
+            // Waiting for a consumer to hand a buffer back
+            TRACE_SCOPE("queue_acquire");
+            frame = frame_queue_acquire(&queue, source.width, source.height,
+                                        &degraded);
+        }
+        if (!frame) {
+            continue;
+        }
+        const replay_frame* replayed = &(source.frames[j % source.count]);
+        const size_t pixels = (size_t) source.width * source.height;
+        // A degraded frame only has room for every other pixel of every
+        // other row
+        input_bytes += degraded ? (size_t) half_size(source.width) *
+                       half_size(source.height) * 5 : pixels * 5;
+        if (degraded) {
+            downsample_pixels(frame->color_image, replayed->color_image,
+                              source.width, source.height, 3);
+            downsample_pixels(frame->depth_image, replayed->depth_image,
+                              source.width, source.height, 2);
+        } else {
+            memcpy(frame->color_image, replayed->color_image, pixels * 3);
+            memcpy(frame->depth_image, replayed->depth_image, pixels * 2);
+        }
+
+        buffer_element elem;
+        elem.ID = j + 1;
+        elem.timestamp = trace_now_ns();
+        elem.width = degraded ? half_size(source.width) : source.width;
+        elem.height = degraded ? half_size(source.height) : source.height;
+        elem.color_image = frame->color_image;
+        elem.depth_image = frame->depth_image;
+        elem.frame = frame;
+        elem.half = false;
+        {
+            TRACE_SCOPE("pipe_push");
+            frame_queue_push(&queue, &elem);
+        }
+        if (paced) {
+            // How far behind schedule the frame went into the pipe
+            const uint64_t now = trace_now_ns();
+            const uint64_t lag = now > start_ns + due ?
+                                 now - start_ns - due : 0;
+            trace_record("replay_lag", -1, now - lag, lag);
+        }
+    }
+
+    // Consumers return once the pipe is empty and has no producers left
+    frame_queue_close(&queue);
+    if (queue.reclaimer) {
+        pipe_consumer_free(queue.reclaimer);
+    }
+    for (int j = 0; j < threads; j++) {
+        pthread_join(consumers[j].thread, NULL);
+        pipe_consumer_free(consumers[j].context.consumer);
+    }
+    if (output_mode && strcmp(output_mode, "samples") == 0) {
+        for (int j = 0; j < threads; j++) {
+            sample_shard_flush(&(samples[j]));
+        }
+    }
+    frame_writer_drain(&writer, DRAIN_TIMEOUT_MS);
+    if (output) {
+        frame_archive_close(output);
+    }
+    if (shared) {
+        frame_share_close(shared);
+    }
+    const double elapsed = now_s() - start;
+    const double used_cpu = cpu_s(RUSAGE_SELF) - start_cpu;
+
+    nftw(output_dir, count_file, 16, FTW_PHYS);
+    // What went into the pipe, dropped frames don't count
+    const double input_mb = (double) input_bytes / (1 << 20);
+    const unsigned long pushed = atomic_load(&(queue.pushed));
+
+    printf("{\n");
+    printf("  \"threads\": %d,\n  \"width\": %d,\n  \"height\": %d,\n",
+           threads, source.width, source.height);
+    printf("  \"frames\": %d,\n  \"source_frames\": %d,\n", frames,
+           source.count);
+    printf("  \"pushed\": %lu,\n  \"dropped\": %lu,\n"
+           "  \"degraded\": %lu,\n", pushed, atomic_load(&(queue.dropped)),
+           atomic_load(&(queue.degraded)));
+    printf("  \"source\": \"%s\",\n  \"pace\": \"%s\",\n", source_name,
+           pace);
+    printf("  \"output\": \"%s\",\n", output_mode);
+    printf("  \"output_dir\": \"%s\",\n", output_dir);
+    printf("  \"elapsed_s\": %.4f,\n", elapsed);
+    printf("  \"frames_per_s\": %.2f,\n", pushed / elapsed);
+    printf("  \"input_mb_per_s\": %.2f,\n", input_mb / elapsed);
+    printf("  \"output_bytes\": %zu,\n", output_bytes);
+    printf("  \"output_mb_per_s\": %.2f,\n",
+           (double) output_bytes / (1 << 20) / elapsed);
+    // Cores kept busy on average, and how busy each consumer thread was.
+    // PNG strips are deflated on the PNG worker threads, which only count
+    // towards cores.
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("  \"cpu\": {\"cores\": %.2f, \"online\": %ld, "
+           "\"percent\": %.1f, \"consumer_percent\": [",
+           used_cpu / elapsed, online, used_cpu / elapsed / online * 100.0);
+    for (int j = 0; j < threads; j++) {
+        printf("%.1f%s", consumers[j].cpu_s / elapsed * 100.0,
+               j + 1 < threads ? ", " : "");
+    }
+    printf("]},\n");
+
+    trace_stats stats[TRACE_MAX_SCOPES];
+    int num_stats = trace_collect_stats(stats, TRACE_MAX_SCOPES);
+    if (num_stats > TRACE_MAX_SCOPES) {
+        num_stats = TRACE_MAX_SCOPES;
+    }
+    printf("  \"stages\": {\n");
+    for (int k = 0; k < num_stats; k++) {
+        printf("    \"%s\": {\"count\": %zu, \"p50_us\": %.1f, "
+               "\"p99_us\": %.1f, \"max_us\": %.1f, \"total_ms\": %.1f}%s\n",
+               stats[k].name, stats[k].count, stats[k].p50_us,
+               stats[k].p99_us, stats[k].max_us, stats[k].total_us / 1e3,
+               k + 1 < num_stats ? "," : "");
+    }
+    printf("  }\n}\n");
+    return 0;
+}
@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+
+"""Measures what hooks.so costs bench_app. Every resolution is rendered once
+without the hook and once per capture cadence with it, and the results go
+to a JSON file so that hook versions can be compared:
+
+    bench/run_bench.py --resolutions 1280x720,1920x1080 --every-n 1,30 \\
+        --output bench_results.json
+
+Frame and swap times come from bench_app itself. Time spent in the swap is
+where the hook does its work, so the difference to the run without the hook
+is the stall the application sees. Captured frames are counted by the hook,
+written bytes are whatever ended up in the run's data directory."""
+
+import argparse
+import json
+import os
+import re
+import subprocess
+import tempfile
+import time
+from os.path import abspath, dirname, join
+
+REPO = dirname(dirname(abspath(__file__)))
+CAPTURED = re.compile(r'Captured (\d+) frames, dropped (\d+), degraded (\d+)')
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--hooks', default=join(REPO, 'hooks.so'))
+    parser.add_argument('--app', default=join(REPO, 'bench', 'bench_app'))
+    parser.add_argument('--resolutions', default='640x480,1280x720,1920x1080')
+    parser.add_argument('--every-n', default='1,5,30',
+                        help='DEPTH_UPSAMPLE_EVERY_N values to run')
+    parser.add_argument('--frames', type=int, default=300)
+    parser.add_argument('--grid', type=int, default=256,
+                        help='heightfield size, 2 * grid^2 triangles')
+    parser.add_argument('--repeat', type=int, default=1)
+    parser.add_argument('--hardware', action='store_true',
+                        help="use the GPU instead of llvmpipe")
+    parser.add_argument('--env', action='append', default=[],
+                        metavar='KEY=VALUE',
+                        help='extra hook settings, e.g. '
+                             'DEPTH_UPSAMPLE_OUTPUT=archive')
+    parser.add_argument('--output', default='bench_results.json')
+    return parser.parse_args()
+
+
+def directory_bytes(path):
+    total = 0
+    for root, _, files in os.walk(path):
+        for name in files:
+            file_path = join(root, name)
+            if not os.path.islink(file_path):
+                total += os.path.getsize(file_path)
+    return total
+
+
+def run(args, width, height, every_n):
+    env = dict(os.environ)
+    env['EGL_PLATFORM'] = env.get('EGL_PLATFORM', 'surfaceless')
+    if not args.hardware:
+        env['LIBGL_ALWAYS_SOFTWARE'] = '1'
+    if every_n is not None:
+        # Same environment the depth_upsample launcher sets up
+        env['LD_PRELOAD'] = abspath(args.hooks)
+        env['LD_LIBRARY_PATH'] = join(REPO, 'elfhacks', 'src')
+        env['DEPTH_UPSAMPLE_LOG_LEVEL'] = 'info'
+        env['DEPTH_UPSAMPLE_SCHEDULE'] = 'frames'
+        env['DEPTH_UPSAMPLE_EVERY_N'] = str(every_n)
+        for setting in args.env:
+            key, value = setting.split('=', 1)
+            env[key] = value
+
+    # Each run gets its own data directory to count the bytes in
+    with tempfile.TemporaryDirectory(prefix='depth_upsample_bench_') as cwd:
+        os.mkdir(join(cwd, 'depth_upsample_data'))
+        process = subprocess.run(
+            [abspath(args.app), str(width), str(height), str(args.frames),
+             str(args.grid)],
+            cwd=cwd, env=env, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+            universal_newlines=True, check=True)
+        result = {'width': width, 'height': height, 'every_n': every_n,
+                  'app': json.loads(process.stdout)}
+        if every_n is None:
+            return result
+
+        captured = CAPTURED.search(process.stderr)
+        frames, dropped, degraded = (map(int, captured.groups())
+                                     if captured else (None, None, None))
+        result['captured_frames'] = frames
+        result['dropped_frames'] = dropped
+        result['degraded_frames'] = degraded
+        result['captured_fps'] = (frames / result['app']['total_s']
+                                  if frames is not None else None)
+        result['bytes_written'] = directory_bytes(
+            join(cwd, 'depth_upsample_data'))
+        return result
+
+
+def overhead(result, baseline):
+    """Percent more time per frame and per swap than without the hook."""
+    for key in ('frame_ms', 'swap_ms'):
+        for stat in ('mean', 'p99'):
+            base = baseline['app'][key][stat]
+            hooked = result['app'][key][stat]
+            result.setdefault('overhead', {})[key + '_' + stat] = {
+                'delta_ms': hooked - base,
+                'percent': (hooked - base) / base * 100.0 if base else None
+            }
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(
+            ['git', 'rev-parse', 'HEAD'], cwd=REPO,
+            universal_newlines=True, stderr=subprocess.DEVNULL).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    args = parse_args()
+    resolutions = [tuple(map(int, resolution.split('x')))
+                   for resolution in args.resolutions.split(',')]
+    cadences = [int(every_n) for every_n in args.every_n.split(',')]
+
+    runs = []
+    for width, height in resolutions:
+        for repeat in range(args.repeat):
+            baseline = run(args, width, height, None)
+            baseline['repeat'] = repeat
+            runs.append(baseline)
+            for every_n in cadences:
+                result = run(args, width, height, every_n)
+                result['repeat'] = repeat
+                overhead(result, baseline)
+                runs.append(result)
+                print('{}x{} every {}: {:.2f} ms/frame ({:+.1f}%), '
+                      '{:.2f} ms p99 swap, {} frames, {} bytes'.format(
+                          width, height, every_n,
+                          result['app']['frame_ms']['mean'],
+                          result['overhead']['frame_ms_mean']['percent']
+                          or 0.0,
+                          result['app']['swap_ms']['p99'],
+                          result['captured_frames'],
+                          result['bytes_written']))
+
+    with open(args.output, 'w') as output:
+        json.dump({'hooks': abspath(args.hooks),
+                   'revision': git_revision(),
+                   'timestamp': time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+                   'frames': args.frames,
+                   'grid': args.grid,
+                   'software': not args.hardware,
+                   'env': args.env,
+                   'runs': runs}, output, indent=2)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+
+"""Sweeps pipeline_bench over consumer thread counts, resolutions, PNG
+levels and output formats, and writes every run to a JSON file:
+
+    bench/run_pipeline_bench.py --threads 1,2,4,8 --png-levels 1,6 \\
+        --outputs files,archive --output pipeline_results.json
+
+An output format is DEPTH_UPSAMPLE_OUTPUT, optionally followed by
+:<color format>:<depth format>, e.g. archive:raw:delta. Frames come from
+the synthetic source unless --source points at a captured session
+directory or frames.dua, in which case its resolution is used and --pace
+original replays it at the recorded capture times. Each run writes into a
+fresh temporary directory that is deleted afterwards."""
+
+import argparse
+import json
+import os
+import subprocess
+import tempfile
+import time
+from os.path import abspath, dirname, join
+
+REPO = dirname(dirname(abspath(__file__)))
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--bench',
+                        default=join(REPO, 'bench', 'pipeline_bench'))
+    parser.add_argument('--threads', default='1,2,4,8')
+    parser.add_argument('--resolutions', default='1280x720,1920x1080')
+    parser.add_argument('--png-levels', default='1,6',
+                        help='DEPTH_UPSAMPLE_PNG_LEVEL values to run')
+    parser.add_argument('--outputs', default='files,archive,archive:raw:raw',
+                        help='output[:color format[:depth format]] to run')
+    parser.add_argument('--frames', type=int, default=200)
+    parser.add_argument('--source', default='synthetic')
+    parser.add_argument('--pace', default='fast',
+                        help='fast, original or frames per second')
+    parser.add_argument('--repeat', type=int, default=1)
+    parser.add_argument('--env', action='append', default=[],
+                        metavar='KEY=VALUE',
+                        help='extra settings, e.g. '
+                             'DEPTH_UPSAMPLE_PNG_THREADS=4')
+    parser.add_argument('--output', default='pipeline_results.json')
+    return parser.parse_args()
+
+
+def run(args, threads, width, height, png_level, output):
+    mode, color_format, depth_format = (output.split(':') + [None, None])[:3]
+    env = dict(os.environ)
+    env['DEPTH_UPSAMPLE_OUTPUT'] = mode
+    env['DEPTH_UPSAMPLE_PNG_LEVEL'] = str(png_level)
+    if color_format:
+        env['DEPTH_UPSAMPLE_COLOR_FORMAT'] = color_format
+    if depth_format:
+        env['DEPTH_UPSAMPLE_DEPTH_FORMAT'] = depth_format
+    for setting in args.env:
+        key, value = setting.split('=', 1)
+        env[key] = value
+
+    with tempfile.TemporaryDirectory(prefix='pipeline_bench_') as directory:
+        process = subprocess.run(
+            [abspath(args.bench), str(threads), str(width), str(height),
+             str(args.frames), args.source, directory, args.pace],
+            env=env, stdout=subprocess.PIPE, universal_newlines=True,
+            check=True)
+    result = json.loads(process.stdout)
+    result['png_level'] = png_level
+    result['output'] = output
+    return result
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(
+            ['git', 'rev-parse', 'HEAD'], cwd=REPO,
+            universal_newlines=True, stderr=subprocess.DEVNULL).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    args = parse_args()
+    resolutions = [tuple(map(int, resolution.split('x')))
+                   for resolution in args.resolutions.split(',')]
+    if args.source != 'synthetic':
+        # The recording decides the resolution
+        resolutions = [(0, 0)]
+
+    runs = []
+    for width, height in resolutions:
+        for output in args.outputs.split(','):
+            for png_level in map(int, args.png_levels.split(',')):
+                for threads in map(int, args.threads.split(',')):
+                    for repeat in range(args.repeat):
+                        result = run(args, threads, width, height, png_level,
+                                     output)
+                        result['repeat'] = repeat
+                        runs.append(result)
+                        print('{}x{} {} level {}, {} threads: {:.1f} '
+                              'frames/s, {:.1f} MB/s in, {:.1f} MB/s out, '
+                              '{:.2f} cores'.format(
+                                  result['width'], result['height'], output,
+                                  png_level, threads,
+                                  result['frames_per_s'],
+                                  result['input_mb_per_s'],
+                                  result['output_mb_per_s'],
+                                  result['cpu']['cores']))
+
+    with open(args.output, 'w') as output:
+        json.dump({'bench': abspath(args.bench),
+                   'revision': git_revision(),
+                   'timestamp': time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+                   'frames': args.frames,
+                   'source': args.source,
+                   'pace': args.pace,
+                   'env': args.env,
+                   'runs': runs}, output, indent=2)
+
+
+if __name__ == '__main__':
+    main()
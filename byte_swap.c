@@ -0,0 +1,184 @@
+#include "byte_swap.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define BYTE_SWAP_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+static void swap_bytes16_scalar(unsigned char* dst,
+                                const unsigned char* src,
+                                const size_t count) {
+    for (size_t j = 0; j < count; j++) {
+        const unsigned char low = src[2 * j];
+        dst[2 * j] = src[2 * j + 1];
+        dst[2 * j + 1] = low;
+    }
+}
+
+// Reads the whole pixel before writing it, so dst may trail src
+static void pack_bgra_to_rgb_scalar(unsigned char* dst,
+                                    const unsigned char* src,
+                                    const size_t count) {
+    for (size_t j = 0; j < count; j++) {
+        const unsigned char blue = src[4 * j];
+        const unsigned char green = src[4 * j + 1];
+        const unsigned char red = src[4 * j + 2];
+        dst[3 * j] = red;
+        dst[3 * j + 1] = green;
+        dst[3 * j + 2] = blue;
+    }
+}
+
+#ifdef BYTE_SWAP_X86
+__attribute__((target("avx2")))
+static size_t swap_bytes16_avx2(unsigned char* dst,
+                                const unsigned char* src,
+                                const size_t count) {
+    const __m256i shuffle = _mm256_setr_epi8(
+                                1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t j = 0;
+    for (; j + 16 <= count; j += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + 2 * j));
+        _mm256_storeu_si256((__m256i*)(dst + 2 * j),
+                            _mm256_shuffle_epi8(v, shuffle));
+    }
+    return j;
+}
+
+static size_t swap_bytes16_sse2(unsigned char* dst,
+                                const unsigned char* src,
+                                const size_t count) {
+    size_t j = 0;
+    for (; j + 8 <= count; j += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + 2 * j));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i*)(dst + 2 * j), v);
+    }
+    return j;
+}
+
+// Every iteration loads before it stores, and packed pixels never get
+// ahead of the ones still to be read, so packing in place is safe.
+__attribute__((target("avx2")))
+static size_t pack_bgra_to_rgb_avx2(unsigned char* dst,
+                                    const unsigned char* src,
+                                    const size_t count) {
+    // Packs each lane into its low 12 bytes, then moves them together
+    const __m256i shuffle = _mm256_setr_epi8(
+                                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t j = 0;
+    for (; j + 8 <= count; j += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + 4 * j));
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuffle),
+                                        lanes);
+        _mm_storeu_si128((__m128i*)(dst + 3 * j),
+                         _mm256_castsi256_si128(v));
+        _mm_storel_epi64((__m128i*)(dst + 3 * j + 16),
+                         _mm256_extracti128_si256(v, 1));
+    }
+    return j;
+}
+
+__attribute__((target("ssse3")))
+static size_t pack_bgra_to_rgb_ssse3(unsigned char* dst,
+                                     const unsigned char* src,
+                                     const size_t count) {
+    const __m128i shuffle = _mm_setr_epi8(
+                                2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    size_t j = 0;
+    for (; j + 16 <= count; j += 16) {
+        const unsigned char* in = src + 4 * j;
+        const __m128i a = _mm_shuffle_epi8(
+                              _mm_loadu_si128((const __m128i*) in), shuffle);
+        const __m128i b = _mm_shuffle_epi8(
+                              _mm_loadu_si128((const __m128i*)(in + 16)),
+                              shuffle);
+        const __m128i c = _mm_shuffle_epi8(
+                              _mm_loadu_si128((const __m128i*)(in + 32)),
+                              shuffle);
+        const __m128i d = _mm_shuffle_epi8(
+                              _mm_loadu_si128((const __m128i*)(in + 48)),
+                              shuffle);
+        // Four 12-byte runs make three full vectors
+        unsigned char* out = dst + 3 * j;
+        _mm_storeu_si128((__m128i*) out,
+                         _mm_or_si128(a, _mm_slli_si128(b, 12)));
+        _mm_storeu_si128((__m128i*)(out + 16),
+                         _mm_or_si128(_mm_srli_si128(b, 4),
+                                      _mm_slli_si128(c, 8)));
+        _mm_storeu_si128((__m128i*)(out + 32),
+                         _mm_or_si128(_mm_srli_si128(c, 8),
+                                      _mm_slli_si128(d, 4)));
+    }
+    return j;
+}
+#elif defined(__ARM_NEON)
+static size_t swap_bytes16_neon(unsigned char* dst,
+                                const unsigned char* src,
+                                const size_t count) {
+    size_t j = 0;
+    for (; j + 8 <= count; j += 8) {
+        vst1q_u8(dst + 2 * j, vrev16q_u8(vld1q_u8(src + 2 * j)));
+    }
+    return j;
+}
+
+// vld4q reads all 16 pixels before vst3q writes, so dst may trail src
+static size_t pack_bgra_to_rgb_neon(unsigned char* dst,
+                                    const unsigned char* src,
+                                    const size_t count) {
+    size_t j = 0;
+    for (; j + 16 <= count; j += 16) {
+        const uint8x16x4_t bgra = vld4q_u8(src + 4 * j);
+        uint8x16x3_t rgb;
+        rgb.val[0] = bgra.val[2];
+        rgb.val[1] = bgra.val[1];
+        rgb.val[2] = bgra.val[0];
+        vst3q_u8(dst + 3 * j, rgb);
+    }
+    return j;
+}
+#endif
+
+void swap_bytes16(unsigned char* dst,
+                  const unsigned char* src,
+                  const size_t count) {
+    size_t done = 0;
+#if defined(BYTE_SWAP_X86)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0) {
+        has_avx2 = __builtin_cpu_supports("avx2");
+    }
+    done = has_avx2 ? swap_bytes16_avx2(dst, src, count) :
+           swap_bytes16_sse2(dst, src, count);
+#elif defined(__ARM_NEON)
+    done = swap_bytes16_neon(dst, src, count);
+#endif
+    swap_bytes16_scalar(dst + 2 * done, src + 2 * done, count - done);
+}
+
+void pack_bgra_to_rgb(unsigned char* dst,
+                      const unsigned char* src,
+                      const size_t count) {
+    size_t done = 0;
+#if defined(BYTE_SWAP_X86)
+    static int level = -1;
+    if (level < 0) {
+        level = __builtin_cpu_supports("avx2") ? 2 :
+                __builtin_cpu_supports("ssse3") ? 1 : 0;
+    }
+    if (level == 2) {
+        done = pack_bgra_to_rgb_avx2(dst, src, count);
+    } else if (level == 1) {
+        done = pack_bgra_to_rgb_ssse3(dst, src, count);
+    }
+#elif defined(__ARM_NEON)
+    done = pack_bgra_to_rgb_neon(dst, src, count);
+#endif
+    pack_bgra_to_rgb_scalar(dst + 3 * done, src + 4 * done, count - done);
+}
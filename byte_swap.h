@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stddef.h>
+
+// Swaps the two bytes of each of count 16-bit samples, turning the
+// little-endian depth we read back into the big-endian order PGM and PNG
+// expect. dst and src may be the same buffer. Picks AVX2, SSE2 or NEON at
+// run time, with a scalar loop for the tail and for other targets.
+void swap_bytes16(unsigned char* dst,
+                  const unsigned char* src,
+                  const size_t count);
+// Packs count BGRA8 pixels into RGB8, dropping alpha, so color can be read
+// back in the layout drivers transfer without converting. dst and src may
+// be the same buffer. Picks AVX2, SSSE3 or NEON at run time like
+// swap_bytes16().
+void pack_bgra_to_rgb(unsigned char* dst,
+                      const unsigned char* src,
+                      const size_t count);
@@ -0,0 +1,160 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "capture_context.h"
+#include "log.h"
+
+// Open addressing with linear probing. Slots are claimed with a CAS on the
+// key and never move, removed keys leave a tombstone behind so lookups
+// keep probing past them. Inserts reuse tombstones, and removals turn the
+// ones that end at an empty slot back into empty slots. Lookups never
+// lock, inserts and removals are rare and take writer_lock.
+#define EMPTY_KEY 0
+#define TOMBSTONE_KEY 1
+
+static _Atomic uintptr_t keys[CAPTURE_CONTEXT_MAP_SIZE];
+static _Atomic(capture_context*) values[CAPTURE_CONTEXT_MAP_SIZE];
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool warned_full;
+
+static __thread capture_context* current;
+
+static unsigned int hash_context(const void* ctx) {
+    // Allocations are at least 16 byte aligned
+    return (unsigned int) (((uintptr_t) ctx >> 4) * 2654435761u) %
+           CAPTURE_CONTEXT_MAP_SIZE;
+}
+
+static int find_slot(const void* ctx) {
+    const unsigned int start = hash_context(ctx);
+    for (unsigned int j = 0; j < CAPTURE_CONTEXT_MAP_SIZE; j++) {
+        const unsigned int slot = (start + j) % CAPTURE_CONTEXT_MAP_SIZE;
+        const uintptr_t key = atomic_load(&(keys[slot]));
+        if (key == (uintptr_t) ctx) {
+            return slot;
+        }
+        if (key == EMPTY_KEY) {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static bool insert(capture_context* context) {
+    const unsigned int start = hash_context(context->context);
+    bool inserted = false;
+    pthread_mutex_lock(&writer_lock);
+    for (unsigned int j = 0; j < CAPTURE_CONTEXT_MAP_SIZE && !inserted;
+            j++) {
+        const unsigned int slot = (start + j) % CAPTURE_CONTEXT_MAP_SIZE;
+        uintptr_t key = atomic_load(&(keys[slot]));
+        while (key == EMPTY_KEY || key == TOMBSTONE_KEY) {
+            if (atomic_compare_exchange_weak(&(keys[slot]), &key,
+                                             (uintptr_t) context->context)) {
+                atomic_store(&(values[slot]), context);
+                inserted = true;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&writer_lock);
+    return inserted;
+}
+
+// A probe that reaches a tombstone right before an empty slot ends at that
+// empty slot anyway, so the tombstone and every one before it can become
+// empty again. No key can sit past an empty slot in its own probe, which
+// keeps concurrent lookups correct. Without this, once every slot had been
+// used, each miss would scan the whole map.
+static void reclaim_tombstones(unsigned int slot) {
+    const unsigned int next = (slot + 1) % CAPTURE_CONTEXT_MAP_SIZE;
+    if (atomic_load(&(keys[next])) != EMPTY_KEY) {
+        return;
+    }
+    while (atomic_load(&(keys[slot])) == TOMBSTONE_KEY) {
+        atomic_store(&(keys[slot]), EMPTY_KEY);
+        slot = (slot + CAPTURE_CONTEXT_MAP_SIZE - 1) %
+               CAPTURE_CONTEXT_MAP_SIZE;
+    }
+}
+
+static capture_context* create(void* ctx) {
+    capture_context* context = calloc(1, sizeof(capture_context));
+    if (!context) {
+        return NULL;
+    }
+    context->context = ctx;
+    // Until the drawable or a viewport tells us the real size
+    context->width = 100;
+    context->height = 100;
+    atomic_init(&(context->refs), 1);
+    atomic_init(&(context->destroyed), false);
+    capture_schedule_init(&(context->schedule));
+
+    if (!insert(context)) {
+        if (!atomic_exchange(&warned_full, true)) {
+            LOG_WARN("Tracking %d contexts already, not capturing new ones",
+                     CAPTURE_CONTEXT_MAP_SIZE);
+        }
+        free(context);
+        return NULL;
+    }
+    LOG_DEBUG("Tracking context %p", ctx);
+    return context;
+}
+
+capture_context* capture_context_current() {
+    return current;
+}
+
+capture_context* capture_context_make_current(void* ctx) {
+    capture_context* previous = current;
+    if (previous && previous->context == ctx &&
+            !atomic_load(&(previous->destroyed))) {
+        return previous;
+    }
+
+    capture_context* context = NULL;
+    if (ctx) {
+        const int slot = find_slot(ctx);
+        context = slot >= 0 ? atomic_load(&(values[slot])) : NULL;
+        if (!context) {
+            context = create(ctx);
+        }
+        if (context) {
+            atomic_fetch_add(&(context->refs), 1);
+        }
+    }
+
+    current = context;
+    gl_state_bind(context ? &(context->state) : NULL);
+    if (previous) {
+        capture_context_release(previous);
+    }
+    return context;
+}
+
+capture_context* capture_context_remove(void* ctx) {
+    pthread_mutex_lock(&writer_lock);
+    const int slot = find_slot(ctx);
+    if (slot < 0) {
+        pthread_mutex_unlock(&writer_lock);
+        return NULL;
+    }
+    capture_context* context = atomic_exchange(&(values[slot]), NULL);
+    atomic_store(&(keys[slot]), TOMBSTONE_KEY);
+    reclaim_tombstones(slot);
+    pthread_mutex_unlock(&writer_lock);
+    if (context) {
+        atomic_store(&(context->destroyed), true);
+        LOG_DEBUG("Context %p destroyed", ctx);
+    }
+    return context;
+}
+
+void capture_context_release(capture_context* context) {
+    if (atomic_fetch_sub(&(context->refs), 1) == 1) {
+        free(context);
+    }
+}
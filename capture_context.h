@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "capture_pbo.h"
+#include "capture_schedule.h"
+#include "gl_state.h"
+
+// Contexts we can follow at once. A context that doesn't fit is rendered
+// normally but never captured.
+#define CAPTURE_CONTEXT_MAP_SIZE 256
+
+// Everything the capture path keeps for one GLXContext or EGLContext, keyed
+// by the handle. GLX and EGL both let a context be current on one thread at
+// a time, so only that thread touches the fields below refs and destroyed.
+typedef struct {
+    void* context;
+    // One reference held by the map, one by the thread it is current on
+    atomic_int refs;
+    // The context was destroyed, the entry stays usable until released
+    atomic_bool destroyed;
+    // GLXDrawable or EGLSurface the context was last made current with
+    uintptr_t drawable;
+    GLsizei width;
+    GLsizei height;
+    pbo_ring ring;
+    capture_schedule schedule;
+    gl_state state;
+} capture_context;
+
+// The context made current on the calling thread, NULL if there is none
+// or it couldn't be tracked
+capture_context* capture_context_current();
+// Looks ctx up in the map, creating its entry on first use, and makes it
+// the calling thread's current context. Drops the reference to the context
+// that was current before. A NULL ctx just releases the current one.
+capture_context* capture_context_make_current(void* ctx);
+// Takes ctx out of the map and marks it destroyed. Returns the entry so
+// the caller can free its GL objects while the context is still current,
+// and must hand it to capture_context_release() afterwards.
+capture_context* capture_context_remove(void* ctx);
+void capture_context_release(capture_context* context);
@@ -1,9 +1,16 @@
+#include <time.h>
+
 #include "capture_pbo.h"
+#include "log.h"
+#include "trace.h"
+#include "config.h"
+#include "gl_state.h"
+#include "byte_swap.h"
 
 void check_err() {
     GLenum err = glGetError();
 
-    printf("Checking for errors...\n");
+    LOG_DEBUG("Checking for errors...");
     while (err != GL_NO_ERROR) {
         char* error;
 
@@ -25,161 +32,608 @@ void check_err() {
                 break;
         }
 
-        printf("GL_%s\n", error);
+        LOG_ERROR("GL_%s", error);
+        log_flush();
         exit(1);
         err = glGetError();
     }
-    printf("No errors found\n");
-}
-
-void create_pbo(GLuint* color_pbo,
-                GLuint* depth_pbo) {
-    glGenBuffers(1, color_pbo);
-    glGenBuffers(1, depth_pbo);
-    glBindBuffer(GL_PIXEL_PACK_BUFFER, *color_pbo);
-    glBufferData(GL_PIXEL_PACK_BUFFER, COLOR_TEXTURE_MAX_SIZE, NULL,
-                 GL_DYNAMIC_DRAW);
-    glBindBuffer(GL_PIXEL_PACK_BUFFER, *depth_pbo);
-    glBufferData(GL_PIXEL_PACK_BUFFER, COLOR_TEXTURE_MAX_SIZE, NULL,
-                 GL_DYNAMIC_DRAW);
-    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-}
-
-void create_textures(GLuint* color_texture,
-                     GLuint* depth_texture,
-                     const GLsizei x_res,
-                     const GLsizei y_res) {
-    printf("Creating textures....\n");
-    glGenTextures(1, color_texture);
-    glGenTextures(1, depth_texture);
-    glBindTexture(GL_TEXTURE_2D, *color_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, x_res, y_res, 0, GL_BGRA,
-                 GL_UNSIGNED_BYTE, 0);
-    glBindTexture(GL_TEXTURE_2D, *depth_texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16, x_res, y_res, 0,
-                 GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, 0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-}
-
-void read_into_pbo(const GLuint pbo[2],
-                   const GLsizei x_res,
-                   const GLsizei y_res) {
-    printf("Reading pixels... (%i, %i)\n", x_res, y_res);
-    glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[0]);
-    glReadPixels(0, 0, x_res, y_res, GL_BGRA, GL_UNSIGNED_BYTE, 0);
-    glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[1]);
-    glReadPixels(0, 0, x_res, y_res, GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, 0);
-    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-}
-
-void update_textures_from_pbo(const GLuint pbo[2],
-                              const GLuint textures[2],
-                              const GLsizei x_res,
-                              const GLsizei y_res) {
-    GLint old_unpack_alignment;
-    glGetIntegerv(GL_UNPACK_ALIGNMENT, &old_unpack_alignment);
-    printf("Updating textures....\n");
-    //glMemoryBarrier(GL_ALL_BARRIER_BITS);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glBindTexture(GL_TEXTURE_2D, textures[0]);
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[0]);
-    glTexSubImage2D(GL_TEXTURE_2D, 0,
-                    0, 0, x_res, y_res,
-                    GL_BGRA, GL_UNSIGNED_BYTE, 0);
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[1]);
-    glBindTexture(GL_TEXTURE_2D, textures[1]);
-    glTexSubImage2D(GL_TEXTURE_2D, 0,
-                    0, 0, x_res, y_res,
-                    GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, 0);
-    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, old_unpack_alignment);
+    LOG_DEBUG("No errors found");
 }
 
-void write_image(const GLsizei x_res,
-                 const GLsizei y_res,
-                 const GLuint textures[2],
-                 const unsigned int ID,
-                 pipe_producer_t* producer) {
-    //glMemoryBarrier(GL_ALL_BARRIER_BITS);
-
-    glBindTexture(GL_TEXTURE_2D, textures[0]);
-    glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 0, 0, x_res, y_res, 0);
-
-    glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    uchar* raw_img = (uchar*) malloc(x_res * y_res * 3 * sizeof(uchar));
-    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGB, GL_UNSIGNED_BYTE, raw_img);
-
-    glBindTexture(GL_TEXTURE_2D, textures[1]);
-    glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 0, 0, x_res, y_res, 0);
-    uchar* depth_img = (uchar*) malloc(x_res * y_res * sizeof(unsigned short));
-    glGetTexImage(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT,
-                  depth_img);
-
-    buffer_element* elem = (buffer_element*) malloc(sizeof(buffer_element));
-    elem->ID = ID;
-    elem->width = x_res;
-    elem->height = y_res;
-    elem->color_image = raw_img;
-    elem->depth_image = depth_img;
-
-    printf("Pushing ID %i of size (%i, %i) into pipe\n", ID, x_res, y_res);
-    printf("Color image pointer: %li\n", elem->color_image);
-    printf("Depth image pointer: %li\n", elem->depth_image);
-    pipe_push(producer, elem, 1);
-}
-
-void* frame_consumer_thread(void* consumer_ptr) {
-    pipe_consumer_t* consumer = (pipe_consumer_t*) consumer_ptr;
-
-    buffer_element* elem = (buffer_element*) malloc(sizeof(buffer_element));
-    elem->ID = 1;
-    while (elem->ID != 0) {
-        if (!pipe_pop(consumer, elem, 1)) {
-            printf("Failed to pop anything!\n");
+downsample_mode downsample_default_mode() {
+    const char* mode = config_get_str("DEPTH_UPSAMPLE_GPU_DOWNSAMPLE", "off");
+    if (strcmp(mode, "both") == 0) {
+        return DOWNSAMPLE_BOTH;
+    } else if (strcmp(mode, "only") == 0) {
+        return DOWNSAMPLE_ONLY;
+    } else if (strcmp(mode, "off") != 0) {
+        LOG_WARN("Unknown downsample mode %s, using off", mode);
+    }
+    return DOWNSAMPLE_OFF;
+}
+
+GLenum color_readback_format() {
+    const char* format = config_get_str("DEPTH_UPSAMPLE_COLOR_READBACK",
+                                        "bgra");
+    if (strcmp(format, "rgb") == 0) {
+        return GL_RGB;
+    } else if (strcmp(format, "bgra") != 0) {
+        LOG_WARN("Unknown color readback %s, using bgra", format);
+    }
+    return GL_BGRA;
+}
+
+static size_t color_pixel_size(const pbo_ring* ring) {
+    return ring->color_format == GL_BGRA ? 4 : 3;
+}
+
+static const char* vertex_shader =
+    "void main() {\n"
+    "    // One triangle that covers the whole viewport\n"
+    "    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+    "    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char* fragment_shader =
+    "uniform sampler2D color_texture;\n"
+    "uniform sampler2D depth_texture;\n"
+    "uniform ivec2 source_size;\n"
+    "uniform bool downsample;\n"
+    "out vec4 color;\n"
+    "out vec4 depth;\n"
+    "void main() {\n"
+    "    ivec2 target = ivec2(gl_FragCoord.xy);\n"
+    "    ivec2 source = target;\n"
+    "    if (downsample) {\n"
+    "        // Even columns, and every other row counted from the top.\n"
+    "        // rows is half_size(source_size.y).\n"
+    "        int rows = max(source_size.y / 2 +\n"
+    "                       (source_size.y % 4 == 3 ? 1 : 0), 1);\n"
+    "        source = ivec2(2 * target.x,\n"
+    "                       source_size.y - 1 - 2 * (rows - 1 - target.y));\n"
+    "    }\n"
+    "    color = texelFetch(color_texture, source, 0);\n"
+    "    depth = vec4(texelFetch(depth_texture, source, 0).r);\n"
+    "}\n";
+
+static GLuint compile_shader(const GLenum type,
+                             const char* version,
+                             const char* source) {
+    const char* sources[2] = {version, source};
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 2, sources, NULL);
+    glCompileShader(shader);
+
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (!status) {
+        char info[512];
+        glGetShaderInfoLog(shader, sizeof(info), NULL, info);
+        LOG_DEBUG("Shader failed to compile with %s%s", version, info);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// Builds the downsample program, returning 0 if the context can't run it.
+// GLSL 1.30 covers compatibility contexts, 1.50 core profile ones.
+GLuint create_shaders() {
+    static const char* versions[] = {"#version 130\n", "#version 150\n"};
+    for (size_t j = 0; j < sizeof(versions) / sizeof(versions[0]); j++) {
+        GLuint vertex = compile_shader(GL_VERTEX_SHADER, versions[j],
+                                       vertex_shader);
+        GLuint fragment = compile_shader(GL_FRAGMENT_SHADER, versions[j],
+                                         fragment_shader);
+        if (!vertex || !fragment) {
+            glDeleteShader(vertex);
+            glDeleteShader(fragment);
+            continue;
         }
 
-        printf("%u\n", elem->ID);
-        printf("Found color image pointer: %li\n", elem->color_image);
-
-        char color_file_path[300];
-        char depth_file_path[300];
-        char file_name[50];
-        memset(color_file_path, 0, sizeof(color_file_path));
-        memset(depth_file_path, 0, sizeof(depth_file_path));
-        memset(file_name, 0, sizeof(file_name));
-        strcat(color_file_path, DEPTH_UPSAMPLE_DIR);
-        strcat(depth_file_path, DEPTH_UPSAMPLE_DIR);
-        snprintf(file_name, sizeof(file_name), "%u", elem->ID);
-        strcat(color_file_path, file_name);
-        strcat(depth_file_path, file_name);
-        strcat(color_file_path, "_color.png");
-        strcat(depth_file_path, "_depth.pgm");
-
-        FILE* fp = fopen(color_file_path, "wb");
-        size_t data_length;
-        void* data = tdefl_write_image_to_png_file_in_memory(
-                         elem->color_image,
-                         elem->width, elem->height, 3,
-                         &data_length);
-        fwrite(data, 1, data_length, fp);
-        fclose(fp);
-
-        FILE* fp_depth = fopen(depth_file_path, "wb");
-        fprintf(fp_depth, "P5 %d %d %d\n", elem->width, elem->height, 65535);
-
-        // Convert from little endian to big endian
-        for (int j = 0; j < elem->height; j++) {
-            for (int i = 0; i < elem->width; i++) {
-                fwrite(elem->depth_image + 2 * (j * elem->width + i) + 1, 1,
-                       sizeof(unsigned char), fp_depth);
-                fwrite(elem->depth_image + 2 * (j * elem->width + i), 1,
-                       sizeof(unsigned char), fp_depth);
+        GLuint prog_id = glCreateProgram();
+        glAttachShader(prog_id, vertex);
+        glAttachShader(prog_id, fragment);
+        glBindFragDataLocation(prog_id, 0, "color");
+        glBindFragDataLocation(prog_id, 1, "depth");
+        glLinkProgram(prog_id);
+        glDeleteShader(vertex);
+        glDeleteShader(fragment);
+
+        GLint status;
+        glGetProgramiv(prog_id, GL_LINK_STATUS, &status);
+        if (status) {
+            return prog_id;
+        }
+        glDeleteProgram(prog_id);
+    }
+    LOG_WARN("Can't build the downsample shaders");
+    return 0;
+}
+
+void create_pbo_ring(pbo_ring* ring,
+                     const int size,
+                     frame_queue* queue) {
+    memset(ring, 0, sizeof(pbo_ring));
+    ring->queue = queue;
+    ring->size = size;
+    ring->color_format = color_readback_format();
+    if (ring->size < 1) {
+        ring->size = 1;
+    } else if (ring->size > PBO_RING_MAX_SIZE) {
+        ring->size = PBO_RING_MAX_SIZE;
+    }
+
+    for (int j = 0; j < ring->size; j++) {
+        glGenBuffers(1, &(ring->slots[j].color_pbo));
+        glGenBuffers(1, &(ring->slots[j].depth_pbo));
+    }
+
+    downsample_pass* pass = &(ring->downsample);
+    pass->mode = downsample_default_mode();
+    if (pass->mode == DOWNSAMPLE_OFF) {
+        return;
+    }
+    pass->program = create_shaders();
+    if (!pass->program) {
+        // Keep capturing something rather than nothing
+        pass->mode = DOWNSAMPLE_OFF;
+        return;
+    }
+    glGenVertexArrays(1, &(pass->vao));
+    glGenTextures(2, pass->source_textures);
+    glGenTextures(2, pass->target_textures);
+    glGenFramebuffers(1, &(pass->target_fbo));
+    for (int j = 0; j < ring->size; j++) {
+        glGenBuffers(1, &(ring->slots[j].half_color_pbo));
+        glGenBuffers(1, &(ring->slots[j].half_depth_pbo));
+    }
+}
+
+// PBOs are sized for the current resolution instead of the 4K maximum and
+// only grow when the window does.
+static void reserve_pbo(const GLuint pbo,
+                        GLsizeiptr* capacity,
+                        const GLsizeiptr size) {
+    gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, pbo);
+    if (*capacity < size) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+        *capacity = size;
+    }
+}
+
+// A color/depth pair of PBOs, mapped for reading. Each pair is mapped
+// once per frame, for the dedup signature and the copies alike.
+typedef struct {
+    GLuint color_pbo;
+    GLuint depth_pbo;
+    GLsizei width;
+    GLsizei height;
+    const uchar* color;
+    const uchar* depth;
+} mapped_pair;
+
+static const uchar* map_pbo(const GLuint pbo, const size_t size) {
+    gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, pbo);
+    return (const uchar*) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size,
+                                           GL_MAP_READ_BIT);
+}
+
+static bool map_pair(const pbo_ring* ring,
+                     mapped_pair* pair,
+                     const GLuint color_pbo,
+                     const GLuint depth_pbo,
+                     const GLsizei width,
+                     const GLsizei height) {
+    const size_t pixels = (size_t) width * height;
+    pair->color_pbo = color_pbo;
+    pair->depth_pbo = depth_pbo;
+    pair->width = width;
+    pair->height = height;
+    pair->color = map_pbo(color_pbo, pixels * color_pixel_size(ring));
+    pair->depth = map_pbo(depth_pbo, pixels * sizeof(unsigned short));
+    return pair->color && pair->depth;
+}
+
+// Only unmaps what was mapped, unmapping a buffer that isn't is an error
+static void unmap_pair(mapped_pair* pair) {
+    if (pair->color) {
+        gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, pair->color_pbo);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        pair->color = NULL;
+    }
+    if (pair->depth) {
+        gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, pair->depth_pbo);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        pair->depth = NULL;
+    }
+}
+
+static void copy_pixels(uchar* dst,
+                        const uchar* mapped,
+                        const GLsizei x_res,
+                        const GLsizei y_res,
+                        const size_t pixel_size,
+                        const bool degraded) {
+    if (degraded) {
+        downsample_pixels(dst, mapped, x_res, y_res, pixel_size);
+    } else {
+        memcpy(dst, mapped, (size_t) x_res * y_res * pixel_size);
+    }
+}
+
+// Color always leaves as packed RGB8. A BGRA readback is packed in the
+// same pass that copies it out of the PBO, degraded frames pick the same
+// pixels as downsample_pixels().
+static void copy_color(uchar* dst,
+                       const uchar* mapped,
+                       const GLsizei x_res,
+                       const GLsizei y_res,
+                       const GLenum format,
+                       const bool degraded) {
+    if (format != GL_BGRA) {
+        copy_pixels(dst, mapped, x_res, y_res, 3 * sizeof(uchar), degraded);
+        return;
+    }
+    if (degraded) {
+        const GLsizei out_x = half_size(x_res);
+        const GLsizei out_y = half_size(y_res);
+        for (GLsizei y = 0; y < out_y; y++) {
+            const GLsizei src_y = y_res - 1 - 2 * (out_y - 1 - y);
+            const uchar* src_row = mapped + (size_t) src_y * x_res * 4;
+            uchar* dst_row = dst + (size_t) y * out_x * 3;
+            for (GLsizei x = 0; x < out_x; x++) {
+                dst_row[3 * x] = src_row[8 * x + 2];
+                dst_row[3 * x + 1] = src_row[8 * x + 1];
+                dst_row[3 * x + 2] = src_row[8 * x];
             }
         }
-        fclose(fp_depth);
+    } else {
+        pack_bgra_to_rgb(dst, mapped, (size_t) x_res * y_res);
+    }
+}
+
+// Copies one mapped color/depth pair into a pool frame and queues it. A
+// degraded frame only has room for half the pair, which is decimated.
+static void push_frame(pbo_ring* ring,
+                       const pbo_slot* slot,
+                       const mapped_pair* pair,
+                       const bool half) {
+    const GLsizei width = pair->width;
+    const GLsizei height = pair->height;
+    bool degraded;
+    frame_buffer* frame = frame_queue_acquire(ring->queue, width, height,
+                                              &degraded);
+    if (!frame) {
+        LOG_DEBUG("Dropping ID %u", slot->ID);
+        return;
+    }
+
+    copy_color(frame->color_image, pair->color, width, height,
+               ring->color_format, degraded);
+    copy_pixels(frame->depth_image, pair->depth, width, height,
+                sizeof(unsigned short), degraded);
+
+    buffer_element elem;
+    elem.ID = slot->ID;
+    elem.timestamp = slot->timestamp;
+    elem.width = degraded ? half_size(width) : width;
+    elem.height = degraded ? half_size(height) : height;
+    elem.color_image = frame->color_image;
+    elem.depth_image = frame->depth_image;
+    elem.frame = frame;
+    elem.half = half;
+
+    LOG_DEBUG("Pushing ID %u of size (%i, %i) into pipe",
+              elem.ID, elem.width, elem.height);
+    {
+        TRACE_SCOPE("pipe_push");
+        frame_queue_push(ring->queue, &elem);
+    }
+}
+
+// Signs the smallest copy of the frame there is, the GPU downsampled one
+// if the pass ran
+static bool is_duplicate(pbo_ring* ring,
+                         const pbo_slot* slot,
+                         const mapped_pair* pair) {
+    TRACE_SCOPE("dedup_signature");
+    frame_signature signature;
+    frame_signature_compute(&signature, pair->color, pair->depth,
+                            pair->width, pair->height,
+                            ring->color_format == GL_BGRA);
+    return frame_dedup_check(&(ring->dedup), &signature, slot->ID);
+}
+
+static void retire_pbo_slot(pbo_ring* ring,
+                            pbo_slot* slot) {
+    TRACE_SCOPE("retire_pbo_slot");
+    glDeleteSync(slot->fence);
+    slot->fence = NULL;
+    const GLuint pack_buffer = gl_state_current()->pack_buffer;
+
+    const downsample_mode mode = ring->downsample.mode;
+    mapped_pair full = {0};
+    mapped_pair half = {0};
+    const bool mapped =
+        (mode == DOWNSAMPLE_ONLY ||
+         map_pair(ring, &full, slot->color_pbo, slot->depth_pbo,
+                  slot->width, slot->height)) &&
+        (mode == DOWNSAMPLE_OFF ||
+         map_pair(ring, &half, slot->half_color_pbo, slot->half_depth_pbo,
+                  half_size(slot->width), half_size(slot->height)));
+    if (!mapped) {
+        LOG_WARN("Can't map the readback of frame %u, dropping it",
+                 slot->ID);
+        atomic_fetch_add(&(ring->queue->dropped), 1);
+    } else if (frame_dedup_mode() != DEDUP_OFF &&
+               is_duplicate(ring, slot,
+                            mode == DOWNSAMPLE_OFF ? &full : &half)) {
+        LOG_DEBUG("Dropping duplicate ID %u", slot->ID);
+    } else {
+        if (mode != DOWNSAMPLE_ONLY) {
+            push_frame(ring, slot, &full, false);
+        }
+        if (mode != DOWNSAMPLE_OFF) {
+            push_frame(ring, slot, &half, true);
+        }
+    }
+    unmap_pair(&full);
+    unmap_pair(&half);
+    gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, pack_buffer);
+}
+
+// The readback behind a fence that can't be waited on, after a context
+// loss for instance, is never coming. Its slot is freed for the next one.
+static void drop_pbo_slot(pbo_ring* ring, pbo_slot* slot) {
+    LOG_WARN("Readback of frame %u failed, dropping it", slot->ID);
+    glDeleteSync(slot->fence);
+    slot->fence = NULL;
+    atomic_fetch_add(&(ring->queue->dropped), 1);
+    ring->retired++;
+}
+
+bool retire_pbo_ring(pbo_ring* ring, const bool wait) {
+    gpu_trace_collect(&(ring->gpu_timer));
+    while (ring->retired != ring->issued) {
+        pbo_slot* slot = &(ring->slots[ring->retired % ring->size]);
+
+        GLenum status = glClientWaitSync(slot->fence,
+                                         wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0,
+                                         wait ? GL_TIMEOUT_IGNORED : 0);
+        if (status == GL_WAIT_FAILED ||
+                (wait && status == GL_TIMEOUT_EXPIRED)) {
+            drop_pbo_slot(ring, slot);
+            return false;
+        }
+        if (status != GL_ALREADY_SIGNALED &&
+                status != GL_CONDITION_SATISFIED) {
+            // Slots complete in order, so nothing behind this one is ready
+            return true;
+        }
+
+        retire_pbo_slot(ring, slot);
+        ring->retired++;
+        // Only block for as long as it takes to free up a single slot
+        if (wait) {
+            return true;
+        }
+    }
+    return true;
+}
+
+void flush_pbo_ring(pbo_ring* ring) {
+    // Every call retires or drops one slot
+    const unsigned int in_flight = ring->issued - ring->retired;
+    for (unsigned int j = 0; j < in_flight; j++) {
+        retire_pbo_ring(ring, true);
+    }
+}
+
+void destroy_pbo_ring(pbo_ring* ring) {
+    flush_pbo_ring(ring);
+    gpu_trace_destroy(&(ring->gpu_timer));
+
+    for (int j = 0; j < ring->size; j++) {
+        pbo_slot* slot = &(ring->slots[j]);
+        glDeleteBuffers(1, &(slot->color_pbo));
+        glDeleteBuffers(1, &(slot->depth_pbo));
+        if (slot->half_color_pbo) {
+            glDeleteBuffers(1, &(slot->half_color_pbo));
+            glDeleteBuffers(1, &(slot->half_depth_pbo));
+        }
+    }
+
+    downsample_pass* pass = &(ring->downsample);
+    if (pass->program) {
+        glDeleteProgram(pass->program);
+        glDeleteVertexArrays(1, &(pass->vao));
+        glDeleteTextures(2, pass->source_textures);
+        glDeleteTextures(2, pass->target_textures);
+        glDeleteFramebuffers(1, &(pass->target_fbo));
+    }
+    memset(ring, 0, sizeof(pbo_ring));
+}
+
+// Wall-clock capture time in nanoseconds, stored with archived frames
+static uint64_t capture_timestamp() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void allocate_texture(const GLuint texture,
+                             const GLint internal_format,
+                             const GLenum format,
+                             const GLenum type,
+                             const GLsizei width,
+                             const GLsizei height) {
+    gl_state_bind_texture(texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0,
+                 format, type, NULL);
+    // Without mipmaps the default filter leaves the texture incomplete
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+static void resize_downsample_pass(downsample_pass* pass,
+                                   const GLsizei x_res,
+                                   const GLsizei y_res) {
+    if (pass->width == x_res && pass->height == y_res) {
+        return;
+    }
+    LOG_DEBUG("Resizing the downsample pass to (%i, %i)", x_res, y_res);
+    pass->width = x_res;
+    pass->height = y_res;
+    const GLsizei out_x = half_size(x_res);
+    const GLsizei out_y = half_size(y_res);
+
+    allocate_texture(pass->source_textures[0], GL_RGBA8, GL_RGBA,
+                     GL_UNSIGNED_BYTE, x_res, y_res);
+    allocate_texture(pass->source_textures[1], GL_DEPTH_COMPONENT24,
+                     GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, x_res, y_res);
+    allocate_texture(pass->target_textures[0], GL_RGBA8, GL_RGBA,
+                     GL_UNSIGNED_BYTE, out_x, out_y);
+    allocate_texture(pass->target_textures[1], GL_R16, GL_RED,
+                     GL_UNSIGNED_SHORT, out_x, out_y);
 
-        free(elem->color_image);
+    gl_state_bind_framebuffer(GL_DRAW_FRAMEBUFFER, pass->target_fbo);
+    glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, pass->target_textures[0], 0);
+    glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT1,
+                           GL_TEXTURE_2D, pass->target_textures[1], 0);
+    if (glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER) !=
+            GL_FRAMEBUFFER_COMPLETE) {
+        LOG_ERROR("Downsample framebuffer is incomplete");
     }
 }
+
+// Draws texture[0] (color) and texture[1] (depth), both x_res by y_res,
+// into attachments 0 and 1 of the bound draw framebuffer. With downsample
+// the output is half size, otherwise a 1:1 copy. Without depth only the
+// color attachment is written.
+void render_image(const GLuint prog_id,
+                  const GLuint texture[2],
+                  const bool downsample,
+                  const bool depth,
+                  const GLsizei x_res,
+                  const GLsizei y_res) {
+    static const GLenum draw_buffers[2] = {
+        GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1
+    };
+    // Uniform lookups are queries too, so only do them once per program
+    static GLuint located_program;
+    static GLint locations[4];
+    if (located_program != prog_id) {
+        locations[0] = glGetUniformLocation(prog_id, "color_texture");
+        locations[1] = glGetUniformLocation(prog_id, "depth_texture");
+        locations[2] = glGetUniformLocation(prog_id, "source_size");
+        locations[3] = glGetUniformLocation(prog_id, "downsample");
+        located_program = prog_id;
+    }
+    glDrawBuffers(depth ? 2 : 1, draw_buffers);
+
+    gl_state_use_program(prog_id);
+    for (int j = 0; j < 2; j++) {
+        gl_state_active_texture(GL_TEXTURE0 + j);
+        gl_state_bind_texture(texture[j]);
+    }
+    glUniform1i(locations[0], 0);
+    glUniform1i(locations[1], 1);
+    glUniform2i(locations[2], x_res, y_res);
+    glUniform1i(locations[3], downsample);
+
+    // This goes straight to the driver, so our glViewport hook doesn't take
+    // it for a window resize
+    gl_state_viewport(0, 0, downsample ? half_size(x_res) : x_res,
+                      downsample ? half_size(y_res) : y_res);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+// Copies the frame out of the read framebuffer, renders the half size pair
+// and queues its readback into the slot's half resolution PBOs. Only the
+// state this changes is put back afterwards.
+static void downsample_frame(pbo_ring* ring,
+                             pbo_slot* slot,
+                             const GLsizei x_res,
+                             const GLsizei y_res) {
+    TRACE_SCOPE("downsample_frame");
+    downsample_pass* pass = &(ring->downsample);
+    const GLsizei out_x = half_size(x_res);
+    const GLsizei out_y = half_size(y_res);
+
+    const gl_state saved = *gl_state_current();
+    for (int j = 0; j < GL_STATE_CAPABILITIES; j++) {
+        gl_state_set_enabled(j, false);
+    }
+    gl_state_color_mask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    gl_state_polygon_mode(GL_FILL);
+    gl_state_bind_sampler(0, 0);
+    gl_state_bind_sampler(1, 0);
+    gl_state_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    gl_state_active_texture(GL_TEXTURE0);
+    resize_downsample_pass(pass, x_res, y_res);
+
+    gl_state_bind_texture(pass->source_textures[0]);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, x_res, y_res);
+    gl_state_bind_texture(pass->source_textures[1]);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, x_res, y_res);
+
+    gl_state_bind_framebuffer(GL_DRAW_FRAMEBUFFER, pass->target_fbo);
+    gl_state_bind_vertex_array(pass->vao);
+    render_image(pass->program, pass->source_textures,
+                 true, true, x_res, y_res);
+
+    gl_state_bind_framebuffer(GL_READ_FRAMEBUFFER, pass->target_fbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    reserve_pbo(slot->half_color_pbo, &(slot->half_color_capacity),
+                out_x * out_y * color_pixel_size(ring));
+    glReadPixels(0, 0, out_x, out_y, ring->color_format, GL_UNSIGNED_BYTE,
+                 0);
+    glReadBuffer(GL_COLOR_ATTACHMENT1);
+    reserve_pbo(slot->half_depth_pbo, &(slot->half_depth_capacity),
+                out_x * out_y * sizeof(unsigned short));
+    glReadPixels(0, 0, out_x, out_y, GL_RED, GL_UNSIGNED_SHORT, 0);
+
+    gl_state_restore(&saved);
+}
+
+void write_image(const GLsizei x_res,
+                 const GLsizei y_res,
+                 pbo_ring* ring,
+                 const unsigned int ID) {
+    TRACE_SCOPE("write_image");
+    if (ring->issued - ring->retired == (unsigned int) ring->size) {
+        LOG_DEBUG("PBO ring is full, waiting on readback %u", ring->retired);
+        retire_pbo_ring(ring, true);
+    }
+
+    pbo_slot* slot = &(ring->slots[ring->issued % ring->size]);
+    slot->ID = ID;
+    slot->timestamp = capture_timestamp();
+    slot->width = x_res;
+    slot->height = y_res;
+
+    const gl_state saved = *gl_state_current();
+    gl_state_pack_tightly();
+
+    gpu_trace_begin(&(ring->gpu_timer), "gpu_readback");
+    if (ring->downsample.mode != DOWNSAMPLE_ONLY) {
+        reserve_pbo(slot->color_pbo, &(slot->color_capacity),
+                    x_res * y_res * color_pixel_size(ring));
+        glReadPixels(0, 0, x_res, y_res, ring->color_format,
+                     GL_UNSIGNED_BYTE, 0);
+        reserve_pbo(slot->depth_pbo, &(slot->depth_capacity),
+                    x_res * y_res * sizeof(unsigned short));
+        glReadPixels(0, 0, x_res, y_res, GL_DEPTH_COMPONENT,
+                     GL_UNSIGNED_SHORT, 0);
+    }
+    if (ring->downsample.mode != DOWNSAMPLE_OFF) {
+        downsample_frame(ring, slot, x_res, y_res);
+    }
+    gpu_trace_end(&(ring->gpu_timer));
+    gl_state_restore(&saved);
+
+    slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ring->issued++;
+}
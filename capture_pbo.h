@@ -10,40 +10,95 @@
 #include <GL/glext.h>
 
 #include "pipe.h"
-#include "miniz.h"
 #include "hooks_dict.h"
+#include "frame_pool.h"
+#include "frame_queue.h"
+#include "frame_consumer.h"
+#include "frame_dedup.h"
+#include "gpu_trace.h"
 
 #define COLOR_TEXTURE_MAX_SIZE 8294400 * 3 * sizeof(char)
 #define DEPTH_TEXTURE_MAX_SIZE 8294400 * sizeof(unsigned short)
 #define ELEMENT_SIZE (sizeof(char*) + sizeof(float*) + sizeof(GLsizei) * 2 + sizeof(unsigned int))
 #define DEPTH_UPSAMPLE_DIR "depth_upsample_data/"
+#define PBO_RING_DEFAULT_SIZE 3
+#define PBO_RING_MAX_SIZE 16
 
-typedef unsigned char uchar;
+// DEPTH_UPSAMPLE_GPU_DOWNSAMPLE: off, both (full and half resolution) or
+// only (half resolution)
+typedef enum {
+    DOWNSAMPLE_OFF,
+    DOWNSAMPLE_BOTH,
+    DOWNSAMPLE_ONLY
+} downsample_mode;
 
+// One in-flight readback: glReadPixels has been issued into the PBOs and
+// the fence tells us when the transfer has actually finished.
 typedef struct {
+    GLuint color_pbo;
+    GLuint depth_pbo;
+    GLuint half_color_pbo;
+    GLuint half_depth_pbo;
+    GLsizeiptr color_capacity;
+    GLsizeiptr depth_capacity;
+    GLsizeiptr half_color_capacity;
+    GLsizeiptr half_depth_capacity;
+    GLsync fence;
     unsigned int ID;
+    uint64_t timestamp;
     GLsizei width;
     GLsizei height;
-    uchar* color_image;
-    uchar* depth_image;
-} buffer_element;
-
-void create_pbo(GLuint* color_pbo,
-                GLuint* depth_pbo);
-void create_textures(GLuint* color_texture,
-                     GLuint* depth_texture,
-                     const GLsizei x_res,
-                     const GLsizei y_res);
-void read_into_pbo(const GLuint pbo[2],
-                   const GLsizei x_res,
-                   const GLsizei y_res);
-void update_textures_from_pbo(const GLuint pbo[2],
-                              const GLuint textures[2],
-                              const GLsizei x_res,
-                              const GLsizei y_res);
+} pbo_slot;
+
+// The captured color and depth are copied into the source textures and
+// drawn at half size into the target FBO, which has an RGBA8 color and an
+// R16 depth attachment, picking the same pixels as downsample_pixels().
+typedef struct {
+    downsample_mode mode;
+    GLuint program;
+    GLuint vao;
+    GLuint source_textures[2];
+    GLuint target_textures[2];
+    GLuint target_fbo;
+    GLsizei width;
+    GLsizei height;
+} downsample_pass;
+
+// Readback number K goes into slot K % size. Slots are only mapped once
+// their fence has signaled, so the swap thread never waits on the GPU
+// unless every slot is still in flight.
+typedef struct {
+    pbo_slot slots[PBO_RING_MAX_SIZE];
+    int size;
+    unsigned int issued;
+    unsigned int retired;
+    frame_queue* queue;
+    gpu_trace gpu_timer;
+    downsample_pass downsample;
+    frame_dedup dedup;
+    // GL_BGRA or GL_RGB, see color_readback_format()
+    GLenum color_format;
+} pbo_ring;
+
+downsample_mode downsample_default_mode();
+// DEPTH_UPSAMPLE_COLOR_READBACK: bgra (default) reads color back four bytes
+// a pixel, which drivers transfer as is, and packs it to RGB while copying
+// it out of the PBO. rgb has the driver do the conversion instead.
+GLenum color_readback_format();
+void create_pbo_ring(pbo_ring* ring,
+                     const int size,
+                     frame_queue* queue);
+// Pushes the readbacks that have finished, or with wait the oldest one
+// once it has. Returns false if a readback failed, its slot is free again
+// but the frame is dropped.
+bool retire_pbo_ring(pbo_ring* ring, const bool wait);
+// Waits for and pushes every readback still in flight
+void flush_pbo_ring(pbo_ring* ring);
+// Flushes the ring and frees the GL objects, the context the ring was
+// created in must be current
+void destroy_pbo_ring(pbo_ring* ring);
 GLuint create_shaders();
-void render_image(HOOKS hooks,
-                  const GLuint prog_id,
+void render_image(const GLuint prog_id,
                   const GLuint texture[2],
                   const bool downsample,
                   const bool depth,
@@ -51,7 +106,5 @@ void render_image(HOOKS hooks,
                   const GLsizei y_res);
 void write_image(const GLsizei x_res,
                  const GLsizei y_res,
-                 const GLuint textures[2],
-                 const unsigned int ID,
-                 pipe_producer_t* producer);
-void* frame_consumer_thread(void* consumer_ptr);
+                 pbo_ring* ring,
+                 const unsigned int ID);
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture_schedule.h"
+#include "config.h"
+#include "frame_dedup.h"
+#include "gl_state.h"
+#include "log.h"
+#include "trace.h"
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void capture_schedule_init(capture_schedule* schedule) {
+    memset(schedule, 0, sizeof(capture_schedule));
+
+    const char* mode = config_get_str("DEPTH_UPSAMPLE_SCHEDULE", "frames");
+    if (strcmp(mode, "interval") == 0) {
+        schedule->mode = SCHEDULE_INTERVAL;
+    } else if (strcmp(mode, "fps") == 0) {
+        schedule->mode = SCHEDULE_FPS;
+    } else if (strcmp(mode, "scene") == 0) {
+        schedule->mode = SCHEDULE_SCENE;
+    } else {
+        if (strcmp(mode, "frames") != 0) {
+            LOG_WARN("Unknown capture schedule %s, using frames", mode);
+        }
+        schedule->mode = SCHEDULE_EVERY_N;
+    }
+
+    int every_n = config_get_int("DEPTH_UPSAMPLE_EVERY_N",
+                                 SCHEDULE_DEFAULT_EVERY_N);
+    schedule->every_n = every_n < 1 ? 1 : every_n;
+
+    if (schedule->mode == SCHEDULE_INTERVAL) {
+        schedule->interval = config_get_double("DEPTH_UPSAMPLE_INTERVAL_MS",
+                                               1000.0) / 1000.0;
+    } else if (schedule->mode == SCHEDULE_FPS) {
+        double fps = config_get_double("DEPTH_UPSAMPLE_TARGET_FPS", 2.0);
+        schedule->interval = fps > 0.0 ? 1.0 / fps : 1.0;
+    }
+
+    schedule->threshold = config_get_double("DEPTH_UPSAMPLE_SCENE_THRESHOLD",
+                                            0.05);
+    int min_frames = config_get_int("DEPTH_UPSAMPLE_SCENE_MIN_FRAMES", 5);
+    schedule->min_frames = min_frames < 1 ? 1 : min_frames;
+    schedule->last_capture = now_seconds();
+}
+
+static void create_signature_objects(capture_schedule* schedule) {
+    // Renderbuffer bindings aren't shadowed, but this only runs once
+    GLint old_renderbuffer;
+    glGetIntegerv(GL_RENDERBUFFER_BINDING, &old_renderbuffer);
+    glGenFramebuffers(1, &(schedule->fbo));
+    glGenRenderbuffers(1, &(schedule->renderbuffer));
+    glBindRenderbuffer(GL_RENDERBUFFER, schedule->renderbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8,
+                          SIGNATURE_SIZE, SIGNATURE_SIZE);
+    glBindRenderbuffer(GL_RENDERBUFFER, old_renderbuffer);
+
+    const gl_state saved = *gl_state_current();
+    gl_state_bind_framebuffer(GL_DRAW_FRAMEBUFFER, schedule->fbo);
+    glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER, schedule->renderbuffer);
+
+    glGenBuffers(SIGNATURE_RING_SIZE, schedule->signature_pbo);
+    for (int j = 0; j < SIGNATURE_RING_SIZE; j++) {
+        gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, schedule->signature_pbo[j]);
+        glBufferData(GL_PIXEL_PACK_BUFFER,
+                     SIGNATURE_SIZE * SIGNATURE_SIZE * 4, NULL,
+                     GL_STREAM_READ);
+    }
+    gl_state_restore(&saved);
+}
+
+static void destroy_levels(capture_schedule* schedule) {
+    if (schedule->levels > 0) {
+        glDeleteFramebuffers(schedule->levels, schedule->level_fbo);
+        glDeleteRenderbuffers(schedule->levels,
+                              schedule->level_renderbuffer);
+    }
+    schedule->levels = 0;
+}
+
+static void add_level(capture_schedule* schedule,
+                      const GLsizei width,
+                      const GLsizei height) {
+    const int level = schedule->levels++;
+    schedule->level_width[level] = width;
+    schedule->level_height[level] = height;
+    glGenFramebuffers(1, &(schedule->level_fbo[level]));
+    glGenRenderbuffers(1, &(schedule->level_renderbuffer[level]));
+    glBindRenderbuffer(GL_RENDERBUFFER, schedule->level_renderbuffer[level]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    gl_state_bind_framebuffer(GL_DRAW_FRAMEBUFFER,
+                              schedule->level_fbo[level]);
+    glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                              GL_RENDERBUFFER,
+                              schedule->level_renderbuffer[level]);
+}
+
+// Only runs when the back buffer changes size
+static void create_levels(capture_schedule* schedule,
+                          const GLsizei x_res,
+                          const GLsizei y_res) {
+    destroy_levels(schedule);
+    schedule->source_width = x_res;
+    schedule->source_height = y_res;
+
+    GLint old_renderbuffer;
+    glGetIntegerv(GL_RENDERBUFFER_BINDING, &old_renderbuffer);
+    const gl_state saved = *gl_state_current();
+    gl_state_bind_framebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    GLint sample_buffers = 0;
+    glGetIntegerv(GL_SAMPLE_BUFFERS, &sample_buffers);
+
+    // Multisampled pixels can only be blitted to the same size
+    GLsizei width = x_res;
+    GLsizei height = y_res;
+    if (sample_buffers > 0) {
+        add_level(schedule, width, height);
+    }
+    while ((width > 2 * SIGNATURE_SIZE || height > 2 * SIGNATURE_SIZE) &&
+            schedule->levels < SIGNATURE_MAX_LEVELS) {
+        width = width > 2 * SIGNATURE_SIZE ? (width + 1) / 2 : width;
+        height = height > 2 * SIGNATURE_SIZE ? (height + 1) / 2 : height;
+        add_level(schedule, width, height);
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, old_renderbuffer);
+    gl_state_restore(&saved);
+}
+
+// Let the GPU do the reduction: the back buffer is halved down to a tiny
+// renderbuffer, and only those few hundred pixels are read back.
+static void issue_signature(capture_schedule* schedule,
+                            const GLsizei x_res,
+                            const GLsizei y_res) {
+    const int slot = schedule->signatures_issued % SIGNATURE_RING_SIZE;
+
+    const gl_state saved = *gl_state_current();
+    gl_state_set_enabled(GL_STATE_SCISSOR_TEST, false);
+    gl_state_pack_tightly();
+
+    GLuint source = 0;
+    GLsizei width = x_res;
+    GLsizei height = y_res;
+    for (int j = 0; j <= schedule->levels; j++) {
+        const bool last = j == schedule->levels;
+        const GLsizei level_width = last ? SIGNATURE_SIZE :
+                                    schedule->level_width[j];
+        const GLsizei level_height = last ? SIGNATURE_SIZE :
+                                     schedule->level_height[j];
+        const GLuint target = last ? schedule->fbo :
+                              schedule->level_fbo[j];
+        gl_state_bind_framebuffer(GL_READ_FRAMEBUFFER, source);
+        gl_state_bind_framebuffer(GL_DRAW_FRAMEBUFFER, target);
+        glBlitFramebuffer(0, 0, width, height,
+                          0, 0, level_width, level_height,
+                          GL_COLOR_BUFFER_BIT,
+                          level_width == width && level_height == height ?
+                          GL_NEAREST : GL_LINEAR);
+        source = target;
+        width = level_width;
+        height = level_height;
+    }
+
+    gl_state_bind_framebuffer(GL_READ_FRAMEBUFFER, schedule->fbo);
+    gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, schedule->signature_pbo[slot]);
+    glReadPixels(0, 0, SIGNATURE_SIZE, SIGNATURE_SIZE,
+                 GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    schedule->signature_fence[slot] =
+        glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+    gl_state_restore(&saved);
+    schedule->signatures_issued++;
+}
+
+void capture_schedule_destroy(capture_schedule* schedule) {
+    if (!schedule->fbo) {
+        return;
+    }
+    for (int j = 0; j < SIGNATURE_RING_SIZE; j++) {
+        if (schedule->signature_fence[j]) {
+            glDeleteSync(schedule->signature_fence[j]);
+            schedule->signature_fence[j] = NULL;
+        }
+    }
+    glDeleteBuffers(SIGNATURE_RING_SIZE, schedule->signature_pbo);
+    destroy_levels(schedule);
+    glDeleteRenderbuffers(1, &(schedule->renderbuffer));
+    glDeleteFramebuffers(1, &(schedule->fbo));
+    schedule->fbo = 0;
+}
+
+static void retire_signatures(capture_schedule* schedule) {
+    while (schedule->signatures_retired != schedule->signatures_issued) {
+        const int slot = schedule->signatures_retired % SIGNATURE_RING_SIZE;
+        GLenum status = glClientWaitSync(schedule->signature_fence[slot],
+                                         0, 0);
+        if (status != GL_ALREADY_SIGNALED &&
+                status != GL_CONDITION_SATISFIED) {
+            return;
+        }
+        glDeleteSync(schedule->signature_fence[slot]);
+        schedule->signature_fence[slot] = NULL;
+
+        const GLuint pack_buffer = gl_state_current()->pack_buffer;
+        gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER,
+                             schedule->signature_pbo[slot]);
+        const unsigned char* rgba = (const unsigned char*) glMapBufferRange(
+                                        GL_PIXEL_PACK_BUFFER, 0,
+                                        SIGNATURE_SIZE * SIGNATURE_SIZE * 4,
+                                        GL_MAP_READ_BIT);
+        for (int j = 0; j < SIGNATURE_SIZE * SIGNATURE_SIZE; j++) {
+            schedule->last_signature[j] = (0.299f * rgba[4 * j] +
+                                           0.587f * rgba[4 * j + 1] +
+                                           0.114f * rgba[4 * j + 2]) / 255.0f;
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, pack_buffer);
+        schedule->signatures_retired++;
+
+        if (!schedule->have_signature ||
+                signature_distance(schedule->last_signature,
+                                   schedule->captured_signature,
+                                   SIGNATURE_SIZE * SIGNATURE_SIZE) >
+                schedule->threshold) {
+            schedule->scene_changed = true;
+        }
+    }
+}
+
+static bool scene_should_capture(capture_schedule* schedule,
+                                 const GLsizei x_res,
+                                 const GLsizei y_res) {
+    TRACE_SCOPE("scene_signature");
+    if (!schedule->fbo) {
+        create_signature_objects(schedule);
+    }
+
+    retire_signatures(schedule);
+    if (schedule->signatures_issued - schedule->signatures_retired <
+            SIGNATURE_RING_SIZE) {
+        if (x_res != schedule->source_width ||
+                y_res != schedule->source_height) {
+            create_levels(schedule, x_res, y_res);
+        }
+        issue_signature(schedule, x_res, y_res);
+    }
+
+    if (!schedule->scene_changed ||
+            schedule->frames_since_capture < schedule->min_frames) {
+        return false;
+    }
+
+    memcpy(schedule->captured_signature, schedule->last_signature,
+           sizeof(schedule->captured_signature));
+    schedule->have_signature = true;
+    schedule->scene_changed = false;
+    return true;
+}
+
+bool capture_schedule_should_capture(capture_schedule* schedule,
+                                     const GLsizei x_res,
+                                     const GLsizei y_res) {
+    bool capture = false;
+    schedule->frames_since_capture++;
+
+    switch (schedule->mode) {
+        case SCHEDULE_EVERY_N:
+            capture = schedule->frames_since_capture >= schedule->every_n;
+            break;
+        case SCHEDULE_INTERVAL: {
+            double now = now_seconds();
+            if (now - schedule->last_capture >= schedule->interval) {
+                schedule->last_capture = now;
+                capture = true;
+            }
+            break;
+        }
+        case SCHEDULE_FPS: {
+            // Token bucket holding at most one second of captures
+            double now = now_seconds();
+            double max_budget = 1.0 / schedule->interval;
+            schedule->budget += (now - schedule->last_capture) /
+                                schedule->interval;
+            schedule->last_capture = now;
+            if (schedule->budget > max_budget) {
+                schedule->budget = max_budget < 1.0 ? 1.0 : max_budget;
+            }
+            if (schedule->budget >= 1.0) {
+                schedule->budget -= 1.0;
+                capture = true;
+            }
+            break;
+        }
+        case SCHEDULE_SCENE:
+            capture = scene_should_capture(schedule, x_res, y_res);
+            break;
+    }
+
+    if (capture) {
+        schedule->frames_since_capture = 0;
+    }
+    return capture;
+}
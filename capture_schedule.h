@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#define SCHEDULE_DEFAULT_EVERY_N 30
+#define SIGNATURE_SIZE 16
+#define SIGNATURE_RING_SIZE 3
+// Enough halvings for a 65536 pixel wide back buffer, plus a resolve
+#define SIGNATURE_MAX_LEVELS 14
+
+typedef enum {
+    SCHEDULE_EVERY_N,
+    SCHEDULE_INTERVAL,
+    SCHEDULE_FPS,
+    SCHEDULE_SCENE
+} schedule_mode;
+
+// Decides which swaps get captured. Selected with DEPTH_UPSAMPLE_SCHEDULE:
+//   frames   - every DEPTH_UPSAMPLE_EVERY_N swaps (default 30)
+//   interval - at most once every DEPTH_UPSAMPLE_INTERVAL_MS milliseconds
+//   fps      - averages DEPTH_UPSAMPLE_TARGET_FPS captures per second,
+//              catching up for up to a second of missed budget
+//   scene    - whenever the luminance signature of the back buffer moves
+//              more than DEPTH_UPSAMPLE_SCENE_THRESHOLD (0-1) away from the
+//              last captured frame, at most once every
+//              DEPTH_UPSAMPLE_SCENE_MIN_FRAMES swaps
+typedef struct {
+    schedule_mode mode;
+    unsigned int every_n;
+    unsigned int frames_since_capture;
+    double interval;
+    double last_capture;
+    double budget;
+
+    // Scene-change detection. The back buffer is halved with linear blits
+    // until it is at most twice SIGNATURE_SIZE^2, so every level averages
+    // 2x2 blocks of the one before instead of sampling single pixels. The
+    // last blit lands in a SIGNATURE_SIZE^2 renderbuffer that is read back
+    // asynchronously, so a signature is available a frame or two after it
+    // was taken. A multisampled back buffer is resolved at full size first.
+    float threshold;
+    unsigned int min_frames;
+    bool scene_changed;
+    bool have_signature;
+    GLuint fbo;
+    GLuint renderbuffer;
+    GLuint level_fbo[SIGNATURE_MAX_LEVELS];
+    GLuint level_renderbuffer[SIGNATURE_MAX_LEVELS];
+    GLsizei level_width[SIGNATURE_MAX_LEVELS];
+    GLsizei level_height[SIGNATURE_MAX_LEVELS];
+    int levels;
+    // Back buffer size the levels were made for
+    GLsizei source_width;
+    GLsizei source_height;
+    GLuint signature_pbo[SIGNATURE_RING_SIZE];
+    GLsync signature_fence[SIGNATURE_RING_SIZE];
+    unsigned int signatures_issued;
+    unsigned int signatures_retired;
+    float last_signature[SIGNATURE_SIZE * SIGNATURE_SIZE];
+    float captured_signature[SIGNATURE_SIZE * SIGNATURE_SIZE];
+} capture_schedule;
+
+void capture_schedule_init(capture_schedule* schedule);
+// Frees the GL objects, the context they were created in must be current
+void capture_schedule_destroy(capture_schedule* schedule);
+bool capture_schedule_should_capture(capture_schedule* schedule,
+                                     const GLsizei x_res,
+                                     const GLsizei y_res);
@@ -0,0 +1,525 @@
+// Encodes and writes the frames of games captured with
+// DEPTH_UPSAMPLE_OUTPUT=collector, so PNG encoding and disk I/O don't
+// compete with the game for its CPU time and address space.
+//
+//   depth_upsample_collector [socket] [data_dir]
+//
+// socket defaults to DEPTH_UPSAMPLE_COLLECTOR or depth_upsample_collector
+// in $XDG_RUNTIME_DIR, data_dir to depth_upsample_data/. Only games of the
+// collector's own user are served. Every game that connects gets its own
+// session directory there, named after the game's pid, and old sessions
+// are deleted as DEPTH_UPSAMPLE_KEEP_SESSIONS and DEPTH_UPSAMPLE_KEEP_GB
+// say. Frames are mapped from the memfds the game sends and released back
+// to it once written.
+//
+// Output is configured in the collector's own environment with the same
+// variables as hooks.so: DEPTH_UPSAMPLE_OUTPUT (files, archive or
+// samples), DEPTH_UPSAMPLE_COLOR_FORMAT, DEPTH_UPSAMPLE_DEPTH_FORMAT,
+// DEPTH_UPSAMPLE_PNG_LEVEL and so on. Besides those,
+//   DEPTH_UPSAMPLE_COLLECTOR_THREADS - consumer threads per game (8)
+//   DEPTH_UPSAMPLE_COLLECTOR_NICE    - nice value of the daemon (0)
+//   DEPTH_UPSAMPLE_COLLECTOR_CPUS    - cores it may run on, e.g. 4-7,10
+// SIGINT or SIGTERM stops accepting games and exits once the connected
+// ones have finished writing.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#include "pipe.h"
+#include "frame_stream.h"
+#include "frame_consumer.h"
+#include "png_encode.h"
+#include "session.h"
+#include "config.h"
+#include "log.h"
+
+#define COLLECTOR_DEFAULT_DIR "depth_upsample_data/"
+#define COLLECTOR_DEFAULT_THREADS 8
+#define COLLECTOR_MAX_THREADS 64
+#define COLLECTOR_MAX_GAMES 64
+// Writes of a game that has gone away are still waited for
+#define COLLECTOR_DRAIN_TIMEOUT_MS 600000
+
+// One connected game and the consumer pipeline writing its session
+typedef struct {
+    int socket;
+    uint32_t pid;
+    pthread_t thread;
+    // Only there for its release callback, frames come from the game
+    frame_pool remote;
+    char session_dir[SESSION_PATH_SIZE];
+    // Keeps other processes' cleanup away until the session is written
+    int session_lock;
+    pipe_producer_t* producer;
+    frame_writer writer;
+    frame_archive archive;
+    frame_archive half_archive;
+    int threads;
+    pthread_t consumer_threads[COLLECTOR_MAX_THREADS];
+    consumer_context consumers[COLLECTOR_MAX_THREADS];
+    sample_shard samples[COLLECTOR_MAX_THREADS];
+    atomic_ulong received;
+    atomic_ulong released;
+} game;
+
+// A frame mapped from the game's memfd, handed back by
+// frame_pool_release() like a frame of our own
+typedef struct {
+    frame_buffer frame;
+    game* from;
+    uint32_t slot;
+    void* mapping;
+} remote_frame;
+
+static char root[SESSION_PATH_SIZE];
+static pthread_mutex_t games_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t game_left = PTHREAD_COND_INITIALIZER;
+static game* games[COLLECTOR_MAX_GAMES];
+
+// Tells the game it may reuse the buffer behind slot. Fails once the game
+// has exited, which is fine, nothing is waiting for it then.
+static void release_slot(game* self, const uint32_t slot) {
+    stream_message message;
+    memset(&message, 0, sizeof(message));
+    memcpy(message.magic, STREAM_MAGIC, sizeof(message.magic));
+    message.type = STREAM_RELEASE;
+    message.version = STREAM_VERSION;
+    message.pid = (uint32_t) getpid();
+    message.slot = slot;
+    stream_send(self->socket, &message, -1);
+}
+
+static void release_remote(frame_buffer* frame) {
+    remote_frame* remote = (remote_frame*) frame;
+    game* from = remote->from;
+    release_slot(from, remote->slot);
+    munmap(remote->mapping, remote->frame.capacity);
+    free(remote);
+    atomic_fetch_add(&(from->released), 1);
+}
+
+static bool start_session(game* self) {
+    if (!session_create(root, (int) self->pid, self->session_dir,
+                        sizeof(self->session_dir), &(self->session_lock))) {
+        return false;
+    }
+    session_start_cleanup(root, self->session_dir);
+
+    frame_pool_init(&(self->remote), 0);
+    self->remote.release = release_remote;
+    frame_writer_init(&(self->writer));
+    pipe_t* pipe = pipe_new(sizeof(buffer_element), 0);
+    self->producer = pipe_producer_new(pipe);
+    const char* output_mode = config_get_str("DEPTH_UPSAMPLE_OUTPUT",
+                                             "files");
+    const bool direct_io = config_get_int("DEPTH_UPSAMPLE_DIRECT_IO", 0);
+    frame_archive* output = NULL;
+    frame_archive* half_output = NULL;
+    char archive_path[SESSION_PATH_SIZE + sizeof(ARCHIVE_HALF_FILE_NAME)];
+    snprintf(archive_path, sizeof(archive_path), "%s%s", self->session_dir,
+             ARCHIVE_FILE_NAME);
+    if (strcmp(output_mode, "archive") == 0 &&
+            frame_archive_open(&(self->archive), archive_path, direct_io)) {
+        output = &(self->archive);
+        // Opened up front, the game may or may not send half frames
+        snprintf(archive_path, sizeof(archive_path), "%s%s",
+                 self->session_dir, ARCHIVE_HALF_FILE_NAME);
+        if (frame_archive_open(&(self->half_archive), archive_path,
+                               direct_io)) {
+            half_output = &(self->half_archive);
+        }
+    }
+
+    self->threads = config_get_int("DEPTH_UPSAMPLE_COLLECTOR_THREADS",
+                                   COLLECTOR_DEFAULT_THREADS);
+    if (self->threads < 1) {
+        self->threads = 1;
+    } else if (self->threads > COLLECTOR_MAX_THREADS) {
+        self->threads = COLLECTOR_MAX_THREADS;
+    }
+    for (int j = 0; j < self->threads; j++) {
+        consumer_context* context = &(self->consumers[j]);
+        context->consumer = pipe_consumer_new(pipe);
+        context->output_dir = self->session_dir;
+        context->archive = output;
+        context->half_archive = half_output;
+        context->samples = NULL;
+        if (strcmp(output_mode, "samples") == 0) {
+            sample_shard_init(&(self->samples[j]), &(self->writer),
+                              self->session_dir, j);
+            context->samples = &(self->samples[j]);
+        }
+        context->share = NULL;
+        context->share_only = false;
+        context->writer = &(self->writer);
+    }
+    for (int j = 0; j < self->threads; j++) {
+        pthread_create(&(self->consumer_threads[j]), NULL,
+                       frame_consumer_thread, &(self->consumers[j]));
+    }
+    pipe_free(pipe);
+    return true;
+}
+
+// Whether size bytes starting at offset lie within the buffer, without
+// letting the sum wrap around
+static bool fits(const uint64_t offset, const uint64_t size,
+                 const uint64_t buffer_size) {
+    return offset <= buffer_size && size <= buffer_size - offset;
+}
+
+// Maps a frame message's memfd, or returns NULL if the message doesn't
+// describe a frame that fits the buffer. A memfd that could still shrink
+// would fault the consumers reading it.
+static remote_frame* map_frame(game* self,
+                               const stream_message* message,
+                               const int fd) {
+    if (message->type != STREAM_FRAME || fd < 0 || message->width == 0 ||
+            message->height == 0 ||
+            message->width > STREAM_MAX_DIMENSION ||
+            message->height > STREAM_MAX_DIMENSION) {
+        return NULL;
+    }
+    const uint64_t pixels = (uint64_t) message->width * message->height;
+    struct stat status;
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (fstat(fd, &status) != 0 || status.st_size < 0 ||
+            (uint64_t) status.st_size < message->size || seals < 0 ||
+            !(seals & F_SEAL_SHRINK) ||
+            !fits(message->color_offset, pixels * 3, message->size) ||
+            !fits(message->depth_offset, pixels * 2, message->size)) {
+        return NULL;
+    }
+    void* mapping = mmap(NULL, message->size, PROT_READ,
+                         MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        LOG_ERROR("Can't map frame %u from game %u", message->ID,
+                  self->pid);
+        return NULL;
+    }
+
+    remote_frame* remote = (remote_frame*) calloc(1, sizeof(remote_frame));
+    remote->from = self;
+    remote->slot = message->slot;
+    remote->mapping = mapping;
+    frame_buffer* frame = &(remote->frame);
+    frame->pool = &(self->remote);
+    frame->fd = -1;
+    frame->capacity = message->size;
+    frame->color_image = (unsigned char*) mapping + message->color_offset;
+    frame->depth_image = (unsigned char*) mapping + message->depth_offset;
+    return remote;
+}
+
+static void finish_session(game* self) {
+    // Consumers return once they have popped everything that was sent
+    pipe_producer_free(self->producer);
+    for (int j = 0; j < self->threads; j++) {
+        pthread_join(self->consumer_threads[j], NULL);
+        pipe_consumer_free(self->consumers[j].consumer);
+    }
+    if (self->consumers[0].samples) {
+        for (int j = 0; j < self->threads; j++) {
+            sample_shard_flush(&(self->samples[j]));
+        }
+    }
+    frame_writer_drain(&(self->writer), COLLECTOR_DRAIN_TIMEOUT_MS);
+    frame_writer_close(&(self->writer));
+    if (self->consumers[0].archive) {
+        frame_archive_close(&(self->archive));
+    }
+    if (self->consumers[0].half_archive) {
+        frame_archive_close(&(self->half_archive));
+    }
+    close(self->session_lock);
+    LOG_INFO("Game %u is done, wrote %lu of %lu frames to %s", self->pid,
+             atomic_load(&(self->released)), atomic_load(&(self->received)),
+             self->session_dir);
+}
+
+static void receive_frames(game* self) {
+    stream_message message;
+    int fd;
+    while (stream_receive(self->socket, &message, &fd)) {
+        remote_frame* remote = map_frame(self, &message, fd);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!remote) {
+            if (message.type == STREAM_FRAME) {
+                LOG_WARN("Dropping a malformed frame from game %u",
+                         self->pid);
+                release_slot(self, message.slot);
+            }
+            continue;
+        }
+        atomic_fetch_add(&(self->received), 1);
+
+        buffer_element elem;
+        elem.ID = message.ID;
+        elem.width = (GLsizei) message.width;
+        elem.height = (GLsizei) message.height;
+        elem.timestamp = message.timestamp;
+        elem.color_image = remote->frame.color_image;
+        elem.depth_image = remote->frame.depth_image;
+        elem.frame = &(remote->frame);
+        elem.half = message.flags & STREAM_FRAME_HALF;
+        pipe_push(self->producer, &elem, 1);
+    }
+}
+
+static void* serve_game(void* game_ptr) {
+    game* self = (game*) game_ptr;
+    stream_message message;
+    int fd;
+    // Another collector checking whether this one is running hangs up
+    // without a word, which isn't worth a warning
+    bool greeted = stream_receive(self->socket, &message, &fd);
+    if (greeted && fd >= 0) {
+        close(fd);
+    }
+    if (greeted && (message.type != STREAM_HELLO ||
+                    message.version != STREAM_VERSION)) {
+        LOG_WARN("Dropping a client that isn't a version %d game",
+                 STREAM_VERSION);
+        greeted = false;
+    }
+    // The pid names the session, so it is taken from the kernel rather
+    // than from what the client says
+    struct ucred peer;
+    socklen_t peer_size = sizeof(peer);
+    if (greeted && (getsockopt(self->socket, SOL_SOCKET, SO_PEERCRED, &peer,
+                               &peer_size) != 0 ||
+                    peer.uid != getuid())) {
+        LOG_WARN("Dropping a client run by another user");
+        greeted = false;
+    }
+    if (greeted) {
+        self->pid = (uint32_t) peer.pid;
+        if (start_session(self)) {
+            message.pid = (uint32_t) getpid();
+            stream_send(self->socket, &message, -1);
+            LOG_INFO("Game %u connected", self->pid);
+            receive_frames(self);
+            finish_session(self);
+        }
+    }
+
+    pthread_mutex_lock(&games_lock);
+    for (int j = 0; j < COLLECTOR_MAX_GAMES; j++) {
+        if (games[j] == self) {
+            games[j] = NULL;
+        }
+    }
+    pthread_cond_signal(&game_left);
+    pthread_mutex_unlock(&games_lock);
+    close(self->socket);
+    free(self);
+    return NULL;
+}
+
+static void accept_game(const int client) {
+    game* self = (game*) calloc(1, sizeof(game));
+    self->socket = client;
+    pthread_mutex_lock(&games_lock);
+    int slot = -1;
+    for (int j = 0; j < COLLECTOR_MAX_GAMES && slot < 0; j++) {
+        if (!games[j]) {
+            slot = j;
+        }
+    }
+    if (slot >= 0) {
+        games[slot] = self;
+    }
+    pthread_mutex_unlock(&games_lock);
+    if (slot < 0) {
+        LOG_WARN("Already serving %d games, turning one away",
+                 COLLECTOR_MAX_GAMES);
+        close(client);
+        free(self);
+        return;
+    }
+    pthread_create(&(self->thread), NULL, serve_game, self);
+    pthread_detach(self->thread);
+}
+
+// Games finish writing what they sent, nothing new is received
+static void stop_games() {
+    pthread_mutex_lock(&games_lock);
+    for (int j = 0; j < COLLECTOR_MAX_GAMES; j++) {
+        if (games[j]) {
+            shutdown(games[j]->socket, SHUT_RD);
+        }
+    }
+    while (true) {
+        bool any = false;
+        for (int j = 0; j < COLLECTOR_MAX_GAMES; j++) {
+            any = any || games[j];
+        }
+        if (!any) {
+            break;
+        }
+        pthread_cond_wait(&game_left, &games_lock);
+    }
+    pthread_mutex_unlock(&games_lock);
+}
+
+// "4-7,10" style lists, as taskset takes them
+static bool parse_cpus(const char* list, cpu_set_t* cpus) {
+    CPU_ZERO(cpus);
+    while (*list) {
+        char* end;
+        const long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0) {
+            return false;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) {
+                return false;
+            }
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, cpus);
+        }
+        list = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',') {
+            return false;
+        }
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+// Set before any thread starts, so every thread inherits them
+static void set_scheduling() {
+    const int nice_value = config_get_int("DEPTH_UPSAMPLE_COLLECTOR_NICE", 0);
+    if (nice_value && setpriority(PRIO_PROCESS, 0, nice_value) != 0) {
+        LOG_WARN("Can't set the collector's nice value to %d", nice_value);
+    }
+    const char* list = config_get_str("DEPTH_UPSAMPLE_COLLECTOR_CPUS", "");
+    if (list[0]) {
+        cpu_set_t cpus;
+        if (!parse_cpus(list, &cpus)) {
+            LOG_WARN("Can't parse DEPTH_UPSAMPLE_COLLECTOR_CPUS=%s", list);
+        } else if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+            LOG_WARN("Can't run the collector on CPUs %s", list);
+        }
+    }
+}
+
+static int listen_on(const char* path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    const int server = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (server < 0) {
+        return -1;
+    }
+    // A socket file nobody answers on is left over from a collector that
+    // didn't get to clean up
+    if (connect(server, (struct sockaddr*) &address, sizeof(address)) == 0) {
+        LOG_ERROR("Another collector is already listening on %s", path);
+        close(server);
+        return -1;
+    }
+    unlink(path);
+    // Other users may not even connect
+    const mode_t mask = umask(077);
+    const bool bound = bind(server, (struct sockaddr*) &address,
+                            sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || listen(server, COLLECTOR_MAX_GAMES) != 0) {
+        LOG_ERROR("Can't listen on %s", path);
+        close(server);
+        return -1;
+    }
+    // A game that hangs up between poll() and accept() mustn't block the
+    // loop
+    fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+    return server;
+}
+
+int main(int argc, char** argv) {
+    char default_path[STREAM_SOCKET_SIZE];
+    stream_socket_path(default_path, sizeof(default_path));
+    const char* path = argc > 1 ? argv[1] : default_path;
+    const char* dir = argc > 2 ? argv[2] : COLLECTOR_DEFAULT_DIR;
+    // Session paths are built by appending to the root
+    snprintf(root, sizeof(root), "%s%s", dir,
+             dir[0] && dir[strlen(dir) - 1] == '/' ? "" : "/");
+
+    // Blocked before any thread starts, the log thread included, so every
+    // thread inherits the mask and the signals only arrive through the
+    // signalfd
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    const int stop_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+    if (stop_fd < 0) {
+        LOG_ERROR("Can't wait for SIGINT and SIGTERM");
+        log_flush();
+        return 1;
+    }
+
+    set_scheduling();
+    const int server = listen_on(path);
+    if (server < 0) {
+        log_flush();
+        return 1;
+    }
+    png_encoder_init();
+    LOG_INFO("Collecting frames on %s into %s", path, root);
+
+    struct pollfd fds[2] = {
+        {.fd = server, .events = POLLIN},
+        {.fd = stop_fd, .events = POLLIN}
+    };
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG_ERROR("Can't wait for games on %s", path);
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        const int client = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+        if (client >= 0) {
+            accept_game(client);
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                   errno != ECONNABORTED && errno != EINTR) {
+            LOG_ERROR("Can't accept games on %s", path);
+            break;
+        }
+    }
+
+    close(server);
+    close(stop_fd);
+    unlink(path);
+    stop_games();
+    LOG_INFO("Collector stopped");
+    log_flush();
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "log.h"
+
+int config_get_int(const char* name, const int default_value) {
+    const char* value = getenv(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+
+    char* end;
+    long parsed = strtol(value, &end, 10);
+    if (*end != '\0') {
+        LOG_WARN("Ignoring malformed %s=%s", name, value);
+        return default_value;
+    }
+    return (int) parsed;
+}
+
+double config_get_double(const char* name, const double default_value) {
+    const char* value = getenv(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+
+    char* end;
+    double parsed = strtod(value, &end);
+    if (*end != '\0') {
+        LOG_WARN("Ignoring malformed %s=%s", name, value);
+        return default_value;
+    }
+    return parsed;
+}
+
+const char* config_get_str(const char* name, const char* default_value) {
+    const char* value = getenv(name);
+    if (!value || !*value) {
+        return default_value;
+    }
+    return value;
+}
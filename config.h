@@ -0,0 +1,8 @@
+#pragma once
+
+// Every tunable of hooks.so is read from the environment of the hooked
+// process, so the depth_upsample launcher can configure a capture session
+// without rebuilding.
+int config_get_int(const char* name, const int default_value);
+double config_get_double(const char* name, const double default_value);
+const char* config_get_str(const char* name, const char* default_value);
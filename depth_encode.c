@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miniz.h"
+#include "depth_encode.h"
+#include "byte_swap.h"
+#include "config.h"
+#include "log.h"
+
+depth_format depth_default_format() {
+    const char* format = config_get_str("DEPTH_UPSAMPLE_DEPTH_FORMAT", "pgm");
+    if (strcmp(format, "raw") == 0) {
+        return DEPTH_FORMAT_RAW;
+    } else if (strcmp(format, "png16") == 0) {
+        return DEPTH_FORMAT_PNG16;
+    } else if (strcmp(format, "delta") == 0) {
+        return DEPTH_FORMAT_DELTA;
+    } else if (strcmp(format, "pgm") != 0) {
+        LOG_WARN("Unknown depth format %s, using pgm", format);
+    }
+    return DEPTH_FORMAT_PGM;
+}
+
+const char* depth_format_suffix(const depth_format format) {
+    switch (format) {
+        case DEPTH_FORMAT_RAW:
+            return "_depth.raw";
+        case DEPTH_FORMAT_PNG16:
+            return "_depth.png";
+        case DEPTH_FORMAT_DELTA:
+            return "_depth.dpd";
+        default:
+            return "_depth.pgm";
+    }
+}
+
+static void put_u32_le(unsigned char* out, const uint32_t value) {
+    out[0] = (unsigned char) value;
+    out[1] = (unsigned char)(value >> 8);
+    out[2] = (unsigned char)(value >> 16);
+    out[3] = (unsigned char)(value >> 24);
+}
+
+static void write_header(unsigned char* out,
+                         const char* magic,
+                         const int width,
+                         const int height) {
+    memcpy(out, magic, 4);
+    put_u32_le(out + 4, 1);
+    put_u32_le(out + 8, width);
+    put_u32_le(out + 12, height);
+}
+
+static void* encode_pgm(const unsigned char* depth,
+                        const int width,
+                        const int height,
+                        size_t* out_length) {
+    char header[64];
+    const int header_length = snprintf(header, sizeof(header),
+                                       "P5 %d %d %d\n", width, height, 65535);
+    const size_t samples = (size_t) width * height;
+
+    unsigned char* out = (unsigned char*) malloc(header_length + 2 * samples);
+    memcpy(out, header, header_length);
+    swap_bytes16(out + header_length, depth, samples);
+    *out_length = header_length + 2 * samples;
+    return out;
+}
+
+static void* encode_raw(const unsigned char* depth,
+                        const int width,
+                        const int height,
+                        size_t* out_length) {
+    const size_t samples = (size_t) width * height;
+    unsigned char* out = (unsigned char*) malloc(DEPTH_HEADER_SIZE +
+                                                 2 * samples);
+    write_header(out, DEPTH_RAW_MAGIC, width, height);
+    memcpy(out + DEPTH_HEADER_SIZE, depth, 2 * samples);
+    *out_length = DEPTH_HEADER_SIZE + 2 * samples;
+    return out;
+}
+
+// Each sample is predicted from its left, upper and upper-left neighbours
+// as left + up - up_left, which is exact on any planar patch of depth, so
+// most residuals are zero or tiny. Residuals are zigzag coded and split
+// into a plane of high bytes (almost all zero) followed by a plane of low
+// bytes before deflating. Decoding is a 2D prefix sum, which numpy does
+// with two cumsum calls.
+static void* encode_delta(const unsigned char* depth,
+                          const int width,
+                          const int height,
+                          const png_options* options,
+                          size_t* out_length) {
+    const size_t samples = (size_t) width * height;
+    const uint16_t* d = (const uint16_t*) depth;
+    unsigned char* planes = (unsigned char*) malloc(2 * samples);
+    unsigned char* high = planes;
+    unsigned char* low = planes + samples;
+
+    for (int y = 0; y < height; y++) {
+        const uint16_t* row = d + (size_t) y * width;
+        const uint16_t* up = y > 0 ? row - width : NULL;
+        for (int x = 0; x < width; x++) {
+            const uint16_t left = x > 0 ? row[x - 1] : 0;
+            const uint16_t above = up ? up[x] : 0;
+            const uint16_t above_left = up && x > 0 ? up[x - 1] : 0;
+            const uint16_t predicted = left + above - above_left;
+            const int16_t residual = (int16_t)(uint16_t)(row[x] - predicted);
+            const uint16_t zigzag = ((uint16_t) residual << 1) ^
+                                    (uint16_t)(residual >> 15);
+            high[(size_t) y * width + x] = zigzag >> 8;
+            low[(size_t) y * width + x] = zigzag & 0xff;
+        }
+    }
+
+    mz_ulong compressed_length = mz_compressBound(2 * samples);
+    unsigned char* out = (unsigned char*) malloc(DEPTH_HEADER_SIZE +
+                                                 compressed_length);
+    write_header(out, DEPTH_DELTA_MAGIC, width, height);
+    int status = mz_compress2(out + DEPTH_HEADER_SIZE, &compressed_length,
+                              planes, 2 * samples, options->level);
+    if (status != MZ_OK) {
+        LOG_ERROR("Compressing depth residuals failed (%i)", status);
+    }
+    free(planes);
+
+    *out_length = DEPTH_HEADER_SIZE + compressed_length;
+    return out;
+}
+
+void* depth_encode(const unsigned char* depth,
+                   const int width,
+                   const int height,
+                   const depth_format format,
+                   const png_options* options,
+                   size_t* out_length) {
+    switch (format) {
+        case DEPTH_FORMAT_RAW:
+            return encode_raw(depth, width, height, out_length);
+        case DEPTH_FORMAT_PNG16:
+            return png_encode(depth, width, height, 1, 16, options,
+                              out_length);
+        case DEPTH_FORMAT_DELTA:
+            return encode_delta(depth, width, height, options, out_length);
+        default:
+            return encode_pgm(depth, width, height, out_length);
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "png_encode.h"
+
+#define DEPTH_RAW_MAGIC "DUPR"
+#define DEPTH_DELTA_MAGIC "DUPD"
+#define DEPTH_HEADER_SIZE 16
+
+typedef enum {
+    DEPTH_FORMAT_PGM,
+    DEPTH_FORMAT_RAW,
+    DEPTH_FORMAT_PNG16,
+    DEPTH_FORMAT_DELTA
+} depth_format;
+
+// Serializes a 16-bit depth image into one buffer that is written with a
+// single fwrite. DEPTH_UPSAMPLE_DEPTH_FORMAT selects the format:
+//   pgm   - binary PGM, big endian (default, as before)
+//   raw   - DUPR header followed by the little-endian samples
+//   png16 - 16-bit grayscale PNG through the strip encoder
+//   delta - DUPD header followed by a zlib stream of plane-predicted
+//           residuals (see depth_encode.c); smooth depth compresses far
+//           better this way than as PNG
+// The 16 byte DUPR/DUPD header is the magic, then version, width and
+// height as little-endian uint32. The returned buffer is freed with free().
+depth_format depth_default_format();
+const char* depth_format_suffix(const depth_format format);
+void* depth_encode(const unsigned char* depth,
+                   const int width,
+                   const int height,
+                   const depth_format format,
+                   const png_options* options,
+                   size_t* out_length);
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "frame_archive.h"
+#include "log.h"
+
+static uint64_t align_offset(const uint64_t offset) {
+    return (offset + ARCHIVE_ALIGNMENT - 1) / ARCHIVE_ALIGNMENT *
+           ARCHIVE_ALIGNMENT;
+}
+
+static bool write_fully(const int fd,
+                        const void* data,
+                        size_t length,
+                        uint64_t offset) {
+    const char* bytes = (const char*) data;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static void add_to_index(frame_archive* archive,
+                         const archive_record* record) {
+    if (archive->count == archive->capacity) {
+        archive->capacity = archive->capacity ? 2 * archive->capacity : 1024;
+        archive->index = (archive_record*) realloc(
+                             archive->index,
+                             archive->capacity * sizeof(archive_record));
+    }
+    archive->index[archive->count++] = *record;
+}
+
+static bool valid_record(const archive_record* record,
+                         const uint64_t offset,
+                         const uint64_t file_size) {
+    return memcmp(record->magic, ARCHIVE_RECORD_MAGIC, 4) == 0 &&
+           record->color_offset == offset + ARCHIVE_ALIGNMENT &&
+           record->depth_offset == align_offset(record->color_offset +
+                                                record->color_size) &&
+           record->depth_offset + record->depth_size <= file_size;
+}
+
+// Walks the records from the start of the file, rebuilding the in-memory
+// index up to the first frame that isn't fully on disk.
+size_t frame_archive_recover(frame_archive* archive) {
+    struct stat st;
+    fstat(archive->fd, &st);
+    const uint64_t file_size = st.st_size;
+
+    archive->count = 0;
+    archive->end = ARCHIVE_ALIGNMENT;
+    archive_record record;
+    while (archive->end + sizeof(record) <= file_size &&
+            pread(archive->fd, &record, sizeof(record), archive->end) ==
+            sizeof(record) &&
+            valid_record(&record, archive->end, file_size)) {
+        add_to_index(archive, &record);
+        archive->end = align_offset(record.depth_offset + record.depth_size);
+    }
+    return archive->count;
+}
+
+bool frame_archive_open(frame_archive* archive,
+                        const char* path,
+                        const bool direct) {
+    memset(archive, 0, sizeof(frame_archive));
+    pthread_mutex_init(&(archive->lock), NULL);
+    archive->direct_fd = -1;
+    archive->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (archive->fd < 0) {
+        LOG_ERROR("Can't open frame archive %s", path);
+        return false;
+    }
+
+    char header[ARCHIVE_ALIGNMENT];
+    memset(header, 0, sizeof(header));
+    const uint32_t version = ARCHIVE_VERSION;
+    memcpy(header, ARCHIVE_MAGIC, 4);
+    memcpy(header + 4, &version, sizeof(version));
+    write_fully(archive->fd, header, sizeof(header), 0);
+    archive->end = ARCHIVE_ALIGNMENT;
+
+    if (direct) {
+        archive->direct_fd = open(path, O_WRONLY | O_DIRECT);
+        if (archive->direct_fd < 0) {
+            LOG_WARN("O_DIRECT isn't supported for %s", path);
+        }
+    }
+    return true;
+}
+
+// Claims aligned space for the record header and its chunks and fills in
+// the offsets. Returns false once the archive is closed.
+bool frame_archive_reserve(frame_archive* archive,
+                           archive_record* record,
+                           uint64_t* header_offset) {
+    memcpy(record->magic, ARCHIVE_RECORD_MAGIC, 4);
+
+    pthread_mutex_lock(&(archive->lock));
+    if (archive->closed) {
+        pthread_mutex_unlock(&(archive->lock));
+        return false;
+    }
+    *header_offset = archive->end;
+    record->color_offset = *header_offset + ARCHIVE_ALIGNMENT;
+    record->depth_offset = align_offset(record->color_offset +
+                                        record->color_size);
+    archive->end = align_offset(record->depth_offset + record->depth_size);
+    pthread_mutex_unlock(&(archive->lock));
+    return true;
+}
+
+void frame_archive_commit(frame_archive* archive,
+                          const archive_record* record) {
+    pthread_mutex_lock(&(archive->lock));
+    if (!archive->closed) {
+        add_to_index(archive, record);
+    }
+    pthread_mutex_unlock(&(archive->lock));
+}
+
+static int compare_offsets(const void* a, const void* b) {
+    const archive_record* x = (const archive_record*) a;
+    const archive_record* y = (const archive_record*) b;
+    return (x->color_offset > y->color_offset) -
+           (x->color_offset < y->color_offset);
+}
+
+void frame_archive_close(frame_archive* archive) {
+    pthread_mutex_lock(&(archive->lock));
+    if (archive->closed) {
+        pthread_mutex_unlock(&(archive->lock));
+        return;
+    }
+    archive->closed = true;
+    // Frames finish writing out of order, the index is in file order
+    qsort(archive->index, archive->count, sizeof(archive_record),
+          compare_offsets);
+    const uint64_t index_offset = archive->end;
+    const size_t index_size = archive->count * sizeof(archive_record);
+    write_fully(archive->fd, archive->index, index_size, index_offset);
+
+    archive_footer footer;
+    memset(&footer, 0, sizeof(footer));
+    memcpy(footer.magic, ARCHIVE_INDEX_MAGIC, 4);
+    footer.version = ARCHIVE_VERSION;
+    footer.count = archive->count;
+    footer.index_offset = index_offset;
+    write_fully(archive->fd, &footer, sizeof(footer),
+                index_offset + index_size);
+    if (ftruncate(archive->fd, index_offset + index_size + sizeof(footer))) {
+        LOG_WARN("Can't trim the frame archive");
+    }
+    fsync(archive->fd);
+    if (archive->direct_fd >= 0) {
+        close(archive->direct_fd);
+        archive->direct_fd = -1;
+    }
+    pthread_mutex_unlock(&(archive->lock));
+}
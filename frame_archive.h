@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define ARCHIVE_FILE_NAME "frames.dua"
+#define ARCHIVE_HALF_FILE_NAME "frames_half.dua"
+#define ARCHIVE_MAGIC "DUPA"
+#define ARCHIVE_RECORD_MAGIC "DUPF"
+#define ARCHIVE_INDEX_MAGIC "DUPI"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_ALIGNMENT 4096
+
+typedef enum {
+    ARCHIVE_COLOR_RGB8 = 0,
+    ARCHIVE_COLOR_PNG = 1
+} archive_color_format;
+
+// Everything is little endian. The file starts with one aligned block
+// holding the magic and version. Every frame is a record header in its own
+// aligned block followed by aligned color and depth chunks, so raw chunks
+// can be memory mapped in place. depth_format is a depth_format value.
+typedef struct {
+    char magic[4];
+    uint32_t ID;
+    uint32_t width;
+    uint32_t height;
+    uint64_t timestamp;
+    uint32_t color_format;
+    uint32_t depth_format;
+    uint64_t color_offset;
+    uint64_t color_size;
+    uint64_t depth_offset;
+    uint64_t depth_size;
+} archive_record;
+
+// Written when the archive is closed: a copy of every record header at an
+// aligned offset, then this footer as the last bytes of the file. An
+// archive without a valid footer is recovered by walking the records.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t count;
+    uint64_t index_offset;
+    uint64_t reserved;
+} archive_footer;
+
+// One append-only archive per session, shared by all consumer threads.
+// Space is reserved under a lock and the frame writer then writes the
+// chunks outside it, so consumers don't serialize on disk I/O. A record
+// header is written after its chunks, so a valid header always means the
+// frame data is on disk, and a frame only enters the index once the writer
+// has committed it. direct_fd is a second O_DIRECT descriptor for
+// page-aligned chunks, or -1.
+typedef struct {
+    int fd;
+    int direct_fd;
+    pthread_mutex_t lock;
+    uint64_t end;
+    archive_record* index;
+    size_t count;
+    size_t capacity;
+    bool closed;
+} frame_archive;
+
+// Creates the archive, replacing whatever was at path
+bool frame_archive_open(frame_archive* archive,
+                        const char* path,
+                        bool direct);
+bool frame_archive_reserve(frame_archive* archive,
+                           archive_record* record,
+                           uint64_t* header_offset);
+// Adds a frame whose chunks and header are all written to the index
+void frame_archive_commit(frame_archive* archive,
+                          const archive_record* record);
+// Every frame still being written has to be committed or given up on
+// first, later commits are ignored
+void frame_archive_close(frame_archive* archive);
+// Rebuilds the index of an archive open for reading from its records, for
+// archives whose writer never got to close them. frame_replay.c uses it.
+size_t frame_archive_recover(frame_archive* archive);
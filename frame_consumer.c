@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_consumer.h"
+#include "png_encode.h"
+#include "depth_encode.h"
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+
+static void add_segment(write_job* job,
+                        const int fd,
+                        const char* path,
+                        const void* data,
+                        const size_t length,
+                        const uint64_t offset) {
+    write_segment* segment = &(job->segments[job->num_segments++]);
+    segment->fd = fd;
+    segment->path[0] = '\0';
+    if (path) {
+        snprintf(segment->path, sizeof(segment->path), "%s", path);
+    }
+    segment->data = data;
+    segment->length = length;
+    segment->offset = offset;
+}
+
+// Raw color still lives in the page-aligned pool buffer at an aligned
+// offset, so with O_DIRECT it can go straight to disk. The length is
+// rounded up to the alignment, which only touches the padding before the
+// depth chunk.
+static void add_archive_color(write_job* job,
+                              const frame_archive* archive,
+                              const archive_record* record,
+                              const void* data,
+                              const bool in_pool) {
+    if (in_pool && archive->direct_fd >= 0) {
+        const size_t length = (record->color_size + ARCHIVE_ALIGNMENT - 1) /
+                              ARCHIVE_ALIGNMENT * ARCHIVE_ALIGNMENT;
+        add_segment(job, archive->direct_fd, NULL, data, length,
+                    record->color_offset);
+    } else {
+        add_segment(job, archive->fd, NULL, data, record->color_size,
+                    record->color_offset);
+    }
+}
+
+void* frame_consumer_thread(void* context_ptr) {
+    consumer_context* context = (consumer_context*) context_ptr;
+    pipe_consumer_t* consumer = context->consumer;
+    png_options options;
+    png_default_options(&options);
+    const depth_format format = depth_default_format();
+    // Raw color is only useful in the archive, where it can be mapped
+    // without decoding
+    const bool raw_archive =
+        context->archive &&
+        strcmp(config_get_str("DEPTH_UPSAMPLE_COLOR_FORMAT", "png"),
+               "raw") == 0;
+
+    buffer_element elem;
+    while (true) {
+        {
+            // Time spent waiting for work
+            TRACE_SCOPE("pipe_pop");
+            if (!pipe_pop(consumer, &elem, 1)) {
+                break;
+            }
+        }
+
+        LOG_DEBUG("Writing frame %u", elem.ID);
+
+        if (context->share) {
+            TRACE_SCOPE("share_publish");
+            frame_share_publish(context->share, elem.ID, elem.width,
+                                elem.height, elem.timestamp, elem.half,
+                                elem.color_image, elem.depth_image);
+        }
+        if (context->share_only) {
+            frame_pool_release(elem.frame);
+            continue;
+        }
+
+        if (context->samples) {
+            // Targets come from the full resolution frame, so the GPU
+            // half resolution copies aren't needed here
+            if (!elem.half) {
+                sample_extract(context->samples, elem.color_image,
+                               elem.depth_image, elem.width, elem.height);
+            }
+            frame_pool_release(elem.frame);
+            continue;
+        }
+
+        // Half frames go to files when their archive couldn't be opened,
+        // and a file is always a PNG
+        frame_archive* archive = elem.half ? context->half_archive :
+                                 context->archive;
+        const bool raw_color = raw_archive && archive;
+        size_t color_length;
+        void* color_data;
+        if (raw_color) {
+            color_length = (size_t) elem.width * elem.height * 3;
+            color_data = elem.color_image;
+        } else {
+            TRACE_SCOPE("png_deflate");
+            color_data = png_encode(elem.color_image,
+                                    elem.width, elem.height,
+                                    3, 8, &options, &color_length);
+        }
+
+        size_t depth_length;
+        void* depth_data;
+        {
+            TRACE_SCOPE("depth_encode");
+            depth_data = depth_encode(elem.depth_image,
+                                      elem.width, elem.height,
+                                      format, &options, &depth_length);
+        }
+
+        write_job job;
+        memset(&job, 0, sizeof(job));
+        job.owned[0] = depth_data;
+        if (raw_color) {
+            // The writer hands the frame back once the color is on disk
+            job.frame = elem.frame;
+        } else {
+            job.owned[1] = color_data;
+            frame_pool_release(elem.frame);
+        }
+
+        if (archive) {
+            TRACE_SCOPE("archive_reserve");
+            archive_record* record =
+                (archive_record*) calloc(1, sizeof(archive_record));
+            record->ID = elem.ID;
+            record->width = elem.width;
+            record->height = elem.height;
+            record->timestamp = elem.timestamp;
+            record->color_format = raw_color ? ARCHIVE_COLOR_RGB8 :
+                                   ARCHIVE_COLOR_PNG;
+            record->depth_format = format;
+            record->color_size = color_length;
+            record->depth_size = depth_length;
+            job.owned[2] = record;
+
+            uint64_t header_offset;
+            if (frame_archive_reserve(archive, record, &header_offset)) {
+                add_archive_color(&job, archive, record, color_data,
+                                  raw_color);
+                add_segment(&job, archive->fd, NULL, depth_data,
+                            depth_length, record->depth_offset);
+                add_segment(&job, archive->fd, NULL, record,
+                            sizeof(archive_record), header_offset);
+                job.archive = archive;
+                job.record = record;
+            }
+        } else {
+            // Half resolution pairs are <ID>_half_color.png and so on
+            const char* infix = elem.half ? "_half" : "";
+            char color_file_path[WRITE_PATH_SIZE];
+            char depth_file_path[WRITE_PATH_SIZE];
+            snprintf(color_file_path, sizeof(color_file_path),
+                     "%s%u%s_color.png", context->output_dir, elem.ID,
+                     infix);
+            snprintf(depth_file_path, sizeof(depth_file_path),
+                     "%s%u%s%s", context->output_dir, elem.ID, infix,
+                     depth_format_suffix(format));
+            add_segment(&job, -1, color_file_path, color_data,
+                        color_length, 0);
+            add_segment(&job, -1, depth_file_path, depth_data,
+                        depth_length, 0);
+        }
+
+        frame_writer_submit(context->writer, &job);
+    }
+    return NULL;
+}
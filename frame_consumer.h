@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <GL/gl.h>
+
+#include "pipe.h"
+#include "frame_pool.h"
+#include "frame_archive.h"
+#include "frame_share.h"
+#include "frame_writer.h"
+#include "sample_extract.h"
+
+typedef unsigned char uchar;
+
+typedef struct {
+    unsigned int ID;
+    GLsizei width;
+    GLsizei height;
+    uint64_t timestamp;
+    uchar* color_image;
+    uchar* depth_image;
+    frame_buffer* frame;
+    // Rendered by the GPU downsample pass rather than read back directly
+    bool half;
+} buffer_element;
+
+// What a consumer thread needs besides the pipe it pops frames from
+typedef struct {
+    pipe_consumer_t* consumer;
+    // Session directory, ending in '/'
+    const char* output_dir;
+    // NULL when every frame is written as its own pair of files
+    frame_archive* archive;
+    // Where half resolution frames go, NULL unless downsampling
+    frame_archive* half_archive;
+    // Set when frames become training samples instead of images
+    sample_shard* samples;
+    // Where frames are published for other processes, NULL if they aren't
+    frame_share* share;
+    // DEPTH_UPSAMPLE_OUTPUT=shm, frames are only published
+    bool share_only;
+    frame_writer* writer;
+} consumer_context;
+
+// Publishes popped frames to the shared memory ring if there is one, then
+// encodes them and hands them to the frame writer, or turns them into
+// training samples. Returns once the pipe is empty and every producer is
+// gone.
+void* frame_consumer_thread(void* context_ptr);
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "frame_dedup.h"
+#include "session.h"
+#include "config.h"
+#include "log.h"
+
+static dedup_mode mode = DEDUP_OFF;
+static float threshold;
+static char tag_path[SESSION_PATH_SIZE + sizeof(DEDUP_FILE_NAME)];
+static FILE* tag_file;
+static bool tag_failed;
+static pthread_mutex_t tag_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_ulong kept;
+static atomic_ulong duplicates;
+
+void frame_dedup_open(const char* output_dir) {
+    const char* setting = config_get_str("DEPTH_UPSAMPLE_DEDUP", "off");
+    if (strcmp(setting, "drop") == 0) {
+        mode = DEDUP_DROP;
+    } else if (strcmp(setting, "tag") == 0) {
+        mode = DEDUP_TAG;
+    } else {
+        if (strcmp(setting, "off") != 0) {
+            LOG_WARN("Unknown dedup mode %s, keeping every frame", setting);
+        }
+        mode = DEDUP_OFF;
+    }
+    if (mode == DEDUP_TAG && !output_dir) {
+        LOG_WARN("No session directory to list duplicates in, keeping "
+                 "every frame");
+        mode = DEDUP_OFF;
+    }
+    threshold = config_get_double("DEPTH_UPSAMPLE_DEDUP_THRESHOLD", 0.005);
+    if (!output_dir) {
+        return;
+    }
+    snprintf(tag_path, sizeof(tag_path), "%s%s", output_dir,
+             DEDUP_FILE_NAME);
+}
+
+dedup_mode frame_dedup_mode() {
+    return mode;
+}
+
+// Center of sample step out of steps across size pixels, so that tiny
+// images still cover every cell
+static GLsizei sample_position(const int step,
+                               const int steps,
+                               const GLsizei size) {
+    return (GLsizei) ((2 * step + 1) * (int64_t) size / (2 * steps));
+}
+
+void frame_signature_compute(frame_signature* signature,
+                             const unsigned char* color,
+                             const unsigned char* depth,
+                             const GLsizei width,
+                             const GLsizei height,
+                             const bool bgra) {
+    const uint16_t* depth16 = (const uint16_t*) depth;
+    const size_t pixel_size = bgra ? 4 : 3;
+    const size_t red = bgra ? 2 : 0;
+    const int steps = DEDUP_SIGNATURE_SIZE * DEDUP_CELL_SAMPLES;
+    const float samples = DEDUP_CELL_SAMPLES * DEDUP_CELL_SAMPLES;
+    for (int cy = 0; cy < DEDUP_SIGNATURE_SIZE; cy++) {
+        for (int cx = 0; cx < DEDUP_SIGNATURE_SIZE; cx++) {
+            float luma = 0.0f;
+            float depth_sum = 0.0f;
+            for (int sy = 0; sy < DEDUP_CELL_SAMPLES; sy++) {
+                const GLsizei y = sample_position(
+                                      cy * DEDUP_CELL_SAMPLES + sy, steps,
+                                      height);
+                for (int sx = 0; sx < DEDUP_CELL_SAMPLES; sx++) {
+                    const GLsizei x = sample_position(
+                                          cx * DEDUP_CELL_SAMPLES + sx, steps,
+                                          width);
+                    const size_t j = (size_t) y * width + x;
+                    const unsigned char* pixel = color + pixel_size * j;
+                    luma += 0.299f * pixel[red] +
+                            0.587f * pixel[1] +
+                            0.114f * pixel[2 - red];
+                    depth_sum += depth16[j];
+                }
+            }
+            const int cell = cy * DEDUP_SIGNATURE_SIZE + cx;
+            signature->luma[cell] = luma / (255.0f * samples);
+            signature->depth[cell] = depth_sum / (65535.0f * samples);
+        }
+    }
+}
+
+float signature_distance(const float* a, const float* b, const int count) {
+    float distance = 0.0f;
+    for (int j = 0; j < count; j++) {
+        distance += fabsf(a[j] - b[j]);
+    }
+    return count ? distance / count : 0.0f;
+}
+
+static void tag_duplicate(const unsigned int ID,
+                          const unsigned int kept_ID,
+                          const float distance) {
+    pthread_mutex_lock(&tag_lock);
+    if (!tag_file && !tag_failed) {
+        tag_file = fopen(tag_path, "a");
+        if (!tag_file) {
+            LOG_ERROR("Can't open %s, duplicates aren't listed", tag_path);
+            tag_failed = true;
+        }
+    }
+    if (tag_file) {
+        fprintf(tag_file, "%u %u %.6f\n", ID, kept_ID, distance);
+    }
+    pthread_mutex_unlock(&tag_lock);
+}
+
+bool frame_dedup_check(frame_dedup* dedup,
+                       const frame_signature* signature,
+                       const unsigned int ID) {
+    if (dedup->have_kept) {
+        const int cells = DEDUP_SIGNATURE_SIZE * DEDUP_SIGNATURE_SIZE;
+        const float luma = signature_distance(signature->luma,
+                                              dedup->kept.luma, cells);
+        const float depth = signature_distance(signature->depth,
+                                               dedup->kept.depth, cells);
+        const float distance = luma > depth ? luma : depth;
+        if (distance < threshold) {
+            atomic_fetch_add(&duplicates, 1);
+            LOG_DEBUG("Frame %u is a duplicate of %u (%f)", ID,
+                      dedup->kept_ID, distance);
+            if (mode == DEDUP_TAG) {
+                tag_duplicate(ID, dedup->kept_ID, distance);
+                return false;
+            }
+            return true;
+        }
+    }
+
+    atomic_fetch_add(&kept, 1);
+    dedup->kept = *signature;
+    dedup->kept_ID = ID;
+    dedup->have_kept = true;
+    return false;
+}
+
+void frame_dedup_report() {
+    pthread_mutex_lock(&tag_lock);
+    if (tag_file) {
+        fclose(tag_file);
+        tag_file = NULL;
+    }
+    pthread_mutex_unlock(&tag_lock);
+    if (mode == DEDUP_OFF) {
+        return;
+    }
+    const unsigned long kept_frames = atomic_load(&kept);
+    const unsigned long duplicate_frames = atomic_load(&duplicates);
+    const unsigned long total = kept_frames + duplicate_frames;
+    LOG_INFO("Kept %lu frames, %s %lu near-duplicates (%.1f%%)", kept_frames,
+             mode == DEDUP_DROP ? "dropped" : "tagged", duplicate_frames,
+             total ? 100.0 * duplicate_frames / total : 0.0);
+}
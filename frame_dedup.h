@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <GL/gl.h>
+
+#define DEDUP_SIGNATURE_SIZE 16
+// Samples per signature cell in each direction
+#define DEDUP_CELL_SAMPLES 4
+#define DEDUP_FILE_NAME "duplicates.txt"
+
+typedef enum {
+    DEDUP_OFF,
+    DEDUP_DROP,
+    DEDUP_TAG
+} dedup_mode;
+
+// Mean luminance and depth over a coarse grid, both scaled to 0-1
+typedef struct {
+    float luma[DEDUP_SIGNATURE_SIZE * DEDUP_SIGNATURE_SIZE];
+    float depth[DEDUP_SIGNATURE_SIZE * DEDUP_SIGNATURE_SIZE];
+} frame_signature;
+
+// Near-duplicate suppression, selected with DEPTH_UPSAMPLE_DEDUP:
+//   off  - every captured frame is written (default)
+//   drop - frames whose luminance and depth signatures both stay within
+//          DEPTH_UPSAMPLE_DEDUP_THRESHOLD (mean absolute difference, 0-1,
+//          default 0.005) of the last kept frame are discarded before they
+//          are copied out of their PBOs
+//   tag  - such frames are written anyway, and their IDs are listed in
+//          DEDUP_FILE_NAME in the session directory as
+//          "<ID> <kept ID> <distance>" lines
+// One per context, frames are compared against the last kept frame of the
+// same context.
+typedef struct {
+    bool have_kept;
+    unsigned int kept_ID;
+    frame_signature kept;
+} frame_dedup;
+
+// Reads the settings, output_dir is where tag mode lists duplicates. It is
+// NULL when the collector writes the session, tag mode is then off.
+void frame_dedup_open(const char* output_dir);
+dedup_mode frame_dedup_mode();
+// Averages a sparse lattice of pixels in every cell, so the cost doesn't
+// depend on the resolution. color is packed RGB8, or BGRA8 if bgra is
+// set, depth 16-bit.
+void frame_signature_compute(frame_signature* signature,
+                             const unsigned char* color,
+                             const unsigned char* depth,
+                             const GLsizei width,
+                             const GLsizei height,
+                             const bool bgra);
+// Mean absolute difference between two signature grids of count cells,
+// also what the scene schedule compares its luminance grids with
+float signature_distance(const float* a, const float* b, const int count);
+// Returns true if the frame should be dropped. Frames that are kept
+// become the reference for the next ones.
+bool frame_dedup_check(frame_dedup* dedup,
+                       const frame_signature* signature,
+                       const unsigned int ID);
+void frame_dedup_report();
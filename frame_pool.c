@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "frame_pool.h"
+#include "log.h"
+
+static size_t page_align(const size_t size) {
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    return (size + page_size - 1) / page_size * page_size;
+}
+
+static size_t frame_capacity(const size_t color_size,
+                             const size_t depth_size) {
+    return page_align(sizeof(frame_buffer)) + page_align(color_size) +
+           page_align(depth_size);
+}
+
+// The whole buffer, header included, is one memfd, so another process can
+// map it and find the images at the same offsets. Sealing its size lets
+// that process trust the size it maps.
+static void* map_shared(const size_t capacity, int* fd) {
+    *fd = memfd_create("depth_upsample_frame",
+                       MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (*fd < 0) {
+        return MAP_FAILED;
+    }
+    void* mem = MAP_FAILED;
+    if (ftruncate(*fd, (off_t) capacity) == 0 &&
+            fcntl(*fd, F_ADD_SEALS,
+                  F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == 0) {
+        mem = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, *fd, 0);
+    }
+    if (mem == MAP_FAILED) {
+        close(*fd);
+        *fd = -1;
+    }
+    return mem;
+}
+
+// Color is packed RGB, depth is 16-bit. Both regions start on a page
+// boundary and MAP_POPULATE faults every page in up front, so the first
+// memcpy out of a PBO doesn't pay for it on the swap thread. Returns NULL
+// if the memory isn't there, the game keeps running without that frame.
+static frame_buffer* allocate_frame(frame_pool* pool,
+                                    const size_t color_size,
+                                    const size_t depth_size) {
+    const size_t header_size = page_align(sizeof(frame_buffer));
+    const size_t capacity = frame_capacity(color_size, depth_size);
+
+    int fd = -1;
+    void* mem = pool->shared ? map_shared(capacity, &fd) :
+                mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        if (pool->failed++ == 0) {
+            LOG_ERROR("Failed to map a %zu byte frame buffer, dropping "
+                      "frames", capacity);
+        } else {
+            LOG_DEBUG("Failed to map a %zu byte frame buffer", capacity);
+        }
+        return NULL;
+    }
+
+    frame_buffer* frame = (frame_buffer*) mem;
+    frame->pool = pool;
+    frame->next = NULL;
+    frame->fd = fd;
+    frame->capacity = capacity;
+    frame->color_size = page_align(color_size);
+    frame->depth_size = page_align(depth_size);
+    frame->color_image = (unsigned char*) mem + header_size;
+    frame->depth_image = frame->color_image + frame->color_size;
+    pool->allocated++;
+    pool->allocated_bytes += capacity;
+    return frame;
+}
+
+static void free_frame(frame_buffer* frame) {
+    frame_pool* pool = frame->pool;
+    pool->allocated--;
+    pool->allocated_bytes -= frame->capacity;
+    const int fd = frame->fd;
+    munmap(frame, frame->capacity);
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+void frame_pool_init(frame_pool* pool, const size_t max_bytes) {
+    pthread_mutex_init(&(pool->lock), NULL);
+    pthread_cond_init(&(pool->released), NULL);
+    pool->free_list = NULL;
+    pool->allocated = 0;
+    pool->allocated_bytes = 0;
+    pool->max_bytes = max_bytes;
+    pool->failed = 0;
+    pool->shared = false;
+    pool->release = NULL;
+}
+
+void frame_pool_share(frame_pool* pool) {
+    pthread_mutex_lock(&(pool->lock));
+    pool->shared = true;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+// A new buffer may be mapped as long as the pool stays within max_bytes.
+// A single frame is always allowed so that one oversized frame can't
+// deadlock the capture.
+static bool can_allocate(frame_pool* pool, const size_t capacity) {
+    return pool->allocated == 0 ||
+           pool->allocated_bytes + capacity <= pool->max_bytes;
+}
+
+// Unlinks the smallest idle buffer that fits, so contexts capturing at
+// different sizes each keep reusing buffers of their own size
+static frame_buffer* take_fitting(frame_pool* pool,
+                                  const size_t color_size,
+                                  const size_t depth_size) {
+    frame_buffer** best = NULL;
+    for (frame_buffer** link = &(pool->free_list); *link;
+            link = &((*link)->next)) {
+        const frame_buffer* frame = *link;
+        if (frame->color_size >= color_size &&
+                frame->depth_size >= depth_size &&
+                (!best || frame->capacity < (*best)->capacity)) {
+            best = link;
+        }
+    }
+    if (!best) {
+        return NULL;
+    }
+    frame_buffer* frame = *best;
+    *best = frame->next;
+    return frame;
+}
+
+static frame_buffer* acquire_frame(frame_pool* pool,
+                                   const GLsizei width,
+                                   const GLsizei height,
+                                   const bool wait) {
+    const size_t color_size = width * height * 3;
+    const size_t depth_size = width * height * sizeof(unsigned short);
+    const size_t capacity = frame_capacity(color_size, depth_size);
+    frame_buffer* frame = NULL;
+
+    pthread_mutex_lock(&(pool->lock));
+    while (true) {
+        frame = take_fitting(pool, color_size, depth_size);
+        if (frame) {
+            break;
+        }
+        // Idle buffers too small for this frame only go when the budget
+        // needs the room
+        while (!can_allocate(pool, capacity) && pool->free_list) {
+            frame_buffer* idle = pool->free_list;
+            pool->free_list = idle->next;
+            free_frame(idle);
+        }
+        // A buffer that fails to map ends the wait too, waiting wouldn't
+        // bring the memory back
+        if (can_allocate(pool, capacity)) {
+            frame = allocate_frame(pool, color_size, depth_size);
+            break;
+        }
+        if (!wait) {
+            break;
+        }
+        pthread_cond_wait(&(pool->released), &(pool->lock));
+    }
+    pthread_mutex_unlock(&(pool->lock));
+
+    if (frame) {
+        frame->next = NULL;
+    }
+    return frame;
+}
+
+frame_buffer* frame_pool_acquire(frame_pool* pool,
+                                 const GLsizei width,
+                                 const GLsizei height) {
+    return acquire_frame(pool, width, height, true);
+}
+
+frame_buffer* frame_pool_try_acquire(frame_pool* pool,
+                                     const GLsizei width,
+                                     const GLsizei height) {
+    return acquire_frame(pool, width, height, false);
+}
+
+void frame_pool_release(frame_buffer* frame) {
+    frame_pool* pool = frame->pool;
+    if (pool->release) {
+        pool->release(frame);
+        return;
+    }
+
+    pthread_mutex_lock(&(pool->lock));
+    frame->next = pool->free_list;
+    pool->free_list = frame;
+    pthread_cond_signal(&(pool->released));
+    pthread_mutex_unlock(&(pool->lock));
+}
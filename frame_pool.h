@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <GL/gl.h>
+
+#define FRAME_POOL_DEFAULT_MB 512
+
+typedef struct frame_pool frame_pool;
+typedef struct frame_buffer frame_buffer;
+
+// A page-aligned, pre-faulted allocation holding one color and one depth
+// image. Buffers travel from the readback ring through the frame pipe to a
+// consumer thread, which hands them back with frame_pool_release(). fd is
+// the memfd behind the buffer if the pool shares them, -1 otherwise.
+struct frame_buffer {
+    frame_pool* pool;
+    frame_buffer* next;
+    int fd;
+    size_t capacity;
+    size_t color_size;
+    size_t depth_size;
+    unsigned char* color_image;
+    unsigned char* depth_image;
+};
+
+// Shared by every captured context. Idle buffers of any size stay on the
+// free list and are handed out best fit, so windows of different sizes
+// don't evict each other's buffers; one only goes when the byte budget
+// needs room for a size nothing idle fits.
+struct frame_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    frame_buffer* free_list;
+    int allocated;
+    size_t allocated_bytes;
+    size_t max_bytes;
+    // Buffers that couldn't be mapped, only the first one is logged as an
+    // error
+    unsigned long failed;
+    // Buffers are memfds that can be passed to another process
+    bool shared;
+    // Set for frames this pool doesn't own, such as the ones the collector
+    // maps from a game, to hand them back instead of recycling them
+    void (*release)(frame_buffer* frame);
+};
+
+void frame_pool_init(frame_pool* pool, const size_t max_bytes);
+// Backs buffers allocated from now on with memfds
+void frame_pool_share(frame_pool* pool);
+// Both return NULL if a new buffer is needed but can't be mapped, the
+// try version also when the budget has no room for it
+frame_buffer* frame_pool_acquire(frame_pool* pool,
+                                 const GLsizei width,
+                                 const GLsizei height);
+frame_buffer* frame_pool_try_acquire(frame_pool* pool,
+                                     const GLsizei width,
+                                     const GLsizei height);
+void frame_pool_release(frame_buffer* frame);
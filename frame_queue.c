@@ -0,0 +1,151 @@
+#include <string.h>
+
+#include "frame_queue.h"
+#include "frame_consumer.h"
+#include "config.h"
+#include "log.h"
+
+void frame_queue_init(frame_queue* queue, frame_pool* pool, pipe_t* pipe) {
+    const char* policy = config_get_str("DEPTH_UPSAMPLE_QUEUE_POLICY",
+                                        "block");
+    if (strcmp(policy, "drop-newest") == 0) {
+        queue->policy = QUEUE_DROP_NEWEST;
+    } else if (strcmp(policy, "drop-oldest") == 0) {
+        queue->policy = QUEUE_DROP_OLDEST;
+    } else if (strcmp(policy, "degrade") == 0) {
+        queue->policy = QUEUE_DEGRADE;
+    } else {
+        if (strcmp(policy, "block") != 0) {
+            LOG_WARN("Unknown queue policy %s, using block", policy);
+        }
+        queue->policy = QUEUE_BLOCK;
+    }
+
+    queue->pool = pool;
+    queue->producer = pipe_producer_new(pipe);
+    queue->reclaimer = queue->policy == QUEUE_DROP_OLDEST ?
+                       pipe_consumer_new(pipe) : NULL;
+    pthread_mutex_init(&(queue->lock), NULL);
+    queue->closed = false;
+    atomic_init(&(queue->pushed), 0);
+    atomic_init(&(queue->dropped), 0);
+    atomic_init(&(queue->degraded), 0);
+}
+
+static void count_drop(frame_queue* queue) {
+    if (atomic_fetch_add(&(queue->dropped), 1) == 0) {
+        LOG_WARN("Capture queue is full, dropping frames");
+    }
+}
+
+frame_buffer* frame_queue_acquire(frame_queue* queue,
+                                  const GLsizei width,
+                                  const GLsizei height,
+                                  bool* degraded) {
+    *degraded = false;
+    // A buffer that can't be mapped is a dropped frame, whatever the
+    // policy
+    if (queue->policy == QUEUE_BLOCK) {
+        frame_buffer* frame = frame_pool_acquire(queue->pool, width, height);
+        if (!frame) {
+            count_drop(queue);
+        }
+        return frame;
+    }
+
+    frame_buffer* frame = frame_pool_try_acquire(queue->pool, width, height);
+    if (frame) {
+        return frame;
+    }
+
+    switch (queue->policy) {
+        case QUEUE_DROP_OLDEST: {
+            buffer_element oldest;
+            while (pipe_pop_eager(queue->reclaimer, &oldest, 1)) {
+                frame_pool_release(oldest.frame);
+                count_drop(queue);
+                frame = frame_pool_try_acquire(queue->pool, width, height);
+                if (frame) {
+                    return frame;
+                }
+            }
+            // Everything is held by consumers that are mid-write
+            frame = frame_pool_acquire(queue->pool, width, height);
+            if (!frame) {
+                count_drop(queue);
+            }
+            return frame;
+        }
+        case QUEUE_DEGRADE:
+            frame = frame_pool_try_acquire(queue->pool, half_size(width),
+                                           half_size(height));
+            if (frame) {
+                if (atomic_fetch_add(&(queue->degraded), 1) == 0) {
+                    LOG_WARN("Capture queue is full, degrading frames");
+                }
+                *degraded = true;
+                return frame;
+            }
+            count_drop(queue);
+            return NULL;
+        default:
+            count_drop(queue);
+            return NULL;
+    }
+}
+
+void frame_queue_push(frame_queue* queue, const void* elem) {
+    pthread_mutex_lock(&(queue->lock));
+    if (queue->closed) {
+        pthread_mutex_unlock(&(queue->lock));
+        frame_pool_release(((const buffer_element*) elem)->frame);
+        count_drop(queue);
+        return;
+    }
+    pipe_push(queue->producer, elem, 1);
+    pthread_mutex_unlock(&(queue->lock));
+    atomic_fetch_add(&(queue->pushed), 1);
+}
+
+void frame_queue_close(frame_queue* queue) {
+    pthread_mutex_lock(&(queue->lock));
+    if (!queue->closed) {
+        queue->closed = true;
+        pipe_producer_free(queue->producer);
+    }
+    pthread_mutex_unlock(&(queue->lock));
+}
+
+void frame_queue_report(frame_queue* queue) {
+    const unsigned long dropped = atomic_load(&(queue->dropped));
+    const unsigned long degraded = atomic_load(&(queue->degraded));
+    LOG_AT(dropped || degraded ? LOG_LEVEL_WARN : LOG_LEVEL_INFO,
+           "Captured %lu frames, dropped %lu, degraded %lu",
+           atomic_load(&(queue->pushed)), dropped, degraded);
+}
+
+GLsizei half_size(const GLsizei size) {
+    const GLsizei half = size / 2 + (size % 4 == 3 ? 1 : 0);
+    return half > 0 ? half : 1;
+}
+
+// Nearest-sample 2x decimation, picking the same pixels as downsample() in
+// process_data.py does after it flips the image upright.
+void downsample_pixels(unsigned char* dst,
+                       const unsigned char* src,
+                       const GLsizei x_res,
+                       const GLsizei y_res,
+                       const size_t pixel_size) {
+    const GLsizei out_x = half_size(x_res);
+    const GLsizei out_y = half_size(y_res);
+    for (GLsizei y = 0; y < out_y; y++) {
+        const GLsizei src_y = y_res - 1 - 2 * (out_y - 1 - y);
+        const unsigned char* src_row = src + (size_t) src_y * x_res *
+                                       pixel_size;
+        unsigned char* dst_row = dst + (size_t) y * out_x * pixel_size;
+        for (GLsizei x = 0; x < out_x; x++) {
+            memcpy(dst_row + x * pixel_size, src_row + 2 * x * pixel_size,
+                   pixel_size);
+        }
+    }
+}
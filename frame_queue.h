@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <GL/gl.h>
+
+#include "pipe.h"
+#include "frame_pool.h"
+
+typedef enum {
+    QUEUE_BLOCK,
+    QUEUE_DROP_NEWEST,
+    QUEUE_DROP_OLDEST,
+    QUEUE_DEGRADE
+} queue_policy;
+
+// Producer side of the frame pipe. The pool's byte budget
+// (DEPTH_UPSAMPLE_QUEUE_MB) is the queue limit, and
+// DEPTH_UPSAMPLE_QUEUE_POLICY decides what happens when a captured frame
+// doesn't fit in it:
+//   block       - wait on the swap thread until a consumer frees a buffer
+//   drop-newest - discard the frame that was just read back
+//   drop-oldest - discard the oldest frame still waiting in the pipe
+//   degrade     - keep the frame at half resolution, dropping it only if
+//                 even that doesn't fit
+typedef struct {
+    queue_policy policy;
+    frame_pool* pool;
+    pipe_producer_t* producer;
+    // Consumer handle used only to pull stale frames back out of the pipe
+    pipe_consumer_t* reclaimer;
+    // Taken by pushes, so closing can't free the producer under one
+    pthread_mutex_t lock;
+    bool closed;
+    _Atomic unsigned long pushed;
+    _Atomic unsigned long dropped;
+    _Atomic unsigned long degraded;
+} frame_queue;
+
+void frame_queue_init(frame_queue* queue, frame_pool* pool, pipe_t* pipe);
+frame_buffer* frame_queue_acquire(frame_queue* queue,
+                                  const GLsizei width,
+                                  const GLsizei height,
+                                  bool* degraded);
+void frame_queue_push(frame_queue* queue, const void* elem);
+// Lets consumers return once they have popped what was pushed so far.
+// Frames pushed afterwards are dropped.
+void frame_queue_close(frame_queue* queue);
+void frame_queue_report(frame_queue* queue);
+// Half of size rounded the way cv2.resize(fx=0.5) sizes its output, half
+// to even (33 gives 16, 35 gives 18), but at least 1
+GLsizei half_size(const GLsizei size);
+// Nearest-sample 2x decimation of an x_res by y_res image into the
+// half_size(x_res) by half_size(y_res) a degraded frame holds
+void downsample_pixels(unsigned char* dst,
+                       const unsigned char* src,
+                       const GLsizei x_res,
+                       const GLsizei y_res,
+                       const size_t pixel_size);
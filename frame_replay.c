@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "miniz.h"
+#include "frame_replay.h"
+#include "depth_encode.h"
+#include "byte_swap.h"
+#include "log.h"
+
+static const depth_format depth_formats[] = {
+    DEPTH_FORMAT_PGM, DEPTH_FORMAT_RAW, DEPTH_FORMAT_PNG16, DEPTH_FORMAT_DELTA
+};
+
+static uint32_t get_u32_be(const unsigned char* in) {
+    return ((uint32_t) in[0] << 24) | ((uint32_t) in[1] << 16) |
+           ((uint32_t) in[2] << 8) | in[3];
+}
+
+static uint32_t get_u32_le(const unsigned char* in) {
+    return in[0] | ((uint32_t) in[1] << 8) | ((uint32_t) in[2] << 16) |
+           ((uint32_t) in[3] << 24);
+}
+
+static unsigned char paeth(const int a, const int b, const int c) {
+    const int p = a + b - c;
+    const int pa = abs(p - a);
+    const int pb = abs(p - b);
+    const int pc = abs(p - c);
+    return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+// Just what png_encode() writes: one image, non-interlaced, 8-bit RGB or
+// 16-bit gray, any filter. Returns the unfiltered rows, 16-bit samples in
+// host order.
+static unsigned char* decode_png(const unsigned char* png,
+                                 const size_t length,
+                                 const int channels,
+                                 const int bit_depth,
+                                 int* width,
+                                 int* height) {
+    static const unsigned char signature[] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+    if (length < sizeof(signature) + 25 ||
+            memcmp(png, signature, sizeof(signature)) != 0) {
+        return NULL;
+    }
+
+    unsigned char* idat = NULL;
+    size_t idat_length = 0;
+    bool valid_header = false;
+    size_t offset = sizeof(signature);
+    while (offset + 12 <= length) {
+        const uint32_t chunk_length = get_u32_be(png + offset);
+        const unsigned char* type = png + offset + 4;
+        const unsigned char* data = png + offset + 8;
+        if (chunk_length > length - offset - 12) {
+            break;
+        }
+        if (memcmp(type, "IHDR", 4) == 0 && chunk_length == 13) {
+            *width = get_u32_be(data);
+            *height = get_u32_be(data + 4);
+            valid_header = data[8] == bit_depth &&
+                           data[9] == (channels == 3 ? 2 : 0) &&
+                           data[12] == 0;
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            idat = (unsigned char*) realloc(idat, idat_length + chunk_length);
+            memcpy(idat + idat_length, data, chunk_length);
+            idat_length += chunk_length;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+        offset += 12 + chunk_length;
+    }
+    if (!valid_header || !idat || *width <= 0 || *height <= 0) {
+        free(idat);
+        return NULL;
+    }
+
+    const size_t pixel_size = channels * bit_depth / 8;
+    const size_t row_size = pixel_size * *width;
+    mz_ulong filtered_length = (row_size + 1) * *height;
+    unsigned char* filtered = (unsigned char*) malloc(filtered_length);
+    const int status = mz_uncompress(filtered, &filtered_length, idat,
+                                     idat_length);
+    free(idat);
+    if (status != MZ_OK || filtered_length != (row_size + 1) * *height) {
+        free(filtered);
+        return NULL;
+    }
+
+    unsigned char* image = (unsigned char*) malloc(row_size * *height);
+    for (int y = 0; y < *height; y++) {
+        const unsigned char filter = filtered[y * (row_size + 1)];
+        const unsigned char* in = filtered + y * (row_size + 1) + 1;
+        unsigned char* row = image + y * row_size;
+        const unsigned char* up = y > 0 ? row - row_size : NULL;
+        for (size_t x = 0; x < row_size; x++) {
+            const int a = x >= pixel_size ? row[x - pixel_size] : 0;
+            const int b = up ? up[x] : 0;
+            const int c = up && x >= pixel_size ? up[x - pixel_size] : 0;
+            switch (filter) {
+                case PNG_FILTER_SUB:
+                    row[x] = in[x] + a;
+                    break;
+                case PNG_FILTER_UP:
+                    row[x] = in[x] + b;
+                    break;
+                case PNG_FILTER_AVERAGE:
+                    row[x] = in[x] + (a + b) / 2;
+                    break;
+                case PNG_FILTER_PAETH:
+                    row[x] = in[x] + paeth(a, b, c);
+                    break;
+                default:
+                    row[x] = in[x];
+            }
+        }
+    }
+    free(filtered);
+
+    if (bit_depth == 16) {
+        swap_bytes16(image, image, (size_t) *width * *height * channels);
+    }
+    return image;
+}
+
+static unsigned char* decode_pgm(const unsigned char* pgm,
+                                 const size_t length,
+                                 int* width,
+                                 int* height) {
+    char header[64];
+    const size_t header_size = length < sizeof(header) - 1 ? length :
+                               sizeof(header) - 1;
+    memcpy(header, pgm, header_size);
+    header[header_size] = '\0';
+    int max_value;
+    int header_length = 0;
+    if (sscanf(header, "P5 %d %d %d%n", width, height, &max_value,
+               &header_length) != 3 || max_value != 65535 ||
+            *width <= 0 || *height <= 0) {
+        return NULL;
+    }
+    // One whitespace character ends the header
+    header_length++;
+    const size_t samples = (size_t) *width * *height;
+    if (length < header_length + 2 * samples) {
+        return NULL;
+    }
+    unsigned char* depth = (unsigned char*) malloc(2 * samples);
+    swap_bytes16(depth, pgm + header_length, samples);
+    return depth;
+}
+
+static bool parse_header(const unsigned char* in,
+                         const size_t length,
+                         const char* magic,
+                         int* width,
+                         int* height) {
+    if (length < DEPTH_HEADER_SIZE || memcmp(in, magic, 4) != 0) {
+        return false;
+    }
+    *width = get_u32_le(in + 8);
+    *height = get_u32_le(in + 12);
+    return *width > 0 && *height > 0;
+}
+
+// Undoes encode_delta(): zigzag residuals from the high and low byte
+// planes, plus the left + up - up_left prediction
+static unsigned char* decode_delta(const unsigned char* in,
+                                   const size_t length,
+                                   int* width,
+                                   int* height) {
+    if (!parse_header(in, length, DEPTH_DELTA_MAGIC, width, height)) {
+        return NULL;
+    }
+    const size_t samples = (size_t) *width * *height;
+    mz_ulong planes_length = 2 * samples;
+    unsigned char* planes = (unsigned char*) malloc(planes_length);
+    if (mz_uncompress(planes, &planes_length, in + DEPTH_HEADER_SIZE,
+                      length - DEPTH_HEADER_SIZE) != MZ_OK ||
+            planes_length != 2 * samples) {
+        free(planes);
+        return NULL;
+    }
+
+    const unsigned char* high = planes;
+    const unsigned char* low = planes + samples;
+    uint16_t* depth = (uint16_t*) malloc(2 * samples);
+    for (int y = 0; y < *height; y++) {
+        uint16_t* row = depth + (size_t) y * *width;
+        const uint16_t* up = y > 0 ? row - *width : NULL;
+        for (int x = 0; x < *width; x++) {
+            const size_t j = (size_t) y * *width + x;
+            const uint16_t zigzag = (uint16_t) (high[j] << 8) | low[j];
+            const uint16_t residual = (zigzag >> 1) ^ (uint16_t) -(zigzag & 1);
+            const uint16_t left = x > 0 ? row[x - 1] : 0;
+            const uint16_t above = up ? up[x] : 0;
+            const uint16_t above_left = up && x > 0 ? up[x - 1] : 0;
+            row[x] = (uint16_t) (residual + left + above - above_left);
+        }
+    }
+    free(planes);
+    return (unsigned char*) depth;
+}
+
+static unsigned char* decode_depth(const unsigned char* in,
+                                   const size_t length,
+                                   const depth_format format,
+                                   int* width,
+                                   int* height) {
+    switch (format) {
+        case DEPTH_FORMAT_RAW: {
+            if (!parse_header(in, length, DEPTH_RAW_MAGIC, width, height) ||
+                    length < DEPTH_HEADER_SIZE +
+                    2 * (size_t) *width * *height) {
+                return NULL;
+            }
+            unsigned char* depth = (unsigned char*) malloc(
+                                       2 * (size_t) *width * *height);
+            memcpy(depth, in + DEPTH_HEADER_SIZE,
+                   2 * (size_t) *width * *height);
+            return depth;
+        }
+        case DEPTH_FORMAT_PNG16:
+            return decode_png(in, length, 1, 16, width, height);
+        case DEPTH_FORMAT_DELTA:
+            return decode_delta(in, length, width, height);
+        default:
+            return decode_pgm(in, length, width, height);
+    }
+}
+
+static unsigned char* read_chunk(const int fd,
+                                 const uint64_t offset,
+                                 const size_t length) {
+    unsigned char* data = (unsigned char*) malloc(length);
+    if (pread(fd, data, length, offset) != (ssize_t) length) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+static unsigned char* read_file(const char* path, size_t* length) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    *length = st.st_size;
+    unsigned char* data = read_chunk(fd, 0, *length);
+    close(fd);
+    return data;
+}
+
+static int compare_records(const void* a, const void* b) {
+    const archive_record* x = (const archive_record*) a;
+    const archive_record* y = (const archive_record*) b;
+    return (x->ID > y->ID) - (x->ID < y->ID);
+}
+
+static bool open_archive(frame_replay* replay, const char* path) {
+    replay->fd = open(path, O_RDONLY);
+    if (replay->fd < 0) {
+        return false;
+    }
+    // Walking the records also finds the frames of a session that never
+    // got to write its index
+    frame_archive archive;
+    memset(&archive, 0, sizeof(archive));
+    archive.fd = replay->fd;
+    replay->count = frame_archive_recover(&archive);
+    replay->records = archive.index;
+    return true;
+}
+
+// Any <ID>_color.png with a depth file next to it, in whatever format.
+// Half resolution pairs are left out.
+static bool open_directory(frame_replay* replay, const char* path) {
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return false;
+    }
+    snprintf(replay->dir, sizeof(replay->dir), "%s%s", path,
+             path[strlen(path) - 1] == '/' ? "" : "/");
+
+    size_t capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        unsigned int ID;
+        int name_length = 0;
+        if (sscanf(entry->d_name, "%u_color.png%n", &ID, &name_length) != 1 ||
+                entry->d_name[name_length] != '\0') {
+            continue;
+        }
+        char color_path[SESSION_PATH_SIZE + 32];
+        snprintf(color_path, sizeof(color_path), "%s%s", replay->dir,
+                 entry->d_name);
+        struct stat st;
+        if (stat(color_path, &st) != 0) {
+            continue;
+        }
+        if (replay->count == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            replay->records = (archive_record*) realloc(
+                                  replay->records,
+                                  capacity * sizeof(archive_record));
+        }
+        archive_record* record = &(replay->records[replay->count++]);
+        memset(record, 0, sizeof(archive_record));
+        record->ID = ID;
+        record->timestamp = (uint64_t) st.st_mtim.tv_sec * 1000000000ull +
+                            st.st_mtim.tv_nsec;
+    }
+    closedir(dir);
+    return true;
+}
+
+bool frame_replay_open(frame_replay* replay, const char* path) {
+    memset(replay, 0, sizeof(frame_replay));
+    replay->fd = -1;
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        LOG_ERROR("Can't find %s", path);
+        return false;
+    }
+    bool opened;
+    if (S_ISDIR(st.st_mode)) {
+        char archive_path[SESSION_PATH_SIZE + sizeof(ARCHIVE_FILE_NAME)];
+        snprintf(archive_path, sizeof(archive_path), "%s/%s", path,
+                 ARCHIVE_FILE_NAME);
+        opened = access(archive_path, R_OK) == 0 ?
+                 open_archive(replay, archive_path) :
+                 open_directory(replay, path);
+    } else {
+        opened = open_archive(replay, path);
+    }
+    if (!opened) {
+        LOG_ERROR("Can't read frames from %s", path);
+        return false;
+    }
+
+    // Consumers finish frames out of order
+    qsort(replay->records, replay->count, sizeof(archive_record),
+          compare_records);
+    LOG_INFO("Replaying %zu frames from %s", replay->count, path);
+    return true;
+}
+
+static bool read_archive_frame(frame_replay* replay,
+                               const archive_record* record,
+                               replay_frame* frame) {
+    unsigned char* color = read_chunk(replay->fd, record->color_offset,
+                                      record->color_size);
+    unsigned char* depth = read_chunk(replay->fd, record->depth_offset,
+                                      record->depth_size);
+    if (!color || !depth) {
+        free(color);
+        free(depth);
+        return false;
+    }
+
+    int width = record->width;
+    int height = record->height;
+    if (record->color_format == ARCHIVE_COLOR_PNG) {
+        frame->color_image = decode_png(color, record->color_size, 3, 8,
+                                        &width, &height);
+        free(color);
+    } else if (record->color_size == (size_t) width * height * 3) {
+        frame->color_image = color;
+    } else {
+        free(color);
+    }
+    int depth_width = 0;
+    int depth_height = 0;
+    frame->depth_image = decode_depth(depth, record->depth_size,
+                                      (depth_format) record->depth_format,
+                                      &depth_width, &depth_height);
+    free(depth);
+    frame->width = width;
+    frame->height = height;
+    return frame->color_image && frame->depth_image &&
+           width == (int) record->width && height == (int) record->height &&
+           depth_width == width && depth_height == height;
+}
+
+static bool read_file_frame(frame_replay* replay,
+                            const archive_record* record,
+                            replay_frame* frame) {
+    char path[SESSION_PATH_SIZE + 32];
+    snprintf(path, sizeof(path), "%s%u_color.png", replay->dir, record->ID);
+    size_t length;
+    unsigned char* color = read_file(path, &length);
+    if (!color) {
+        return false;
+    }
+    frame->color_image = decode_png(color, length, 3, 8, &(frame->width),
+                                    &(frame->height));
+    free(color);
+
+    for (size_t j = 0; j < sizeof(depth_formats) / sizeof(depth_format) &&
+            !frame->depth_image; j++) {
+        snprintf(path, sizeof(path), "%s%u%s", replay->dir, record->ID,
+                 depth_format_suffix(depth_formats[j]));
+        unsigned char* depth = read_file(path, &length);
+        if (depth) {
+            int width = 0;
+            int height = 0;
+            frame->depth_image = decode_depth(depth, length, depth_formats[j],
+                                              &width, &height);
+            free(depth);
+            if (width != frame->width || height != frame->height) {
+                free(frame->depth_image);
+                frame->depth_image = NULL;
+            }
+        }
+    }
+    return frame->color_image && frame->depth_image;
+}
+
+bool frame_replay_next(frame_replay* replay, replay_frame* frame) {
+    while (replay->next < replay->count) {
+        const archive_record* record = &(replay->records[replay->next++]);
+        memset(frame, 0, sizeof(replay_frame));
+        frame->ID = record->ID;
+        frame->timestamp = record->timestamp;
+        const bool decoded = replay->fd >= 0 ?
+                             read_archive_frame(replay, record, frame) :
+                             read_file_frame(replay, record, frame);
+        if (decoded) {
+            return true;
+        }
+        LOG_WARN("Can't decode frame %u, skipping it", record->ID);
+        replay_frame_free(frame);
+    }
+    return false;
+}
+
+void frame_replay_close(frame_replay* replay) {
+    if (replay->fd >= 0) {
+        close(replay->fd);
+    }
+    free(replay->records);
+    replay->records = NULL;
+    replay->count = 0;
+}
+
+void replay_frame_free(replay_frame* frame) {
+    free(frame->color_image);
+    free(frame->depth_image);
+    frame->color_image = NULL;
+    frame->depth_image = NULL;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "frame_archive.h"
+#include "session.h"
+
+// One decoded frame, laid out the way it was read back: packed RGB8 color
+// and host order 16-bit depth, bottom row first
+typedef struct {
+    unsigned int ID;
+    int width;
+    int height;
+    // Capture time in ns, see frame_replay_open()
+    uint64_t timestamp;
+    unsigned char* color_image;
+    unsigned char* depth_image;
+} replay_frame;
+
+// Reads back what an earlier session captured, in capture order: either a
+// frames.dua archive or a directory of <ID>_color.png and <ID>_depth.*
+// pairs, in any color and depth format hooks.so writes. Archive records
+// carry their capture timestamps. Loose files don't, so their modification
+// time stands in for it, which is when the consumer finished the frame.
+typedef struct {
+    // Archive descriptor, -1 when reading a directory
+    int fd;
+    char dir[SESSION_PATH_SIZE];
+    // Archive records, or just IDs and timestamps for a directory
+    archive_record* records;
+    size_t count;
+    size_t next;
+} frame_replay;
+
+// path is an archive, or a session directory. A directory holding a
+// frames.dua is read through the archive.
+bool frame_replay_open(frame_replay* replay, const char* path);
+// Decodes the next frame. Frames that can't be read or decoded are skipped
+// with a warning. Returns false after the last one.
+bool frame_replay_next(frame_replay* replay, replay_frame* frame);
+void frame_replay_close(frame_replay* replay);
+void replay_frame_free(replay_frame* frame);
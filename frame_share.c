@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame_share.h"
+#include "config.h"
+#include "log.h"
+
+static uint64_t align_up(const uint64_t offset, const uint64_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Pid of the process still publishing into the ring under name, or 0 if
+// there is none or it has exited without closing it
+static uint64_t live_owner(const char* name) {
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return 0;
+    }
+    share_header header;
+    uint64_t owner = 0;
+    if (read(fd, &header, sizeof(header)) == (ssize_t) sizeof(header) &&
+            memcmp(header.magic, SHARE_MAGIC, sizeof(header.magic)) == 0 &&
+            !header.closed && header.pid != (uint64_t) getpid() &&
+            (kill((pid_t) header.pid, 0) == 0 || errno == EPERM)) {
+        owner = header.pid;
+    }
+    close(fd);
+    return owner;
+}
+
+bool frame_share_open(frame_share* share, const bool share_only) {
+    memset(share, 0, sizeof(frame_share));
+    const char* name = config_get_str("DEPTH_UPSAMPLE_SHM",
+                                      share_only ? SHARE_DEFAULT_NAME : "");
+    if (!name[0]) {
+        return false;
+    }
+    // shm_open wants exactly one leading slash
+    snprintf(share->name, sizeof(share->name), "%s%s",
+             name[0] == '/' ? "" : "/", name);
+
+    int slots = config_get_int("DEPTH_UPSAMPLE_SHM_SLOTS",
+                               SHARE_DEFAULT_SLOTS);
+    if (slots < 1) {
+        slots = 1;
+    } else if (slots > SHARE_MAX_SLOTS) {
+        slots = SHARE_MAX_SLOTS;
+    }
+    const uint64_t slot_size = align_up(
+                                   (uint64_t) config_get_int(
+                                       "DEPTH_UPSAMPLE_SHM_SLOT_MB",
+                                       SHARE_DEFAULT_SLOT_MB) << 20,
+                                   SHARE_HEADER_SIZE);
+    share->size = SHARE_HEADER_SIZE + slots * slot_size;
+
+    // Another hooked process keeps its ring, this one goes without
+    const uint64_t owner = live_owner(share->name);
+    if (owner) {
+        LOG_ERROR("Process %llu is publishing frames in %s, set "
+                  "DEPTH_UPSAMPLE_SHM to share these under another name",
+                  (unsigned long long) owner, share->name);
+        return false;
+    }
+    // A ring left behind by an earlier run may have another layout, and
+    // its readers hold on to the old object once the name is gone
+    shm_unlink(share->name);
+    const int fd = shm_open(share->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        LOG_ERROR("Can't create shared memory %s, frames aren't shared",
+                  share->name);
+        return false;
+    }
+    if (ftruncate(fd, (off_t) share->size) != 0) {
+        LOG_ERROR("Can't size shared memory %s to %zu bytes", share->name,
+                  share->size);
+        close(fd);
+        shm_unlink(share->name);
+        return false;
+    }
+    void* base = mmap(NULL, share->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+    struct stat st;
+    fstat(fd, &st);
+    share->inode = st.st_ino;
+    close(fd);
+    if (base == MAP_FAILED) {
+        LOG_ERROR("Can't map shared memory %s", share->name);
+        shm_unlink(share->name);
+        return false;
+    }
+    share->base = (unsigned char*) base;
+    share->header = (share_header*) base;
+
+    // ftruncate zero-filled everything, so every slot starts unwritten.
+    // The magic goes last so readers never see a half-made header.
+    share_header* header = share->header;
+    header->version = SHARE_VERSION;
+    header->slot_count = (uint32_t) slots;
+    header->slot_size = slot_size;
+    header->slots_offset = SHARE_HEADER_SIZE;
+    header->pid = (uint64_t) getpid();
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, SHARE_MAGIC, sizeof(header->magic));
+    atomic_init(&(share->shared), 0);
+    atomic_init(&(share->skipped), 0);
+    LOG_INFO("Sharing frames in %s, %i slots of %llu MB", share->name,
+             slots, (unsigned long long) (slot_size >> 20));
+    return true;
+}
+
+void frame_share_publish(frame_share* share,
+                         const uint32_t ID,
+                         const uint32_t width,
+                         const uint32_t height,
+                         const uint64_t timestamp,
+                         const bool half,
+                         const unsigned char* color,
+                         const unsigned char* depth) {
+    share_header* header = share->header;
+    const uint64_t color_size = (uint64_t) width * height * 3;
+    const uint64_t depth_size = (uint64_t) width * height * 2;
+    const uint64_t depth_offset = align_up(SHARE_SLOT_HEADER_SIZE +
+                                           color_size, SHARE_ALIGNMENT);
+    if (depth_offset + depth_size > header->slot_size) {
+        if (atomic_fetch_add(&(share->skipped), 1) == 0) {
+            LOG_WARN("Frames of (%u, %u) don't fit the shared memory slots, "
+                     "raise DEPTH_UPSAMPLE_SHM_SLOT_MB", width, height);
+        }
+        return;
+    }
+
+    const uint64_t ticket = atomic_fetch_add(&(header->published), 1) + 1;
+    share_slot* slot = (share_slot*) (share->base + header->slots_offset +
+                                      (ticket - 1) % header->slot_count *
+                                      header->slot_size);
+    // Another consumer still writing the frame from slot_count tickets
+    // ago keeps the slot, this frame is the one that goes
+    uint64_t sequence = atomic_load_explicit(&(slot->sequence),
+                                             memory_order_relaxed);
+    if ((sequence & 1) ||
+            !atomic_compare_exchange_strong_explicit(
+                &(slot->sequence), &sequence, sequence + 1,
+                memory_order_relaxed, memory_order_relaxed)) {
+        atomic_fetch_add(&(share->skipped), 1);
+        return;
+    }
+    // The odd sequence has to be visible before any of the frame is
+    atomic_thread_fence(memory_order_release);
+
+    slot->ticket = ticket;
+    slot->timestamp = timestamp;
+    slot->ID = ID;
+    slot->width = width;
+    slot->height = height;
+    slot->flags = half ? SHARE_FRAME_HALF : 0;
+    slot->color_offset = SHARE_SLOT_HEADER_SIZE;
+    slot->depth_offset = depth_offset;
+    memcpy((unsigned char*) slot + SHARE_SLOT_HEADER_SIZE, color,
+           color_size);
+    memcpy((unsigned char*) slot + depth_offset, depth, depth_size);
+
+    atomic_store_explicit(&(slot->sequence), sequence + 2,
+                          memory_order_release);
+    atomic_fetch_add(&(share->shared), 1);
+}
+
+// The name may have been taken over after this process was thought dead
+static bool owns_name(const frame_share* share) {
+    const int fd = shm_open(share->name, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    const bool owned = fstat(fd, &st) == 0 && st.st_ino == share->inode;
+    close(fd);
+    return owned;
+}
+
+void frame_share_close(frame_share* share) {
+    atomic_store(&(share->header->closed), 1);
+    if (owns_name(share)) {
+        shm_unlink(share->name);
+    }
+    const unsigned long skipped = atomic_load(&(share->skipped));
+    LOG_AT(skipped ? LOG_LEVEL_WARN : LOG_LEVEL_INFO,
+           "Shared %lu frames in %s, skipped %lu",
+           atomic_load(&(share->shared)), share->name, skipped);
+}
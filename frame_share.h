@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define SHARE_MAGIC "DUPS"
+#define SHARE_VERSION 1
+#define SHARE_DEFAULT_NAME "/depth_upsample"
+#define SHARE_NAME_SIZE 256
+#define SHARE_DEFAULT_SLOTS 4
+#define SHARE_MAX_SLOTS 64
+// Room for a 3840x2160 color/depth pair
+#define SHARE_DEFAULT_SLOT_MB 48
+#define SHARE_HEADER_SIZE 4096
+#define SHARE_SLOT_HEADER_SIZE 64
+#define SHARE_ALIGNMENT 64
+#define SHARE_FRAME_HALF 1
+
+// Everything is little endian. The shared memory object starts with this
+// header in its own page, followed by slot_count slots every slot_size
+// bytes. Layouts are mirrored in processing/frame_share.py.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t slot_count;
+    // Set once the capturing process has exited
+    _Atomic uint32_t closed;
+    uint64_t slot_size;
+    uint64_t slots_offset;
+    // Tickets handed out so far, frame K was published with ticket K + 1
+    _Atomic uint64_t published;
+    uint64_t pid;
+    uint64_t reserved;
+} share_header;
+
+// Seqlock: sequence is odd while the slot is being written and goes up by
+// two for every frame, 0 means the slot was never written. Readers take
+// the fields and pixels between two reads of an even, unchanged sequence.
+// Color is packed RGB8 at color_offset and depth 16-bit at depth_offset,
+// both from the start of the slot and bottom row first as read back.
+typedef struct {
+    _Atomic uint64_t sequence;
+    uint64_t ticket;
+    uint64_t timestamp;
+    uint32_t ID;
+    uint32_t width;
+    uint32_t height;
+    uint32_t flags;
+    uint64_t color_offset;
+    uint64_t depth_offset;
+    uint64_t reserved;
+} share_slot;
+
+_Static_assert(sizeof(share_slot) == SHARE_SLOT_HEADER_SIZE,
+               "share_slot must fill its header");
+
+// Live frames for other processes, published by the consumer threads
+// before they encode anything. DEPTH_UPSAMPLE_SHM names the POSIX shared
+// memory object (e.g. /depth_upsample), DEPTH_UPSAMPLE_SHM_SLOTS (default
+// SHARE_DEFAULT_SLOTS) frames are kept, each up to DEPTH_UPSAMPLE_SHM_SLOT_MB
+// megabytes. Only the pages frames actually touch take memory. A frame is
+// skipped rather than waited for if it doesn't fit or its slot is still
+// being written by another consumer, so readers never slow the game down.
+// A name another live process is publishing under isn't taken over.
+typedef struct {
+    char name[SHARE_NAME_SIZE];
+    unsigned char* base;
+    size_t size;
+    share_header* header;
+    // Identifies the object, the name only stays ours while it maps to it
+    ino_t inode;
+    atomic_ulong shared;
+    atomic_ulong skipped;
+} frame_share;
+
+// share_only is set for DEPTH_UPSAMPLE_OUTPUT=shm, where frames are only
+// published and SHARE_DEFAULT_NAME is used unless DEPTH_UPSAMPLE_SHM says
+// otherwise. Returns false if publishing is off or the ring can't be made.
+bool frame_share_open(frame_share* share, const bool share_only);
+void frame_share_publish(frame_share* share,
+                         const uint32_t ID,
+                         const uint32_t width,
+                         const uint32_t height,
+                         const uint64_t timestamp,
+                         const bool half,
+                         const unsigned char* color,
+                         const unsigned char* depth);
+// Marks the ring closed and removes its name. The mapping itself stays
+// until the process exits, consumer threads may still be publishing.
+void frame_share_close(frame_share* share);
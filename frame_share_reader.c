@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame_share_reader.h"
+
+bool frame_share_attach(frame_share_reader* reader, const char* name) {
+    memset(reader, 0, sizeof(frame_share_reader));
+    char path[SHARE_NAME_SIZE];
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    const int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size >= SHARE_HEADER_SIZE) {
+        base = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_SHARED, fd,
+                    0);
+    }
+    close(fd);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+
+    const share_header* header = (const share_header*) base;
+    // The writer fills the header in before it sets the magic
+    const bool ready = memcmp(header->magic, SHARE_MAGIC,
+                              sizeof(header->magic)) == 0;
+    atomic_thread_fence(memory_order_acquire);
+    if (!ready || header->version != SHARE_VERSION ||
+            header->slots_offset + (uint64_t) header->slot_count *
+            header->slot_size > (uint64_t) info.st_size) {
+        munmap(base, (size_t) info.st_size);
+        return false;
+    }
+    reader->base = (const unsigned char*) base;
+    reader->size = (size_t) info.st_size;
+    reader->header = header;
+    return true;
+}
+
+static const share_slot* slot_at(const frame_share_reader* reader,
+                                 const uint32_t j) {
+    const share_header* header = reader->header;
+    return (const share_slot*) (reader->base + header->slots_offset +
+                                j * header->slot_size);
+}
+
+// Copies the slot's fields if they are a consistent, written frame
+static bool read_slot(const share_slot* slot, share_frame* frame) {
+    const uint64_t sequence = atomic_load_explicit(
+                                  (_Atomic uint64_t*) &(slot->sequence),
+                                  memory_order_acquire);
+    if (sequence == 0 || (sequence & 1)) {
+        return false;
+    }
+    frame->slot = slot;
+    frame->sequence = sequence;
+    frame->ticket = slot->ticket;
+    frame->timestamp = slot->timestamp;
+    frame->ID = slot->ID;
+    frame->width = slot->width;
+    frame->height = slot->height;
+    frame->half = slot->flags & SHARE_FRAME_HALF;
+    frame->color = (const unsigned char*) slot + slot->color_offset;
+    frame->depth = (const uint16_t*) ((const unsigned char*) slot +
+                                      slot->depth_offset);
+    return frame_share_valid(frame);
+}
+
+bool frame_share_next(frame_share_reader* reader, share_frame* frame) {
+    const uint32_t count = reader->header->slot_count;
+    // A slot can be rewritten between finding it and reading it, in which
+    // case there is a newer frame to look for
+    for (uint32_t attempt = 0; attempt <= count; attempt++) {
+        bool found = false;
+        share_frame candidate;
+        for (uint32_t j = 0; j < count; j++) {
+            if (read_slot(slot_at(reader, j), &candidate) &&
+                    candidate.ticket > reader->last_ticket &&
+                    (!found || candidate.ticket < frame->ticket)) {
+                *frame = candidate;
+                found = true;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+        if (frame_share_valid(frame)) {
+            if (reader->last_ticket) {
+                reader->missed += frame->ticket - reader->last_ticket - 1;
+            }
+            reader->last_ticket = frame->ticket;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool frame_share_valid(const share_frame* frame) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(
+               (_Atomic uint64_t*) &(frame->slot->sequence),
+               memory_order_relaxed) == frame->sequence;
+}
+
+bool frame_share_closed(const frame_share_reader* reader) {
+    return atomic_load((_Atomic uint32_t*) &(reader->header->closed));
+}
+
+void frame_share_detach(frame_share_reader* reader) {
+    if (reader->base) {
+        munmap((void*) reader->base, reader->size);
+    }
+    memset(reader, 0, sizeof(frame_share_reader));
+}
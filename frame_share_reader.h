@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "frame_share.h"
+
+// Reads frames another process publishes with DEPTH_UPSAMPLE_SHM. Only
+// needs libc, so tools can build it on its own.
+typedef struct {
+    const unsigned char* base;
+    size_t size;
+    const share_header* header;
+    // Ticket of the last frame returned
+    uint64_t last_ticket;
+    // Frames overwritten or skipped since the first one returned
+    uint64_t missed;
+} frame_share_reader;
+
+// Points into the shared memory without copying. The pixels are only
+// known to be the frame described here if frame_share_valid() still says
+// so after they have been used.
+typedef struct {
+    const share_slot* slot;
+    uint64_t sequence;
+    uint64_t ticket;
+    uint64_t timestamp;
+    uint32_t ID;
+    uint32_t width;
+    uint32_t height;
+    bool half;
+    const unsigned char* color;
+    const uint16_t* depth;
+} share_frame;
+
+// name is what DEPTH_UPSAMPLE_SHM was set to. Returns false if there is no
+// such ring (yet).
+bool frame_share_attach(frame_share_reader* reader, const char* name);
+// The oldest frame still in the ring that was published after the last
+// one returned. Returns false if there is none right now.
+bool frame_share_next(frame_share_reader* reader, share_frame* frame);
+// True until the frame's slot starts being rewritten
+bool frame_share_valid(const share_frame* frame);
+// Set once the capturing process has exited, attach again to follow the
+// next one
+bool frame_share_closed(const frame_share_reader* reader);
+void frame_share_detach(frame_share_reader* reader);
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "frame_stream.h"
+#include "frame_consumer.h"
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+
+void stream_socket_path(char* path, const size_t size) {
+    const char* configured = config_get_str("DEPTH_UPSAMPLE_COLLECTOR", "");
+    const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (configured[0]) {
+        snprintf(path, size, "%s", configured);
+    } else if (runtime_dir && runtime_dir[0] == '/') {
+        snprintf(path, size, "%s/%s", runtime_dir, STREAM_SOCKET_NAME);
+    } else {
+        snprintf(path, size, "/tmp/%s-%u", STREAM_SOCKET_NAME,
+                 (unsigned int) getuid());
+    }
+}
+
+bool stream_send(const int socket, const stream_message* message,
+                 const int fd) {
+    struct iovec data = {(void*) message, sizeof(stream_message)};
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        header.msg_control = control.buffer;
+        header.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr* rights = CMSG_FIRSTHDR(&header);
+        rights->cmsg_level = SOL_SOCKET;
+        rights->cmsg_type = SCM_RIGHTS;
+        rights->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(rights), &fd, sizeof(int));
+    }
+    ssize_t written;
+    do {
+        written = sendmsg(socket, &header, MSG_NOSIGNAL);
+    } while (written < 0 && errno == EINTR);
+    return written == (ssize_t) sizeof(stream_message);
+}
+
+bool stream_receive(const int socket, stream_message* message, int* fd) {
+    struct iovec data = {message, sizeof(stream_message)};
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr header;
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+    *fd = -1;
+
+    ssize_t read_size;
+    do {
+        read_size = recvmsg(socket, &header, MSG_CMSG_CLOEXEC);
+    } while (read_size < 0 && errno == EINTR);
+    if (read_size <= 0) {
+        return false;
+    }
+    struct cmsghdr* rights = CMSG_FIRSTHDR(&header);
+    if (rights && rights->cmsg_level == SOL_SOCKET &&
+            rights->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(rights), sizeof(int));
+    }
+    if (read_size != (ssize_t) sizeof(stream_message) ||
+            (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+            memcmp(message->magic, STREAM_MAGIC, sizeof(message->magic))) {
+        LOG_WARN("Dropping a malformed collector message");
+        if (*fd >= 0) {
+            close(*fd);
+            *fd = -1;
+        }
+        message->type = 0;
+    }
+    return true;
+}
+
+static void init_message(stream_message* message,
+                         const stream_message_type type) {
+    memset(message, 0, sizeof(stream_message));
+    memcpy(message->magic, STREAM_MAGIC, sizeof(message->magic));
+    message->type = type;
+    message->version = STREAM_VERSION;
+    message->pid = (uint32_t) getpid();
+}
+
+bool frame_stream_connect(frame_stream* stream) {
+    memset(stream, 0, sizeof(frame_stream));
+    pthread_mutex_init(&(stream->lock), NULL);
+    atomic_init(&(stream->sent), 0);
+    atomic_init(&(stream->dropped), 0);
+    char path[STREAM_SOCKET_SIZE];
+    stream_socket_path(path, sizeof(path));
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+    stream->socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (stream->socket < 0 ||
+            connect(stream->socket, (struct sockaddr*) &address,
+                    sizeof(address)) != 0) {
+        LOG_ERROR("No collector at %s, writing frames here", path);
+        if (stream->socket >= 0) {
+            close(stream->socket);
+        }
+        return false;
+    }
+
+    // Only the handshake may time out, the receiver waits for good later
+    struct timeval timeout = {STREAM_CONNECT_TIMEOUT_MS / 1000,
+                              STREAM_CONNECT_TIMEOUT_MS % 1000 * 1000};
+    setsockopt(stream->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+               sizeof(timeout));
+    stream_message hello;
+    init_message(&hello, STREAM_HELLO);
+    int fd;
+    if (!stream_send(stream->socket, &hello, -1) ||
+            !stream_receive(stream->socket, &hello, &fd) ||
+            hello.type != STREAM_HELLO || hello.version != STREAM_VERSION) {
+        LOG_ERROR("Collector at %s didn't answer, writing frames here", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        close(stream->socket);
+        return false;
+    }
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 0;
+    setsockopt(stream->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+               sizeof(timeout));
+    stream->connected = true;
+    LOG_INFO("Streaming frames to the collector at %s (pid %u)", path,
+             hello.pid);
+    return true;
+}
+
+// Hands back every frame the collector still had, once it is gone
+static void disconnect(frame_stream* stream) {
+    frame_buffer* lost[STREAM_MAX_IN_FLIGHT];
+    int count = 0;
+    pthread_mutex_lock(&(stream->lock));
+    const bool was_connected = stream->connected;
+    stream->connected = false;
+    for (int j = 0; j < STREAM_MAX_IN_FLIGHT; j++) {
+        if (stream->in_flight[j]) {
+            lost[count++] = stream->in_flight[j];
+            stream->in_flight[j] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&(stream->lock));
+    if (was_connected) {
+        LOG_ERROR("Lost the collector, %d frames in flight are gone and "
+                  "later ones are dropped", count);
+    }
+    for (int j = 0; j < count; j++) {
+        frame_pool_release(lost[j]);
+    }
+}
+
+// Either hands the frame to the collector or drops it back into the pool
+static void send_frame(frame_stream* stream, const buffer_element* elem) {
+    frame_buffer* frame = elem->frame;
+    pthread_mutex_lock(&(stream->lock));
+    int slot = -1;
+    if (stream->connected && frame->fd >= 0) {
+        for (int j = 0; j < STREAM_MAX_IN_FLIGHT && slot < 0; j++) {
+            const unsigned int candidate = (stream->next_slot + j) %
+                                           STREAM_MAX_IN_FLIGHT;
+            if (!stream->in_flight[candidate]) {
+                slot = (int) candidate;
+            }
+        }
+    }
+    if (slot >= 0) {
+        stream->in_flight[slot] = frame;
+        stream->next_slot = (unsigned int) slot + 1;
+    }
+    pthread_mutex_unlock(&(stream->lock));
+    if (slot < 0) {
+        frame_pool_release(frame);
+        atomic_fetch_add(&(stream->dropped), 1);
+        return;
+    }
+
+    stream_message message;
+    init_message(&message, STREAM_FRAME);
+    message.slot = (uint32_t) slot;
+    message.ID = elem->ID;
+    message.width = (uint32_t) elem->width;
+    message.height = (uint32_t) elem->height;
+    message.flags = elem->half ? STREAM_FRAME_HALF : 0;
+    message.timestamp = elem->timestamp;
+    message.size = frame->capacity;
+    message.color_offset = (uint64_t) (elem->color_image -
+                                       (unsigned char*) frame);
+    message.depth_offset = (uint64_t) (elem->depth_image -
+                                       (unsigned char*) frame);
+    if (stream_send(stream->socket, &message, frame->fd)) {
+        atomic_fetch_add(&(stream->sent), 1);
+        return;
+    }
+
+    pthread_mutex_lock(&(stream->lock));
+    // disconnect() may have handed it back already
+    const bool mine = stream->in_flight[slot] == frame;
+    stream->in_flight[slot] = NULL;
+    pthread_mutex_unlock(&(stream->lock));
+    if (mine) {
+        frame_pool_release(frame);
+    }
+    atomic_fetch_add(&(stream->dropped), 1);
+    disconnect(stream);
+}
+
+static void* stream_sender(void* stream_ptr) {
+    frame_stream* stream = (frame_stream*) stream_ptr;
+    buffer_element elem;
+    while (pipe_pop(stream->consumer, &elem, 1)) {
+        TRACE_SCOPE("stream_send");
+        send_frame(stream, &elem);
+    }
+    return NULL;
+}
+
+static void* stream_receiver(void* stream_ptr) {
+    frame_stream* stream = (frame_stream*) stream_ptr;
+    stream_message message;
+    int fd;
+    while (stream_receive(stream->socket, &message, &fd)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (message.type != STREAM_RELEASE ||
+                message.slot >= STREAM_MAX_IN_FLIGHT) {
+            continue;
+        }
+        pthread_mutex_lock(&(stream->lock));
+        frame_buffer* frame = stream->in_flight[message.slot];
+        stream->in_flight[message.slot] = NULL;
+        pthread_mutex_unlock(&(stream->lock));
+        if (frame) {
+            frame_pool_release(frame);
+        }
+    }
+    disconnect(stream);
+    return NULL;
+}
+
+void frame_stream_start(frame_stream* stream, pipe_t* pipe) {
+    stream->consumer = pipe_consumer_new(pipe);
+    pthread_create(&(stream->sender), NULL, stream_sender, stream);
+    pthread_create(&(stream->receiver), NULL, stream_receiver, stream);
+}
+
+void frame_stream_drain(frame_stream* stream,
+                        const unsigned long pushed,
+                        const int timeout_ms) {
+    const struct timespec poll = {0, 1000000};
+    for (int waited = 0; waited < timeout_ms &&
+            atomic_load(&(stream->sent)) +
+            atomic_load(&(stream->dropped)) < pushed; waited++) {
+        nanosleep(&poll, NULL);
+    }
+    const unsigned long sent = atomic_load(&(stream->sent));
+    const unsigned long dropped = atomic_load(&(stream->dropped));
+    LOG_AT(dropped || sent + dropped < pushed ? LOG_LEVEL_WARN :
+           LOG_LEVEL_INFO,
+           "Sent %lu frames to the collector, dropped %lu, %lu unsent",
+           sent, dropped, pushed - sent - dropped);
+}
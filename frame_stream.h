@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "pipe.h"
+#include "frame_pool.h"
+
+#define STREAM_MAGIC "DUPC"
+#define STREAM_VERSION 2
+#define STREAM_SOCKET_NAME "depth_upsample_collector"
+// Size of sockaddr_un.sun_path
+#define STREAM_SOCKET_SIZE 108
+// Larger frames are refused, which keeps the size arithmetic in 64 bits
+#define STREAM_MAX_DIMENSION 65536
+#define STREAM_MAX_IN_FLIGHT 256
+#define STREAM_CONNECT_TIMEOUT_MS 1000
+#define STREAM_FRAME_HALF 1
+
+typedef enum {
+    // Game to collector right after connecting, answered with the same
+    STREAM_HELLO = 1,
+    // Game to collector, with the frame's memfd attached
+    STREAM_FRAME = 2,
+    // Collector to game, the frame's buffer may be reused
+    STREAM_RELEASE = 3
+} stream_message_type;
+
+// Every message is one SOCK_SEQPACKET packet holding this, little endian.
+// A frame's buffer is mapped size bytes from its start, with packed RGB8
+// color at color_offset and 16-bit depth at depth_offset, both bottom row
+// first as read back. slot is echoed back in the release. The memfd must
+// be sealed against shrinking, so the collector's mapping can't fault.
+typedef struct {
+    char magic[4];
+    uint32_t type;
+    uint32_t version;
+    uint32_t pid;
+    uint32_t slot;
+    uint32_t ID;
+    uint32_t width;
+    uint32_t height;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t timestamp;
+    uint64_t size;
+    uint64_t color_offset;
+    uint64_t depth_offset;
+} stream_message;
+
+// DEPTH_UPSAMPLE_COLLECTOR, or STREAM_SOCKET_NAME in $XDG_RUNTIME_DIR,
+// which only its user can enter. Without one it is suffixed with the uid
+// in /tmp.
+void stream_socket_path(char* path, const size_t size);
+// Sends one message, with fd attached unless it is -1
+bool stream_send(const int socket, const stream_message* message,
+                 const int fd);
+// Receives one message and the fd attached to it, or -1. Returns false
+// once the peer is gone; malformed messages are read and dropped.
+bool stream_receive(const int socket, stream_message* message, int* fd);
+
+// DEPTH_UPSAMPLE_OUTPUT=collector hands captured frames to the
+// depth_upsample_collector daemon listening on stream_socket_path()
+// instead of encoding them in the game.
+// The frame pool is backed by memfds, and a frame is sent as its memfd, so
+// the pixels are never copied. The buffer stays out of the pool until the
+// collector has written the frame and releases it, which keeps the pool's
+// byte budget and the queue policy in charge of how far the collector may
+// fall behind. Frames popped after the collector went away are dropped.
+typedef struct {
+    int socket;
+    pipe_consumer_t* consumer;
+    pthread_mutex_t lock;
+    bool connected;
+    frame_buffer* in_flight[STREAM_MAX_IN_FLIGHT];
+    unsigned int next_slot;
+    atomic_ulong sent;
+    atomic_ulong dropped;
+    pthread_t sender;
+    pthread_t receiver;
+} frame_stream;
+
+// Returns false if no collector answered, frames are then written in the
+// game as usual
+bool frame_stream_connect(frame_stream* stream);
+// Starts one thread sending what it pops from pipe and one taking the
+// releases
+void frame_stream_start(frame_stream* stream, pipe_t* pipe);
+// Waits up to timeout_ms for the sender to have handed over or dropped
+// all pushed frames. The collector keeps its memfds and finishes them
+// after the game has exited.
+void frame_stream_drain(frame_stream* stream,
+                        const unsigned long pushed,
+                        const int timeout_ms);
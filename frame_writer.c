@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "frame_writer.h"
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+
+static int open_segment(const write_segment* segment) {
+    if (!segment->path[0]) {
+        return segment->fd;
+    }
+    int fd = open(segment->path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOG_ERROR("Can't open %s", segment->path);
+    }
+    return fd;
+}
+
+static void finish_job(const write_job* job, const bool written) {
+    if (job->archive && written) {
+        frame_archive_commit(job->archive, job->record);
+    }
+    for (int j = 0; j < WRITE_JOB_MAX_OWNED; j++) {
+        free(job->owned[j]);
+    }
+    if (job->frame) {
+        frame_pool_release(job->frame);
+    }
+}
+
+static void write_job_blocking(const write_job* job) {
+    TRACE_SCOPE("write_job");
+    int written = 0;
+    for (int j = 0; j < job->num_segments; j++) {
+        const write_segment* segment = &(job->segments[j]);
+        int fd = open_segment(segment);
+        if (fd < 0) {
+            break;
+        }
+
+        const char* bytes = (const char*) segment->data;
+        size_t remaining = segment->length;
+        uint64_t offset = segment->offset;
+        while (remaining > 0) {
+            ssize_t written = pwrite(fd, bytes, remaining, offset);
+            if (written <= 0) {
+                LOG_ERROR("Write of %zu bytes failed", remaining);
+                break;
+            }
+            bytes += written;
+            remaining -= written;
+            offset += written;
+        }
+
+        if (segment->path[0]) {
+            close(fd);
+        }
+        if (remaining > 0) {
+            break;
+        }
+        written++;
+    }
+    finish_job(job, written == job->num_segments);
+}
+
+#ifdef HAVE_LIBURING
+typedef struct {
+    frame_writer* writer;
+    pipe_consumer_t* consumer;
+} writer_context;
+
+// Identifies the segment a completion belongs to
+typedef struct {
+    struct inflight_job* inflight;
+    int segment;
+} inflight_part;
+
+typedef struct inflight_job {
+    frame_writer* writer;
+    write_job job;
+    int fds[WRITE_JOB_MAX_SEGMENTS];
+    inflight_part parts[WRITE_JOB_MAX_SEGMENTS];
+    // Bytes of each segment already written
+    size_t done[WRITE_JOB_MAX_SEGMENTS];
+    int pending;
+    bool failed;
+} inflight_job;
+
+// Queues the segments from first on, minus what they already wrote, as
+// one IOSQE_IO_LINK chain, so each one only starts after the previous one
+// is complete. The caller makes sure the ring has room for them.
+static int queue_segments(struct io_uring* ring,
+                          inflight_job* inflight,
+                          const int first) {
+    const int count = inflight->job.num_segments - first;
+    for (int j = first; j < inflight->job.num_segments; j++) {
+        const write_segment* segment = &(inflight->job.segments[j]);
+        const size_t done = inflight->done[j];
+        struct io_uring_sqe* sqe = io_uring_get_sqe(ring);
+        io_uring_prep_write(sqe, inflight->fds[j],
+                            (const char*) segment->data + done,
+                            segment->length - done, segment->offset + done);
+        io_uring_sqe_set_data(sqe, &(inflight->parts[j]));
+        if (j < inflight->job.num_segments - 1) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+    }
+    inflight->pending = count;
+    return count;
+}
+
+// Returns the number of writes queued again
+static int complete(struct io_uring* ring, const struct io_uring_cqe* cqe) {
+    const inflight_part* part = (const inflight_part*) io_uring_cqe_get_data(
+                                    cqe);
+    inflight_job* inflight = part->inflight;
+    const write_segment* segment = &(inflight->job.segments[part->segment]);
+    if (cqe->res < 0) {
+        // The rest of a chain is cancelled after a failed or short write,
+        // and only counts as failed in the first case
+        if (cqe->res != -ECANCELED) {
+            LOG_ERROR("Asynchronous write failed (%i)", cqe->res);
+            inflight->failed = true;
+        }
+    } else if (cqe->res == 0 &&
+               inflight->done[part->segment] < segment->length) {
+        LOG_ERROR("Asynchronous write of %zu bytes wrote nothing",
+                  segment->length - inflight->done[part->segment]);
+        inflight->failed = true;
+    } else {
+        inflight->done[part->segment] += (size_t) cqe->res;
+    }
+    if (--(inflight->pending) > 0) {
+        return 0;
+    }
+
+    // A short write broke the chain, what is left of it goes again
+    int resume = 0;
+    while (resume < inflight->job.num_segments &&
+            inflight->done[resume] == inflight->job.segments[resume].length) {
+        resume++;
+    }
+    if (!inflight->failed && resume < inflight->job.num_segments) {
+        while (io_uring_sq_space_left(ring) <
+                (unsigned int) (inflight->job.num_segments - resume)) {
+            io_uring_submit(ring);
+        }
+        return queue_segments(ring, inflight, resume);
+    }
+
+    for (int j = 0; j < inflight->job.num_segments; j++) {
+        if (inflight->job.segments[j].path[0] && inflight->fds[j] >= 0) {
+            close(inflight->fds[j]);
+        }
+    }
+    finish_job(&(inflight->job), !inflight->failed);
+    atomic_fetch_sub(&(inflight->writer->pending), 1);
+    free(inflight);
+    return 0;
+}
+
+// Reaps what has completed, waiting for one completion first with wait,
+// and keeps inflight, the number of writes in the ring, up to date
+static void reap(struct io_uring* ring,
+                 const bool wait,
+                 unsigned int* inflight) {
+    struct io_uring_cqe* cqe;
+    if (wait && io_uring_wait_cqe(ring, &cqe) == 0) {
+        const int queued = complete(ring, cqe);
+        io_uring_cqe_seen(ring, cqe);
+        *inflight += queued - 1;
+    }
+    while (io_uring_peek_cqe(ring, &cqe) == 0) {
+        const int queued = complete(ring, cqe);
+        io_uring_cqe_seen(ring, cqe);
+        *inflight += queued - 1;
+    }
+}
+
+// Queues every segment of the job as one IOSQE_IO_LINK chain. Returns
+// false without queueing anything if the ring is too full for the chain.
+static bool queue_job(struct io_uring* ring,
+                      frame_writer* writer,
+                      const write_job* job) {
+    if (io_uring_sq_space_left(ring) < (unsigned int) job->num_segments) {
+        return false;
+    }
+
+    inflight_job* inflight = (inflight_job*) malloc(sizeof(inflight_job));
+    inflight->writer = writer;
+    inflight->job = *job;
+    inflight->failed = false;
+    for (int j = 0; j < job->num_segments; j++) {
+        inflight->fds[j] = open_segment(&(job->segments[j]));
+        inflight->parts[j].inflight = inflight;
+        inflight->parts[j].segment = j;
+        inflight->done[j] = 0;
+    }
+    queue_segments(ring, inflight, 0);
+    return true;
+}
+
+static void* writer_thread(void* context_ptr) {
+    writer_context* context = (writer_context*) context_ptr;
+    pipe_consumer_t* consumer = context->consumer;
+    struct io_uring ring;
+    io_uring_queue_init(WRITER_QUEUE_DEPTH, &ring, 0);
+
+    write_job jobs[WRITER_QUEUE_DEPTH / WRITE_JOB_MAX_SEGMENTS];
+    const size_t batch = sizeof(jobs) / sizeof(jobs[0]);
+    unsigned int inflight = 0;
+    while (true) {
+        // Only sleep on the pipe when there is nothing left to reap
+        size_t popped = inflight ? pipe_pop_eager(consumer, jobs, batch) :
+                        pipe_pop(consumer, jobs, 1);
+        if (!inflight && !popped) {
+            // frame_writer_close() was called and everything is written
+            break;
+        }
+        if (!inflight && popped == 1) {
+            popped += pipe_pop_eager(consumer, jobs + 1, batch - 1);
+        }
+
+        for (size_t j = 0; j < popped; j++) {
+            while (!queue_job(&ring, context->writer, &(jobs[j]))) {
+                io_uring_submit(&ring);
+                reap(&ring, true, &inflight);
+            }
+            inflight += jobs[j].num_segments;
+        }
+        if (popped) {
+            TRACE_SCOPE("io_uring_submit");
+            io_uring_submit(&ring);
+        }
+        if (inflight) {
+            reap(&ring, !popped, &inflight);
+            // Resubmitted remainders of short writes
+            io_uring_submit(&ring);
+        }
+    }
+    io_uring_queue_exit(&ring);
+    pipe_consumer_free(consumer);
+    free(context);
+    return NULL;
+}
+
+static bool start_uring_writers(frame_writer* writer) {
+    // Probe that the kernel lets us create a ring at all
+    struct io_uring probe;
+    if (io_uring_queue_init(2, &probe, 0) < 0) {
+        LOG_WARN("io_uring is unavailable, writing frames synchronously");
+        return false;
+    }
+    io_uring_queue_exit(&probe);
+
+    pipe_t* pipe = pipe_new(sizeof(write_job), 0);
+    writer->producer = pipe_producer_new(pipe);
+    for (int j = 0; j < writer->threads; j++) {
+        writer_context* context =
+            (writer_context*) malloc(sizeof(writer_context));
+        context->writer = writer;
+        context->consumer = pipe_consumer_new(pipe);
+        pthread_t thread;
+        pthread_create(&thread, NULL, writer_thread, context);
+        pthread_detach(thread);
+    }
+    pipe_free(pipe);
+    return true;
+}
+#endif
+
+void frame_writer_init(frame_writer* writer) {
+    writer->producer = NULL;
+    atomic_init(&(writer->pending), 0);
+    writer->threads = config_get_int("DEPTH_UPSAMPLE_WRITER_THREADS",
+                                     WRITER_DEFAULT_THREADS);
+    if (writer->threads < 1) {
+        writer->threads = 1;
+    } else if (writer->threads > WRITER_MAX_THREADS) {
+        writer->threads = WRITER_MAX_THREADS;
+    }
+#ifdef HAVE_LIBURING
+    start_uring_writers(writer);
+#endif
+}
+
+void frame_writer_submit(frame_writer* writer, const write_job* job) {
+    // A job with nothing to write only has buffers to give back
+    if (writer->producer && job->num_segments > 0) {
+        atomic_fetch_add(&(writer->pending), 1);
+        pipe_push(writer->producer, job, 1);
+    } else {
+        write_job_blocking(job);
+    }
+}
+
+void frame_writer_drain(frame_writer* writer, const int timeout_ms) {
+    const struct timespec poll = {0, 1000000};
+    for (int waited = 0; waited < timeout_ms &&
+            atomic_load(&(writer->pending)) > 0; waited++) {
+        nanosleep(&poll, NULL);
+    }
+    if (atomic_load(&(writer->pending)) > 0) {
+        LOG_WARN("%u frame writes still pending at exit",
+                 atomic_load(&(writer->pending)));
+    }
+}
+
+void frame_writer_close(frame_writer* writer) {
+    if (writer->producer) {
+        pipe_producer_free(writer->producer);
+        writer->producer = NULL;
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "pipe.h"
+#include "frame_pool.h"
+#include "frame_archive.h"
+
+#define WRITE_JOB_MAX_SEGMENTS 3
+#define WRITE_JOB_MAX_OWNED 3
+#define WRITE_PATH_SIZE 300
+#define WRITER_DEFAULT_THREADS 1
+#define WRITER_MAX_THREADS 4
+#define WRITER_QUEUE_DEPTH 64
+
+// One contiguous write. Segments with a path create (and truncate) that
+// file and close it afterwards, the others pwrite into an already open fd.
+typedef struct {
+    int fd;
+    char path[WRITE_PATH_SIZE];
+    const void* data;
+    size_t length;
+    uint64_t offset;
+} write_segment;
+
+// The segments of a job are written in order, each one only after the
+// previous one succeeded, which is what keeps an archive record header
+// behind its chunks. Once the last one is done the record, if any, is
+// committed to its archive, provided every segment was written in full.
+// Then the owned buffers are freed and the frame goes back to its pool.
+typedef struct {
+    write_segment segments[WRITE_JOB_MAX_SEGMENTS];
+    int num_segments;
+    void* owned[WRITE_JOB_MAX_OWNED];
+    frame_buffer* frame;
+    frame_archive* archive;
+    // One of the owned buffers
+    const archive_record* record;
+} write_job;
+
+// Built with URING=1, jobs are queued to DEPTH_UPSAMPLE_WRITER_THREADS
+// threads (default 1), each submitting batches to its own io_uring and
+// recycling buffers as completions arrive. A short write is resubmitted
+// for the rest of its segment, along with the segments after it.
+// Otherwise, or if io_uring can't be set up at run time,
+// frame_writer_submit() writes the job with plain blocking I/O on the
+// calling consumer thread.
+typedef struct {
+    pipe_producer_t* producer;
+    int threads;
+    atomic_uint pending;
+} frame_writer;
+
+void frame_writer_init(frame_writer* writer);
+void frame_writer_submit(frame_writer* writer, const write_job* job);
+// Waits up to timeout_ms for every submitted job to finish. Only jobs
+// already submitted are waited for, so whatever submits them (consumer
+// threads, sample shards) has to be finished first.
+void frame_writer_drain(frame_writer* writer, int timeout_ms);
+// Lets the writer threads exit once their jobs are written, no job may be
+// submitted after this
+void frame_writer_close(frame_writer* writer);
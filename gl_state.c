@@ -0,0 +1,550 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "gl_state.h"
+#include "log.h"
+#include "trace.h"
+
+static const HOOKS* real;
+// Points at the current context's state, or at the thread's own copy when
+// the context isn't one we know about
+static __thread gl_state* bound;
+static __thread gl_state unbound;
+
+static const GLenum pixel_store_params[GL_STATE_PIXEL_STORE_PARAMS] = {
+    GL_PACK_SWAP_BYTES, GL_PACK_LSB_FIRST, GL_PACK_ROW_LENGTH,
+    GL_PACK_IMAGE_HEIGHT, GL_PACK_SKIP_ROWS, GL_PACK_SKIP_PIXELS,
+    GL_PACK_SKIP_IMAGES, GL_PACK_ALIGNMENT,
+    GL_UNPACK_SWAP_BYTES, GL_UNPACK_LSB_FIRST, GL_UNPACK_ROW_LENGTH,
+    GL_UNPACK_IMAGE_HEIGHT, GL_UNPACK_SKIP_ROWS, GL_UNPACK_SKIP_PIXELS,
+    GL_UNPACK_SKIP_IMAGES, GL_UNPACK_ALIGNMENT
+};
+
+static const GLenum capabilities[GL_STATE_CAPABILITIES] = {
+    GL_SCISSOR_TEST, GL_BLEND, GL_DEPTH_TEST, GL_STENCIL_TEST,
+    GL_CULL_FACE, GL_FRAMEBUFFER_SRGB, GL_RASTERIZER_DISCARD,
+    GL_COLOR_LOGIC_OP
+};
+
+void gl_state_init(const HOOKS* hooks) {
+    real = hooks;
+}
+
+bool gl_state_resolved() {
+    return real && real->__glActiveTexture && real->__glBindFramebuffer &&
+           real->__glBindBuffer && real->__glPixelStorei &&
+           real->__glBindTexture && real->__glUseProgram &&
+           real->__glBindVertexArray && real->__glViewport &&
+           real->__glEnable && real->__glDisable && real->__glColorMask;
+}
+
+static inline gl_state* tracked() {
+    return bound ? bound : &unbound;
+}
+
+void gl_state_bind(gl_state* state) {
+    bound = state;
+    if (!state) {
+        unbound.synced = false;
+    }
+}
+
+static int pixel_store_index(const GLenum pname) {
+    for (int j = 0; j < GL_STATE_PIXEL_STORE_PARAMS; j++) {
+        if (pixel_store_params[j] == pname) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+static int capability_index(const GLenum cap) {
+    for (int j = 0; j < GL_STATE_CAPABILITIES; j++) {
+        if (capabilities[j] == cap) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+static int active_unit() {
+    return tracked()->active_texture - GL_TEXTURE0;
+}
+
+static void sync_unit(const int unit) {
+    const GLenum texture_unit = GL_TEXTURE0 + unit;
+    GLint texture;
+    if (tracked()->active_texture != texture_unit) {
+        real->__glActiveTexture(texture_unit);
+    }
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &texture);
+    GLint sampler = 0;
+    if (tracked()->has_samplers) {
+        glGetIntegerv(GL_SAMPLER_BINDING, &sampler);
+    }
+    if (tracked()->active_texture != texture_unit) {
+        real->__glActiveTexture(tracked()->active_texture);
+    }
+    tracked()->textures[unit] = texture;
+    tracked()->samplers[unit] = sampler;
+    tracked()->known_units |= 1u << unit;
+}
+
+// Queries only go where the context has the state, anything else would
+// leave an error for the application to find
+typedef struct {
+    bool es;
+    int major;
+    int minor;
+} context_version;
+
+static context_version query_version() {
+    context_version version = {false, 0, 0};
+    const char* string = (const char*) glGetString(GL_VERSION);
+    if (!string) {
+        return version;
+    }
+    // "OpenGL ES 3.2 Mesa ..." or "OpenGL ES-CM 1.1" on GLES
+    if (strncmp(string, "OpenGL ES", 9) == 0) {
+        version.es = true;
+        string += strcspn(string, "0123456789");
+    }
+    sscanf(string, "%d.%d", &(version.major), &(version.minor));
+    return version;
+}
+
+static bool at_least(const context_version* version,
+                     const int major,
+                     const int minor) {
+    return version->major > major ||
+           (version->major == major && version->minor >= minor);
+}
+
+// Only asked before GL 3.0 and GLES 3.0, core profiles don't take
+// GL_EXTENSIONS here
+static bool has_extension(const char* name) {
+    const char* extensions = (const char*) glGetString(GL_EXTENSIONS);
+    const size_t length = strlen(name);
+    for (const char* found = extensions ? strstr(extensions, name) : NULL;
+            found; found = strstr(found + length, name)) {
+        if ((found == extensions || found[-1] == ' ') &&
+                (found[length] == ' ' || found[length] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void query_support(gl_state* state) {
+    const context_version version = query_version();
+    state->has_samplers = at_least(&version, 3, version.es ? 0 : 3);
+    state->has_vertex_arrays =
+        at_least(&version, 3, 0) ||
+        has_extension(version.es ? "GL_OES_vertex_array_object" :
+                      "GL_ARB_vertex_array_object");
+    state->has_polygon_mode = !version.es;
+}
+
+static void sync() {
+    TRACE_SCOPE("gl_state_sync");
+    GLint value;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &value);
+    tracked()->draw_framebuffer = value;
+    glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &value);
+    tracked()->read_framebuffer = value;
+    glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &value);
+    tracked()->pack_buffer = value;
+    glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &value);
+    tracked()->unpack_buffer = value;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &value);
+    tracked()->program = value;
+    query_support(tracked());
+    tracked()->vertex_array = 0;
+    if (tracked()->has_vertex_arrays) {
+        glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &value);
+        tracked()->vertex_array = value;
+    }
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &value);
+    tracked()->active_texture = value;
+    for (int j = 0; j < GL_STATE_PIXEL_STORE_PARAMS; j++) {
+        glGetIntegerv(pixel_store_params[j], &(tracked()->pixel_store[j]));
+    }
+    glGetIntegerv(GL_VIEWPORT, tracked()->viewport);
+    glGetBooleanv(GL_COLOR_WRITEMASK, tracked()->color_mask);
+    tracked()->polygon_mode[0] = GL_FILL;
+    tracked()->polygon_mode[1] = GL_FILL;
+    if (tracked()->has_polygon_mode) {
+        glGetIntegerv(GL_POLYGON_MODE, tracked()->polygon_mode);
+    }
+    tracked()->enabled = 0;
+    for (int j = 0; j < GL_STATE_CAPABILITIES; j++) {
+        if (glIsEnabled(capabilities[j])) {
+            tracked()->enabled |= 1u << j;
+        }
+    }
+    tracked()->synced = true;
+    tracked()->known_units = 0;
+    for (int j = 0; j < GL_STATE_TEXTURE_UNITS; j++) {
+        sync_unit(j);
+    }
+}
+
+gl_state* gl_state_current() {
+    if (!tracked()->synced) {
+        sync();
+    }
+    for (int j = 0; j < GL_STATE_TEXTURE_UNITS; j++) {
+        if (!(tracked()->known_units & (1u << j))) {
+            sync_unit(j);
+        }
+    }
+    return tracked();
+}
+
+void gl_state_invalidate() {
+    tracked()->synced = false;
+}
+
+bool gl_state_enabled(const gl_state_capability capability) {
+    return gl_state_current()->enabled & (1u << capability);
+}
+
+void gl_state_on_bind_framebuffer(const GLenum target,
+                                  const GLuint framebuffer) {
+    if (target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER) {
+        tracked()->draw_framebuffer = framebuffer;
+    }
+    if (target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER) {
+        tracked()->read_framebuffer = framebuffer;
+    }
+}
+
+void gl_state_on_bind_buffer(const GLenum target, const GLuint buffer) {
+    if (target == GL_PIXEL_PACK_BUFFER) {
+        tracked()->pack_buffer = buffer;
+    } else if (target == GL_PIXEL_UNPACK_BUFFER) {
+        tracked()->unpack_buffer = buffer;
+    }
+}
+
+void gl_state_on_pixel_store(const GLenum pname, const GLint value) {
+    const int index = pixel_store_index(pname);
+    if (index >= 0) {
+        tracked()->pixel_store[index] = value;
+    }
+}
+
+void gl_state_on_active_texture(const GLenum texture) {
+    tracked()->active_texture = texture;
+}
+
+void gl_state_on_bind_texture(const GLenum target, const GLuint texture) {
+    const int unit = active_unit();
+    if (target == GL_TEXTURE_2D && unit >= 0 &&
+            unit < GL_STATE_TEXTURE_UNITS) {
+        tracked()->textures[unit] = texture;
+    }
+}
+
+void gl_state_on_bind_texture_unit(const GLuint unit, const GLuint texture) {
+    if (unit < GL_STATE_TEXTURE_UNITS) {
+        // Zero unbinds every target, otherwise the target is unknown
+        if (texture == 0) {
+            tracked()->textures[unit] = 0;
+        } else {
+            tracked()->known_units &= ~(1u << unit);
+        }
+    }
+}
+
+void gl_state_on_bind_multi_texture(const GLenum texunit,
+                                    const GLenum target,
+                                    const GLuint texture) {
+    const GLuint unit = texunit - GL_TEXTURE0;
+    if (target == GL_TEXTURE_2D && unit < GL_STATE_TEXTURE_UNITS) {
+        tracked()->textures[unit] = texture;
+    }
+}
+
+void gl_state_on_use_program(const GLuint program) {
+    tracked()->program = program;
+}
+
+void gl_state_on_bind_vertex_array(const GLuint vertex_array) {
+    tracked()->vertex_array = vertex_array;
+}
+
+void gl_state_on_viewport(const GLint x,
+                          const GLint y,
+                          const GLsizei width,
+                          const GLsizei height) {
+    tracked()->viewport[0] = x;
+    tracked()->viewport[1] = y;
+    tracked()->viewport[2] = width;
+    tracked()->viewport[3] = height;
+}
+
+void gl_state_on_enable(const GLenum cap, const bool enabled) {
+    const int index = capability_index(cap);
+    if (index < 0) {
+        return;
+    }
+    if (enabled) {
+        tracked()->enabled |= 1u << index;
+    } else {
+        tracked()->enabled &= ~(1u << index);
+    }
+}
+
+void gl_state_on_color_mask(const GLboolean red,
+                            const GLboolean green,
+                            const GLboolean blue,
+                            const GLboolean alpha) {
+    tracked()->color_mask[0] = red;
+    tracked()->color_mask[1] = green;
+    tracked()->color_mask[2] = blue;
+    tracked()->color_mask[3] = alpha;
+}
+
+void gl_state_on_polygon_mode(const GLenum face, const GLenum mode) {
+    if (face == GL_FRONT || face == GL_FRONT_AND_BACK) {
+        tracked()->polygon_mode[0] = mode;
+    }
+    if (face == GL_BACK || face == GL_FRONT_AND_BACK) {
+        tracked()->polygon_mode[1] = mode;
+    }
+}
+
+void gl_state_on_bind_sampler(const GLuint unit, const GLuint sampler) {
+    if (unit < GL_STATE_TEXTURE_UNITS) {
+        tracked()->samplers[unit] = sampler;
+    }
+}
+
+// Deleting a bound object reverts its bindings in this context to zero
+void gl_state_on_delete_framebuffers(const GLsizei n,
+                                     const GLuint* framebuffers) {
+    for (GLsizei j = 0; j < n; j++) {
+        if (framebuffers[j] == tracked()->draw_framebuffer) {
+            tracked()->draw_framebuffer = 0;
+        }
+        if (framebuffers[j] == tracked()->read_framebuffer) {
+            tracked()->read_framebuffer = 0;
+        }
+    }
+}
+
+void gl_state_on_delete_buffers(const GLsizei n, const GLuint* buffers) {
+    for (GLsizei j = 0; j < n; j++) {
+        if (buffers[j] == tracked()->pack_buffer) {
+            tracked()->pack_buffer = 0;
+        }
+        if (buffers[j] == tracked()->unpack_buffer) {
+            tracked()->unpack_buffer = 0;
+        }
+    }
+}
+
+void gl_state_on_delete_textures(const GLsizei n, const GLuint* textures) {
+    for (GLsizei j = 0; j < n; j++) {
+        for (int unit = 0; unit < GL_STATE_TEXTURE_UNITS; unit++) {
+            if (textures[j] == tracked()->textures[unit]) {
+                tracked()->textures[unit] = 0;
+            }
+        }
+    }
+}
+
+void gl_state_on_delete_vertex_arrays(const GLsizei n,
+                                      const GLuint* vertex_arrays) {
+    for (GLsizei j = 0; j < n; j++) {
+        if (vertex_arrays[j] == tracked()->vertex_array) {
+            tracked()->vertex_array = 0;
+        }
+    }
+}
+
+void gl_state_on_delete_samplers(const GLsizei n, const GLuint* samplers) {
+    for (GLsizei j = 0; j < n; j++) {
+        for (int unit = 0; unit < GL_STATE_TEXTURE_UNITS; unit++) {
+            if (samplers[j] == tracked()->samplers[unit]) {
+                tracked()->samplers[unit] = 0;
+            }
+        }
+    }
+}
+
+void gl_state_bind_framebuffer(const GLenum target,
+                               const GLuint framebuffer) {
+    const gl_state* state = gl_state_current();
+    const bool draw = target == GL_FRAMEBUFFER ||
+                      target == GL_DRAW_FRAMEBUFFER;
+    const bool read = target == GL_FRAMEBUFFER ||
+                      target == GL_READ_FRAMEBUFFER;
+    if ((draw && state->draw_framebuffer != framebuffer) ||
+            (read && state->read_framebuffer != framebuffer)) {
+        real->__glBindFramebuffer(target, framebuffer);
+        gl_state_on_bind_framebuffer(target, framebuffer);
+    }
+}
+
+void gl_state_bind_buffer(const GLenum target, const GLuint buffer) {
+    const gl_state* state = gl_state_current();
+    if ((target == GL_PIXEL_PACK_BUFFER && state->pack_buffer == buffer) ||
+            (target == GL_PIXEL_UNPACK_BUFFER &&
+             state->unpack_buffer == buffer)) {
+        return;
+    }
+    real->__glBindBuffer(target, buffer);
+    gl_state_on_bind_buffer(target, buffer);
+}
+
+void gl_state_pixel_store(const GLenum pname, const GLint value) {
+    const int index = pixel_store_index(pname);
+    if (index >= 0 && gl_state_current()->pixel_store[index] == value) {
+        return;
+    }
+    real->__glPixelStorei(pname, value);
+    gl_state_on_pixel_store(pname, value);
+}
+
+void gl_state_pack_tightly() {
+    gl_state_pixel_store(GL_PACK_SWAP_BYTES, GL_FALSE);
+    gl_state_pixel_store(GL_PACK_LSB_FIRST, GL_FALSE);
+    gl_state_pixel_store(GL_PACK_ROW_LENGTH, 0);
+    gl_state_pixel_store(GL_PACK_IMAGE_HEIGHT, 0);
+    gl_state_pixel_store(GL_PACK_SKIP_ROWS, 0);
+    gl_state_pixel_store(GL_PACK_SKIP_PIXELS, 0);
+    gl_state_pixel_store(GL_PACK_SKIP_IMAGES, 0);
+    gl_state_pixel_store(GL_PACK_ALIGNMENT, 1);
+}
+
+void gl_state_active_texture(const GLenum texture) {
+    if (gl_state_current()->active_texture != texture) {
+        real->__glActiveTexture(texture);
+        gl_state_on_active_texture(texture);
+    }
+}
+
+void gl_state_bind_texture(const GLuint texture) {
+    const gl_state* state = gl_state_current();
+    const int unit = active_unit();
+    if (unit >= 0 && unit < GL_STATE_TEXTURE_UNITS &&
+            state->textures[unit] == texture) {
+        return;
+    }
+    real->__glBindTexture(GL_TEXTURE_2D, texture);
+    gl_state_on_bind_texture(GL_TEXTURE_2D, texture);
+}
+
+void gl_state_use_program(const GLuint program) {
+    if (gl_state_current()->program != program) {
+        real->__glUseProgram(program);
+        gl_state_on_use_program(program);
+    }
+}
+
+void gl_state_bind_vertex_array(const GLuint vertex_array) {
+    const gl_state* state = gl_state_current();
+    if (state->has_vertex_arrays && state->vertex_array != vertex_array) {
+        real->__glBindVertexArray(vertex_array);
+        gl_state_on_bind_vertex_array(vertex_array);
+    }
+}
+
+void gl_state_viewport(const GLint x,
+                       const GLint y,
+                       const GLsizei width,
+                       const GLsizei height) {
+    const GLint* viewport = gl_state_current()->viewport;
+    if (viewport[0] != x || viewport[1] != y ||
+            viewport[2] != width || viewport[3] != height) {
+        real->__glViewport(x, y, width, height);
+        gl_state_on_viewport(x, y, width, height);
+    }
+}
+
+void gl_state_set_enabled(const gl_state_capability capability,
+                          const bool enabled) {
+    if (gl_state_enabled(capability) == enabled) {
+        return;
+    }
+    if (enabled) {
+        real->__glEnable(capabilities[capability]);
+    } else {
+        real->__glDisable(capabilities[capability]);
+    }
+    gl_state_on_enable(capabilities[capability], enabled);
+}
+
+void gl_state_color_mask(const GLboolean red,
+                         const GLboolean green,
+                         const GLboolean blue,
+                         const GLboolean alpha) {
+    const GLboolean* mask = gl_state_current()->color_mask;
+    if (mask[0] != red || mask[1] != green ||
+            mask[2] != blue || mask[3] != alpha) {
+        real->__glColorMask(red, green, blue, alpha);
+        gl_state_on_color_mask(red, green, blue, alpha);
+    }
+}
+
+// Core profiles only take GL_FRONT_AND_BACK, so the faces are only set
+// apart when they differ
+static void set_polygon_mode(const GLint front, const GLint back) {
+    const gl_state* state = gl_state_current();
+    const GLint* mode = state->polygon_mode;
+    if (!state->has_polygon_mode || (mode[0] == front && mode[1] == back)) {
+        return;
+    }
+    if (front == back) {
+        real->__glPolygonMode(GL_FRONT_AND_BACK, front);
+    } else {
+        real->__glPolygonMode(GL_FRONT, front);
+        real->__glPolygonMode(GL_BACK, back);
+    }
+    gl_state_on_polygon_mode(GL_FRONT, front);
+    gl_state_on_polygon_mode(GL_BACK, back);
+}
+
+void gl_state_polygon_mode(const GLenum mode) {
+    set_polygon_mode(mode, mode);
+}
+
+void gl_state_bind_sampler(const GLuint unit, const GLuint sampler) {
+    const gl_state* state = gl_state_current();
+    if (!state->has_samplers || unit >= GL_STATE_TEXTURE_UNITS ||
+            state->samplers[unit] == sampler) {
+        return;
+    }
+    real->__glBindSampler(unit, sampler);
+    gl_state_on_bind_sampler(unit, sampler);
+}
+
+void gl_state_restore(const gl_state* saved) {
+    for (int j = 0; j < GL_STATE_PIXEL_STORE_PARAMS; j++) {
+        gl_state_pixel_store(pixel_store_params[j], saved->pixel_store[j]);
+    }
+    for (int j = 0; j < GL_STATE_CAPABILITIES; j++) {
+        gl_state_set_enabled(j, saved->enabled & (1u << j));
+    }
+    gl_state_color_mask(saved->color_mask[0], saved->color_mask[1],
+                        saved->color_mask[2], saved->color_mask[3]);
+    set_polygon_mode(saved->polygon_mode[0], saved->polygon_mode[1]);
+    gl_state_viewport(saved->viewport[0], saved->viewport[1],
+                      saved->viewport[2], saved->viewport[3]);
+    gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, saved->pack_buffer);
+    gl_state_bind_buffer(GL_PIXEL_UNPACK_BUFFER, saved->unpack_buffer);
+    gl_state_bind_framebuffer(GL_DRAW_FRAMEBUFFER, saved->draw_framebuffer);
+    gl_state_bind_framebuffer(GL_READ_FRAMEBUFFER, saved->read_framebuffer);
+    for (int j = 0; j < GL_STATE_TEXTURE_UNITS; j++) {
+        if (saved->textures[j] != tracked()->textures[j]) {
+            gl_state_active_texture(GL_TEXTURE0 + j);
+            gl_state_bind_texture(saved->textures[j]);
+        }
+        gl_state_bind_sampler(j, saved->samplers[j]);
+    }
+    gl_state_active_texture(saved->active_texture);
+    gl_state_bind_vertex_array(saved->vertex_array);
+    gl_state_use_program(saved->program);
+}
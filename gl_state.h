@@ -0,0 +1,131 @@
+#pragma once
+
+#include <stdbool.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#include "hooks_dict.h"
+
+// Only the units the capture code binds textures to are tracked
+#define GL_STATE_TEXTURE_UNITS 2
+#define GL_STATE_PIXEL_STORE_PARAMS 16
+
+// Capabilities the capture code turns off around its own draws and blits
+typedef enum {
+    GL_STATE_SCISSOR_TEST,
+    GL_STATE_BLEND,
+    GL_STATE_DEPTH_TEST,
+    GL_STATE_STENCIL_TEST,
+    GL_STATE_CULL_FACE,
+    GL_STATE_FRAMEBUFFER_SRGB,
+    GL_STATE_RASTERIZER_DISCARD,
+    GL_STATE_COLOR_LOGIC_OP,
+    GL_STATE_CAPABILITIES
+} gl_state_capability;
+
+// Shadow copy of the state the capture path reads and changes, kept up to
+// date by the hooked entry points so nothing has to be queried with glGet*
+// while the application is rendering. Each context has its own copy, which
+// is queried from GL once when the context is first made current and again
+// after calls that change state in ways we don't follow (glPopAttrib and
+// the like).
+typedef struct {
+    bool synced;
+    // Units whose GL_TEXTURE_2D binding is known
+    unsigned int known_units;
+    GLuint draw_framebuffer;
+    GLuint read_framebuffer;
+    GLuint pack_buffer;
+    GLuint unpack_buffer;
+    GLuint program;
+    // Not there before GL 3.0 without ARB_vertex_array_object
+    bool has_vertex_arrays;
+    GLuint vertex_array;
+    GLenum active_texture;
+    GLuint textures[GL_STATE_TEXTURE_UNITS];
+    // Sampler objects override the texture's own filtering, which can
+    // leave it incomplete. Only tracked from GL 3.3 and GLES 3.0 on.
+    bool has_samplers;
+    GLuint samplers[GL_STATE_TEXTURE_UNITS];
+    // Front and back, GLES has no polygon mode
+    bool has_polygon_mode;
+    GLint polygon_mode[2];
+    GLint pixel_store[GL_STATE_PIXEL_STORE_PARAMS];
+    GLint viewport[4];
+    GLboolean color_mask[4];
+    unsigned int enabled;
+} gl_state;
+
+void gl_state_init(const HOOKS* hooks);
+// False if an entry point save/restore calls through didn't resolve, the
+// capture path then stays off
+bool gl_state_resolved();
+// Makes state the calling thread's shadow, NULL falls back to a per-thread
+// copy that is synced again on its next use
+void gl_state_bind(gl_state* state);
+// The calling thread's shadow state, queried from GL first if needed
+gl_state* gl_state_current();
+void gl_state_invalidate();
+bool gl_state_enabled(const gl_state_capability capability);
+
+// Bookkeeping for the hooks, called after the real entry point
+void gl_state_on_bind_framebuffer(const GLenum target,
+                                  const GLuint framebuffer);
+void gl_state_on_bind_buffer(const GLenum target, const GLuint buffer);
+void gl_state_on_pixel_store(const GLenum pname, const GLint value);
+void gl_state_on_active_texture(const GLenum texture);
+void gl_state_on_bind_texture(const GLenum target, const GLuint texture);
+void gl_state_on_bind_texture_unit(const GLuint unit, const GLuint texture);
+void gl_state_on_bind_multi_texture(const GLenum texunit,
+                                    const GLenum target,
+                                    const GLuint texture);
+void gl_state_on_use_program(const GLuint program);
+void gl_state_on_bind_vertex_array(const GLuint vertex_array);
+void gl_state_on_viewport(const GLint x,
+                          const GLint y,
+                          const GLsizei width,
+                          const GLsizei height);
+void gl_state_on_enable(const GLenum cap, const bool enabled);
+void gl_state_on_color_mask(const GLboolean red,
+                            const GLboolean green,
+                            const GLboolean blue,
+                            const GLboolean alpha);
+void gl_state_on_polygon_mode(const GLenum face, const GLenum mode);
+void gl_state_on_bind_sampler(const GLuint unit, const GLuint sampler);
+void gl_state_on_delete_framebuffers(const GLsizei n,
+                                     const GLuint* framebuffers);
+void gl_state_on_delete_buffers(const GLsizei n, const GLuint* buffers);
+void gl_state_on_delete_textures(const GLsizei n, const GLuint* textures);
+void gl_state_on_delete_vertex_arrays(const GLsizei n,
+                                      const GLuint* vertex_arrays);
+void gl_state_on_delete_samplers(const GLsizei n, const GLuint* samplers);
+
+// Used by the capture code instead of the GL calls: they go straight to
+// the driver, skip calls that wouldn't change anything and keep the shadow
+// in step. Take a copy of gl_state_current() before changing anything and
+// hand it to gl_state_restore() afterwards, which puts back exactly what
+// was changed.
+void gl_state_bind_framebuffer(const GLenum target, const GLuint framebuffer);
+void gl_state_bind_buffer(const GLenum target, const GLuint buffer);
+void gl_state_pixel_store(const GLenum pname, const GLint value);
+// Default pack parameters with an alignment of 1, for tightly packed reads
+void gl_state_pack_tightly();
+void gl_state_active_texture(const GLenum texture);
+void gl_state_bind_texture(const GLuint texture);
+void gl_state_use_program(const GLuint program);
+void gl_state_bind_vertex_array(const GLuint vertex_array);
+void gl_state_viewport(const GLint x,
+                       const GLint y,
+                       const GLsizei width,
+                       const GLsizei height);
+void gl_state_set_enabled(const gl_state_capability capability,
+                          const bool enabled);
+void gl_state_color_mask(const GLboolean red,
+                         const GLboolean green,
+                         const GLboolean blue,
+                         const GLboolean alpha);
+// Front and back faces
+void gl_state_polygon_mode(const GLenum mode);
+// Does nothing before GL 3.3, where no sampler can be bound
+void gl_state_bind_sampler(const GLuint unit, const GLuint sampler);
+void gl_state_restore(const gl_state* saved);
@@ -0,0 +1,57 @@
+#include <string.h>
+
+#include "gpu_trace.h"
+#include "trace.h"
+
+void gpu_trace_begin(gpu_trace* timer, const char* name) {
+    if (!trace_enabled) {
+        return;
+    }
+    if (!timer->queries[0]) {
+        glGenQueries(GPU_TRACE_QUERIES, timer->queries);
+    }
+    // Out of queries, skip this sample rather than wait on the GPU
+    if (timer->issued - timer->retired == GPU_TRACE_QUERIES) {
+        return;
+    }
+
+    const int slot = timer->issued % GPU_TRACE_QUERIES;
+    timer->names[slot] = name;
+    timer->starts[slot] = trace_now_ns();
+    glBeginQuery(GL_TIME_ELAPSED, timer->queries[slot]);
+    timer->active = true;
+}
+
+void gpu_trace_end(gpu_trace* timer) {
+    if (!timer->active) {
+        return;
+    }
+    glEndQuery(GL_TIME_ELAPSED);
+    timer->active = false;
+    timer->issued++;
+}
+
+void gpu_trace_collect(gpu_trace* timer) {
+    while (timer->retired != timer->issued) {
+        const int slot = timer->retired % GPU_TRACE_QUERIES;
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(timer->queries[slot], GL_QUERY_RESULT_AVAILABLE,
+                            &available);
+        if (!available) {
+            return;
+        }
+
+        GLuint64 elapsed;
+        glGetQueryObjectui64v(timer->queries[slot], GL_QUERY_RESULT, &elapsed);
+        trace_record(timer->names[slot], TRACE_GPU_TID, timer->starts[slot],
+                     elapsed);
+        timer->retired++;
+    }
+}
+
+void gpu_trace_destroy(gpu_trace* timer) {
+    if (timer->queries[0]) {
+        glDeleteQueries(GPU_TRACE_QUERIES, timer->queries);
+    }
+    memset(timer, 0, sizeof(gpu_trace));
+}
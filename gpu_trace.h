@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+
+#define GPU_TRACE_QUERIES 8
+
+// GL_TIME_ELAPSED queries around capture work on the render thread. Results
+// are collected a few frames later, once available, and recorded on the GPU
+// track of the trace. Does nothing unless tracing is enabled.
+typedef struct {
+    GLuint queries[GPU_TRACE_QUERIES];
+    const char* names[GPU_TRACE_QUERIES];
+    uint64_t starts[GPU_TRACE_QUERIES];
+    unsigned int issued;
+    unsigned int retired;
+    bool active;
+} gpu_trace;
+
+void gpu_trace_begin(gpu_trace* timer, const char* name);
+void gpu_trace_end(gpu_trace* timer);
+void gpu_trace_collect(gpu_trace* timer);
+void gpu_trace_destroy(gpu_trace* timer);
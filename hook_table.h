@@ -0,0 +1,134 @@
+// Generated by tools/gen_hook_table.py from hooks_dict.h, don't edit
+#pragma once
+
+#include <stdint.h>
+
+#define HOOK_TABLE_SEED 2166136286u
+#define HOOK_TABLE_SIZE 512
+#define HOOK_TABLE_ENTRIES 53
+
+// X(name, hook) for every name in the table
+#define HOOK_TABLE_NAMES(X) \
+    X(glXSwapBuffers, glXSwapBuffers) \
+    X(glXGetProcAddressARB, glXGetProcAddressARB) \
+    X(glXGetProcAddress, glXGetProcAddress) \
+    X(glXMakeCurrent, glXMakeCurrent) \
+    X(glXMakeContextCurrent, glXMakeContextCurrent) \
+    X(glXDestroyContext, glXDestroyContext) \
+    X(eglSwapBuffers, eglSwapBuffers) \
+    X(eglMakeCurrent, eglMakeCurrent) \
+    X(eglDestroyContext, eglDestroyContext) \
+    X(eglGetProcAddress, eglGetProcAddress) \
+    X(glViewport, glViewport) \
+    X(glBindFramebuffer, glBindFramebuffer) \
+    X(glBindFramebufferEXT, glBindFramebufferEXT) \
+    X(glViewportIndexedf, glViewportIndexedf) \
+    X(glViewportIndexedfv, glViewportIndexedfv) \
+    X(glViewportArrayv, glViewportArrayv) \
+    X(glBindBuffer, glBindBuffer) \
+    X(glPixelStorei, glPixelStorei) \
+    X(glPixelStoref, glPixelStoref) \
+    X(glActiveTexture, glActiveTexture) \
+    X(glBindTexture, glBindTexture) \
+    X(glBindTextureUnit, glBindTextureUnit) \
+    X(glBindTextures, glBindTextures) \
+    X(glBindMultiTextureEXT, glBindMultiTextureEXT) \
+    X(glUseProgram, glUseProgram) \
+    X(glBindVertexArray, glBindVertexArray) \
+    X(glBindVertexArrayAPPLE, glBindVertexArrayAPPLE) \
+    X(glEnable, glEnable) \
+    X(glDisable, glDisable) \
+    X(glEnablei, glEnablei) \
+    X(glDisablei, glDisablei) \
+    X(glColorMask, glColorMask) \
+    X(glColorMaski, glColorMaski) \
+    X(glPolygonMode, glPolygonMode) \
+    X(glBindSampler, glBindSampler) \
+    X(glBindSamplers, glBindSamplers) \
+    X(glDeleteFramebuffers, glDeleteFramebuffers) \
+    X(glDeleteBuffers, glDeleteBuffers) \
+    X(glDeleteTextures, glDeleteTextures) \
+    X(glDeleteVertexArrays, glDeleteVertexArrays) \
+    X(glDeleteSamplers, glDeleteSamplers) \
+    X(glPopAttrib, glPopAttrib) \
+    X(glPopClientAttrib, glPopClientAttrib) \
+    X(glBindBufferARB, glBindBuffer) \
+    X(glActiveTextureARB, glActiveTexture) \
+    X(glDeleteBuffersARB, glDeleteBuffers) \
+    X(glBindTextureEXT, glBindTexture) \
+    X(glDeleteTexturesEXT, glDeleteTextures) \
+    X(glDeleteFramebuffersEXT, glDeleteFramebuffers) \
+    X(glUseProgramObjectARB, glUseProgram) \
+    X(glEnableIndexedEXT, glEnablei) \
+    X(glDisableIndexedEXT, glDisablei) \
+    X(glColorMaskIndexedEXT, glColorMaski)
+
+typedef struct {
+    const char* symbol;
+    void* hook;
+} hook_entry;
+
+// 32 bit FNV-1a starting from the seed
+static inline uint32_t hook_table_hash(const char* symbol) {
+    uint32_t value = HOOK_TABLE_SEED;
+    for (; *symbol; symbol++) {
+        value = (value ^ (unsigned char) *symbol) * 16777619u;
+    }
+    return value;
+}
+
+static const hook_entry hook_table[HOOK_TABLE_SIZE] = {
+    [0] = {"glColorMask", (void*) &glColorMask},
+    [1] = {"glDeleteTexturesEXT", (void*) &glDeleteTextures},
+    [2] = {"glDeleteVertexArrays", (void*) &glDeleteVertexArrays},
+    [15] = {"glDeleteSamplers", (void*) &glDeleteSamplers},
+    [19] = {"glXGetProcAddress", (void*) &glXGetProcAddress},
+    [21] = {"glDeleteFramebuffersEXT", (void*) &glDeleteFramebuffers},
+    [22] = {"glBindTextures", (void*) &glBindTextures},
+    [24] = {"glDeleteBuffersARB", (void*) &glDeleteBuffers},
+    [60] = {"glColorMaskIndexedEXT", (void*) &glColorMaski},
+    [82] = {"eglGetProcAddress", (void*) &eglGetProcAddress},
+    [89] = {"glXMakeContextCurrent", (void*) &glXMakeContextCurrent},
+    [90] = {"glViewportArrayv", (void*) &glViewportArrayv},
+    [99] = {"glBindVertexArrayAPPLE", (void*) &glBindVertexArrayAPPLE},
+    [104] = {"glBindBuffer", (void*) &glBindBuffer},
+    [131] = {"glPopClientAttrib", (void*) &glPopClientAttrib},
+    [139] = {"glPixelStorei", (void*) &glPixelStorei},
+    [142] = {"glEnableIndexedEXT", (void*) &glEnablei},
+    [151] = {"eglDestroyContext", (void*) &eglDestroyContext},
+    [154] = {"glDeleteTextures", (void*) &glDeleteTextures},
+    [155] = {"glBindBufferARB", (void*) &glBindBuffer},
+    [158] = {"glActiveTexture", (void*) &glActiveTexture},
+    [171] = {"glBindSamplers", (void*) &glBindSamplers},
+    [180] = {"glBindFramebufferEXT", (void*) &glBindFramebufferEXT},
+    [181] = {"glDeleteBuffers", (void*) &glDeleteBuffers},
+    [187] = {"glBindTextureUnit", (void*) &glBindTextureUnit},
+    [202] = {"glXGetProcAddressARB", (void*) &glXGetProcAddressARB},
+    [218] = {"glXMakeCurrent", (void*) &glXMakeCurrent},
+    [229] = {"glBindFramebuffer", (void*) &glBindFramebuffer},
+    [230] = {"glUseProgramObjectARB", (void*) &glUseProgram},
+    [241] = {"glBindVertexArray", (void*) &glBindVertexArray},
+    [242] = {"glViewportIndexedf", (void*) &glViewportIndexedf},
+    [261] = {"glBindMultiTextureEXT", (void*) &glBindMultiTextureEXT},
+    [280] = {"glBindTextureEXT", (void*) &glBindTexture},
+    [289] = {"glBindTexture", (void*) &glBindTexture},
+    [291] = {"glDisableIndexedEXT", (void*) &glDisablei},
+    [309] = {"eglMakeCurrent", (void*) &eglMakeCurrent},
+    [310] = {"glPolygonMode", (void*) &glPolygonMode},
+    [331] = {"glColorMaski", (void*) &glColorMaski},
+    [371] = {"glDisable", (void*) &glDisable},
+    [400] = {"glUseProgram", (void*) &glUseProgram},
+    [404] = {"glPopAttrib", (void*) &glPopAttrib},
+    [406] = {"glDeleteFramebuffers", (void*) &glDeleteFramebuffers},
+    [414] = {"glEnable", (void*) &glEnable},
+    [435] = {"glViewport", (void*) &glViewport},
+    [446] = {"glXDestroyContext", (void*) &glXDestroyContext},
+    [460] = {"glViewportIndexedfv", (void*) &glViewportIndexedfv},
+    [466] = {"glPixelStoref", (void*) &glPixelStoref},
+    [469] = {"glEnablei", (void*) &glEnablei},
+    [475] = {"glXSwapBuffers", (void*) &glXSwapBuffers},
+    [477] = {"glActiveTextureARB", (void*) &glActiveTexture},
+    [494] = {"glDisablei", (void*) &glDisablei},
+    [496] = {"eglSwapBuffers", (void*) &eglSwapBuffers},
+    [506] = {"glBindSampler", (void*) &glBindSampler},
+};
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <dlfcn.h>
 #include <pthread.h>
 #include <X11/Xlib.h>
@@ -14,21 +15,38 @@
 #include "elfhacks.h"
 #include "pipe.h"
 #include "hooks_dict.h"
+#include "hook_table.h"
 #include "capture_pbo.h"
+#include "config.h"
+#include "capture_context.h"
+#include "png_encode.h"
+#include "log.h"
+#include "session.h"
+#include "gl_state.h"
+#include "frame_stream.h"
 
 #define __PUBLIC __attribute__ ((visibility ("default")))
 
 #define THREADS 8
+#define WRITER_DRAIN_TIMEOUT_MS 2000
 
 HOOKS hooks;
-GLuint pbo[2];
-GLuint texture[2];
+frame_pool pool;
+frame_queue queue;
 pthread_t threads[THREADS];
-pipe_producer_t* frame_producer;
-pipe_consumer_t* frame_writer[THREADS];
-GLsizei window_res_x = 100;
-GLsizei window_res_y = 100;
-int i = 1;
+consumer_context consumers[THREADS];
+frame_writer writer;
+frame_archive archive;
+frame_archive half_archive;
+frame_share share;
+frame_stream stream;
+bool streaming = false;
+sample_shard samples[THREADS];
+char session_dir[SESSION_PATH_SIZE];
+// Held until exit, so no other process's cleanup deletes the session
+int session_lock = -1;
+// Frame IDs are shared by every context so that file names stay unique
+atomic_uint frame_id = 1;
 bool init_dir = false;
 bool init_pipes = false;
 
@@ -60,176 +78,935 @@ void get_real_dlsym(f_dlopen_t* f_dlopen,
     eh_destroy_obj(&libdl);
 }
 
+#define RESOLVE_GLX(symbol, type) \
+    hooks.__##symbol = (type) resolve_from(hooks.libGL_handle, #symbol);
+#define RESOLVE_EGL(symbol, type) \
+    hooks.__##symbol = (type) resolve_from(hooks.libEGL_handle, #symbol);
+#define RESOLVE_GL(symbol, type) \
+    hooks.__##symbol = (type) resolve_gl(#symbol);
+#define COUNT_HOOK(symbol, other) + 1
+
+_Static_assert(0 GLX_HOOKS(COUNT_HOOK) EGL_HOOKS(COUNT_HOOK)
+               GL_HOOKS(COUNT_HOOK) HOOK_ALIASES(COUNT_HOOK) ==
+               HOOK_TABLE_ENTRIES,
+               "hook_table.h is out of date, run make");
+
+// One constant per name in hooks_dict.h, aliases share the one of their
+// hook. A name in hook_table.h that isn't in the lists any more doesn't
+// build, one that hands out another hook fails the assert below. With
+// the counts equal, both hold the same names.
+#define HOOK_INDEX(symbol, type) hook_index_##symbol,
+#define HOOK_ALIAS_INDEX(alias, symbol) \
+    hook_index_##alias = hook_index_##symbol,
+enum {
+    GLX_HOOKS(HOOK_INDEX)
+    EGL_HOOKS(HOOK_INDEX)
+    GL_HOOKS(HOOK_INDEX)
+    HOOK_ALIASES(HOOK_ALIAS_INDEX)
+};
+#define CHECK_HOOK(symbol, hook) \
+    _Static_assert(hook_index_##symbol == hook_index_##hook, \
+                   "hook_table.h maps " #symbol " to " #hook \
+                   ", run make");
+HOOK_TABLE_NAMES(CHECK_HOOK)
+
+// dlsym() with a NULL handle searches the global scope, which finds our
+// own hooks first, so a library that didn't load resolves nothing. Hooks
+// that stay NULL don't call through.
+static void* resolve_from(void* handle, const char* name) {
+    void* function = handle ? hooks.f_dlsym(handle, name) : NULL;
+    if (!function) {
+        LOG_WARN("Can't resolve %s, it isn't called through", name);
+    }
+    return function;
+}
+
+// libGL doesn't have to export entry points past GL 1.x
+static void* resolve_gl(const char* name) {
+    void* function = hooks.libGL_handle ?
+                     hooks.f_dlsym(hooks.libGL_handle, name) : NULL;
+    if (!function && hooks.__glXGetProcAddressARB) {
+        function = (void*) hooks.__glXGetProcAddressARB(
+                       (const GLubyte*) name);
+    }
+    if (!function && hooks.__eglGetProcAddress) {
+        function = (void*) hooks.__eglGetProcAddress(name);
+    }
+    // Extension entry points the driver lacks are expected
+    if (!function) {
+        LOG_DEBUG("Can't resolve %s, it isn't called through", name);
+    }
+    return function;
+}
+
+// EGL-only and GLVND headless systems can lack libGL.so.1, GLVND's
+// libOpenGL.so.0 has the GL entry points there but no GLX
+static void* open_gl_library() {
+    void* handle = hooks.f_dlopen("libGL.so.1", RTLD_LAZY);
+    if (!handle) {
+        handle = hooks.f_dlopen("libOpenGL.so.0", RTLD_LAZY);
+    }
+    if (!handle) {
+        LOG_WARN("Neither libGL.so.1 nor libOpenGL.so.0 can be loaded");
+    }
+    return handle;
+}
+
+void finish_capture() {
+    // Whatever the consumers are still popping gets written before the
+    // archives are closed
+    frame_queue_close(&queue);
+    frame_queue_report(&queue);
+    if (streaming) {
+        frame_stream_drain(&stream, atomic_load(&(queue.pushed)),
+                           WRITER_DRAIN_TIMEOUT_MS);
+    } else {
+        for (int j = 0; j < THREADS; j++) {
+            pthread_join(threads[j], NULL);
+        }
+    }
+    frame_dedup_report();
+    if (consumers[0].samples) {
+        for (int j = 0; j < THREADS; j++) {
+            sample_shard_flush(&(samples[j]));
+        }
+    }
+    frame_writer_drain(&writer, WRITER_DRAIN_TIMEOUT_MS);
+    if (consumers[0].archive) {
+        frame_archive_close(&archive);
+    }
+    if (consumers[0].half_archive) {
+        frame_archive_close(&half_archive);
+    }
+    if (consumers[0].share) {
+        frame_share_close(&share);
+    }
+    log_flush();
+}
+
 void init_hook_info(const bool need_glx_calls,
+                    const bool need_egl_calls,
                     const bool need_gl_calls) {
-    hooks.init = true;
-    get_real_dlsym(&(hooks.f_dlopen), &(hooks.f_dlsym), &(hooks.f_dlvsym));
-
-    if (need_glx_calls) {
-        hooks.init_GLX = true;
-        hooks.libGL_handle = hooks.f_dlopen("libGL.so.1", RTLD_LAZY);
+    if (!hooks.init) {
+        hooks.init = true;
+        get_real_dlsym(&(hooks.f_dlopen), &(hooks.f_dlsym),
+                       &(hooks.f_dlvsym));
+    }
 
-        hooks.__glXSwapBuffers = (f_glx_swap_buffers_t) hooks.f_dlsym(
-                                     hooks.libGL_handle, "glXSwapBuffers");
+    // GL entry points come from libGL whichever API created the context,
+    // only the first call tries to load it
+    if ((need_glx_calls || need_gl_calls) && !hooks.tried_libGL) {
+        hooks.tried_libGL = true;
+        hooks.libGL_handle = open_gl_library();
+    }
 
-        hooks.__glXGetProcAddressARB = (f_glx_ext_func_ptr_t(*)(const GLubyte*))
-                                       hooks.f_dlsym(hooks.libGL_handle,
-                                               "glXGetProcAddressARB");
+    if (need_glx_calls && !hooks.init_GLX) {
+        hooks.init_GLX = true;
+        GLX_HOOKS(RESOLVE_GLX)
+    }
 
-        hooks.__glXMakeCurrent = (f_glx_make_current_t) hooks.f_dlsym(
-                                     hooks.libGL_handle, "glXMakeCurrent");
+    if (need_egl_calls && !hooks.init_EGL) {
+        hooks.init_EGL = true;
+        hooks.libEGL_handle = hooks.f_dlopen("libEGL.so.1", RTLD_LAZY);
+        if (!hooks.libEGL_handle) {
+            LOG_WARN("libEGL.so.1 can't be loaded");
+        }
+        EGL_HOOKS(RESOLVE_EGL)
+        hooks.f_egl_query_surface = (f_egl_query_surface_t) resolve_from(
+                                        hooks.libEGL_handle,
+                                        "eglQuerySurface");
+        hooks.f_egl_query_context = (f_egl_query_context_t) resolve_from(
+                                        hooks.libEGL_handle,
+                                        "eglQueryContext");
     }
 
-    if (need_gl_calls) {
+    if (need_gl_calls && !hooks.init_GL) {
         hooks.init_GL = true;
-        hooks.__glViewport = (f_gl_viewport_t) hooks.f_dlsym(
-                                 hooks.libGL_handle, "glViewport");
-        hooks.__glBindFramebuffer = (f_gl_bind_framebuffer_t)
-                                    hooks.f_dlsym(hooks.libGL_handle,
-                                            "glBindFramebuffer");
+        GL_HOOKS(RESOLVE_GL)
+        gl_state_init(&hooks);
+    }
+
+    if (!init_dir) {
+        // The collector daemon creates the session and runs retention, the
+        // game mustn't touch its data directory at all
+        streaming = strcmp(config_get_str("DEPTH_UPSAMPLE_OUTPUT", "files"),
+                           "collector") == 0 &&
+                    frame_stream_connect(&stream);
+        if (streaming) {
+            frame_dedup_open(NULL);
+        } else {
+            // Fall back to writing straight into the data directory
+            if (!session_create(DEPTH_UPSAMPLE_DIR, (int) getpid(),
+                                session_dir, sizeof(session_dir),
+                                &session_lock)) {
+                snprintf(session_dir, sizeof(session_dir), "%s",
+                         DEPTH_UPSAMPLE_DIR);
+            } else {
+                session_start_cleanup(DEPTH_UPSAMPLE_DIR, session_dir);
+            }
+            frame_dedup_open(session_dir);
+        }
+        init_dir = true;
     }
 
     if (!init_pipes) {
         // Create our file pipes
         // ID, width, height, color texture pointer, depth texture pointer
-        pipe_t* pipe = pipe_new(sizeof(buffer_element), 200);
+        // The pipe itself is unbounded, the frame pool's byte budget is
+        // what limits how much capture data can be queued
+        pipe_t* pipe = pipe_new(sizeof(buffer_element), 0);
+
+        frame_pool_init(&pool, (size_t) config_get_int(
+                            "DEPTH_UPSAMPLE_QUEUE_MB",
+                            FRAME_POOL_DEFAULT_MB) << 20);
+        frame_queue_init(&queue, &pool, pipe);
 
-        frame_producer = pipe_producer_new(pipe);
+        // The collector daemon encodes and writes everything, so none of
+        // the consumer threads are started in the game
+        if (streaming) {
+            frame_pool_share(&pool);
+            frame_stream_start(&stream, pipe);
+            pipe_free(pipe);
+            atexit(finish_capture);
+            init_pipes = true;
+            return;
+        }
+        const char* output_mode = config_get_str("DEPTH_UPSAMPLE_OUTPUT",
+                                                 "files");
+
+        // One append-only archive instead of two files per frame
+        frame_archive* output = NULL;
+        frame_archive* half_output = NULL;
+        const bool direct_io = config_get_int("DEPTH_UPSAMPLE_DIRECT_IO", 0);
+        char archive_path[SESSION_PATH_SIZE +
+                          sizeof(ARCHIVE_HALF_FILE_NAME)];
+        snprintf(archive_path, sizeof(archive_path), "%s%s", session_dir,
+                 ARCHIVE_FILE_NAME);
+        if (strcmp(output_mode, "archive") == 0 &&
+                frame_archive_open(&archive, archive_path, direct_io)) {
+            output = &archive;
+            // GPU downsampled frames get an archive of their own
+            snprintf(archive_path, sizeof(archive_path), "%s%s",
+                     session_dir, ARCHIVE_HALF_FILE_NAME);
+            if (downsample_default_mode() != DOWNSAMPLE_OFF &&
+                    frame_archive_open(&half_archive, archive_path,
+                                       direct_io)) {
+                half_output = &half_archive;
+            }
+        }
+        // Live frames for other processes, with or without files
+        const bool share_only = strcmp(output_mode, "shm") == 0;
+        frame_share* shared = frame_share_open(&share, share_only) ?
+                              &share : NULL;
+        frame_writer_init(&writer);
         for (int j = 0; j < THREADS; j++) {
-            frame_writer[j] = pipe_consumer_new(pipe);
+            consumers[j].consumer = pipe_consumer_new(pipe);
+            consumers[j].archive = output;
+            consumers[j].half_archive = half_output;
+            consumers[j].share = shared;
+            // Without a ring the frames at least end up in files
+            consumers[j].share_only = share_only && shared;
+            consumers[j].samples = NULL;
+            // Training samples straight from the captured buffers
+            if (strcmp(output_mode, "samples") == 0) {
+                sample_shard_init(&(samples[j]), &writer, session_dir, j);
+                consumers[j].samples = &(samples[j]);
+            }
+            consumers[j].output_dir = session_dir;
+            consumers[j].writer = &writer;
         }
         pipe_free(pipe);
+        png_encoder_init();
+        atexit(finish_capture);
 
         for (int j = 0; j < THREADS; j++) {
             pthread_create(&(threads[j]), NULL, frame_consumer_thread,
-                           (void*) frame_writer[j]);
+                           (void*) &(consumers[j]));
         }
 
         init_pipes = true;
     }
+}
 
-    if (!init_dir) {
-        DIR* dir = opendir(DEPTH_UPSAMPLE_DIR);
-        struct dirent* ret;
-        if (dir) {
-            while ((ret = readdir(dir)) != NULL) {
-                if (strcmp(ret->d_name, ".") == 0 ||
-                        strcmp(ret->d_name, "..") == 0) {
-                    continue;
-                }
-                char file_path[300];
-                memset(file_path, 0, sizeof(file_path));
-                strcat(file_path, DEPTH_UPSAMPLE_DIR);
-                strcat(file_path, ret->d_name);
-                printf("Deleting %s\n", file_path);
-                remove(file_path);
-            }
-        } else {
-            printf("Creating dir\n");
-            mkdir(DEPTH_UPSAMPLE_DIR, 0700);
+static void resize_capture(capture_context* context,
+                           const GLsizei width,
+                           const GLsizei height) {
+    if (width != context->width || height != context->height) {
+        LOG_INFO("Resizing capture to (%i, %i)", width, height);
+        context->width = width;
+        context->height = height;
+    }
+}
+
+void before_swap_buffers() {
+    LOG_TRACE("Before swap buffers");
+    capture_context* context = capture_context_current();
+    if (context && !atomic_load(&(context->destroyed))) {
+        retire_pbo_ring(&(context->ring), false);
+        const unsigned int ID = atomic_fetch_add(&frame_id, 1);
+        if (capture_schedule_should_capture(&(context->schedule),
+                                            context->width,
+                                            context->height)) {
+            write_image(context->width, context->height, &(context->ring),
+                        ID);
         }
-        init_dir = true;
     }
 }
 
-void before_swap_buffers(Display* dpy,
-                         GLXDrawable drawable) {
-    printf("Before swap buffers\n");
-    read_into_pbo(pbo, window_res_x, window_res_y);
-    update_textures_from_pbo(pbo, texture, window_res_x, window_res_y);
-    if (++i % 30 == 0) {
-        write_image(window_res_x, window_res_y, texture, i, frame_producer);
+// Pushes the readbacks of the context being switched away from that have
+// already finished. Waiting for the rest here would stall toolkits that
+// release the context every frame, only destroying it flushes the ring.
+static void before_make_current(void* ctx) {
+    capture_context* context = capture_context_current();
+    if (context && context->context != ctx &&
+            !atomic_load(&(context->destroyed))) {
+        retire_pbo_ring(&(context->ring), false);
+    }
+}
+
+// Returns the entry of the context that was made current, or NULL if it
+// isn't captured
+capture_context* after_make_current(void* ctx) {
+    LOG_DEBUG("Just made current");
+    if (!gl_state_resolved()) {
+        capture_context_make_current(NULL);
+        return NULL;
+    }
+    capture_context* context = capture_context_make_current(ctx);
+    if (context && context->ring.size == 0) {
+        create_pbo_ring(&(context->ring),
+                        config_get_int("DEPTH_UPSAMPLE_PBO_RING",
+                                       PBO_RING_DEFAULT_SIZE),
+                        &queue);
+    }
+    return context;
+}
+
+// Start from the drawable's size until the application sets a viewport
+static void after_glx_make_current(Display* dpy,
+                                   GLXDrawable drawable,
+                                   GLXContext ctx) {
+    capture_context* context = after_make_current(ctx);
+    if (context && drawable != context->drawable) {
+        context->drawable = drawable;
+        unsigned int width = 0;
+        unsigned int height = 0;
+        glXQueryDrawable(dpy, drawable, GLX_WIDTH, &width);
+        glXQueryDrawable(dpy, drawable, GLX_HEIGHT, &height);
+        if (width > 0 && height > 0) {
+            resize_capture(context, width, height);
+        }
+    }
+}
+
+static void after_egl_make_current(EGLDisplay dpy,
+                                   EGLSurface surface,
+                                   EGLContext ctx) {
+    // The capture path is desktop GL only, leave GLES contexts alone
+    EGLint client_type = EGL_OPENGL_API;
+    if (ctx != EGL_NO_CONTEXT && hooks.f_egl_query_context) {
+        hooks.f_egl_query_context(dpy, ctx, EGL_CONTEXT_CLIENT_TYPE,
+                                  &client_type);
+    }
+    if (client_type != EGL_OPENGL_API) {
+        capture_context_make_current(NULL);
+        return;
+    }
+
+    capture_context* context = after_make_current(ctx);
+    if (context && (uintptr_t) surface != context->drawable) {
+        context->drawable = (uintptr_t) surface;
+        EGLint width = 0;
+        EGLint height = 0;
+        // Surfaceless contexts only render to framebuffer objects
+        if (surface != EGL_NO_SURFACE && hooks.f_egl_query_surface) {
+            hooks.f_egl_query_surface(dpy, surface, EGL_WIDTH, &width);
+            hooks.f_egl_query_surface(dpy, surface, EGL_HEIGHT, &height);
+        }
+        if (width > 0 && height > 0) {
+            resize_capture(context, width, height);
+        }
     }
-    hooks.__glXSwapBuffers(dpy, drawable);
-    printf("After swap buffers\n");
 }
 
-void after_make_current() {
-    printf("Just made current\n");
-    create_pbo(&(pbo[0]), &(pbo[1]));
+// Our GL objects can only be freed through the context itself. Otherwise
+// the driver frees them along with it, and whatever was still in flight is
+// lost.
+static void before_destroy_context(void* ctx) {
+    capture_context* context = capture_context_remove(ctx);
+    if (!context) {
+        return;
+    }
+    if (context == capture_context_current()) {
+        destroy_pbo_ring(&(context->ring));
+        capture_schedule_destroy(&(context->schedule));
+    } else if (context->ring.issued != context->ring.retired) {
+        LOG_WARN("Context destroyed while not current, dropping %u frames",
+                 context->ring.issued - context->ring.retired);
+    }
+    capture_context_release(context);
 }
 
 __PUBLIC void glXSwapBuffers(Display* dpy, GLXDrawable drawable) {
     if (!hooks.init_GLX) {
-        init_hook_info(true, true);
+        init_hook_info(true, false, true);
     }
-    before_swap_buffers(dpy, drawable);
+    if (!hooks.__glXSwapBuffers) {
+        return;
+    }
+    before_swap_buffers();
+    hooks.__glXSwapBuffers(dpy, drawable);
+    LOG_TRACE("After swap buffers");
 }
 
 __PUBLIC Bool glXMakeCurrent(Display* dpy, GLXDrawable drawable,
                              GLXContext ctx) {
     if (!hooks.init_GLX) {
-        init_hook_info(true, true);
+        init_hook_info(true, false, true);
     }
+    if (!hooks.__glXMakeCurrent) {
+        return False;
+    }
+    before_make_current(ctx);
     Bool ret = hooks.__glXMakeCurrent(dpy, drawable, ctx);
-    after_make_current();
+    if (ret) {
+        after_glx_make_current(dpy, drawable, ctx);
+    }
     return ret;
 }
 
-__PUBLIC void glViewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+__PUBLIC Bool glXMakeContextCurrent(Display* dpy, GLXDrawable draw,
+                                    GLXDrawable read, GLXContext ctx) {
+    if (!hooks.init_GLX) {
+        init_hook_info(true, false, true);
+    }
+    if (!hooks.__glXMakeContextCurrent) {
+        return False;
+    }
+    before_make_current(ctx);
+    Bool ret = hooks.__glXMakeContextCurrent(dpy, draw, read, ctx);
+    if (ret) {
+        after_glx_make_current(dpy, draw, ctx);
+    }
+    return ret;
+}
+
+__PUBLIC void glXDestroyContext(Display* dpy, GLXContext ctx) {
     if (!hooks.init_GLX) {
-        init_hook_info(true, true);
+        init_hook_info(true, false, true);
+    }
+    if (!hooks.__glXDestroyContext) {
+        return;
     }
+    before_destroy_context(ctx);
+    hooks.__glXDestroyContext(dpy, ctx);
+}
 
-    printf("Trying to change the viewport to %ix%i\n", width, height);
+// Headless renderers use EGL, often with pbuffer surfaces on llvmpipe
+__PUBLIC EGLBoolean eglSwapBuffers(EGLDisplay dpy, EGLSurface surface) {
+    if (!hooks.init_EGL) {
+        init_hook_info(false, true, true);
+    }
+    if (!hooks.__eglSwapBuffers) {
+        return EGL_FALSE;
+    }
+    before_swap_buffers();
+    EGLBoolean ret = hooks.__eglSwapBuffers(dpy, surface);
+    LOG_TRACE("After swap buffers");
+    return ret;
+}
+
+__PUBLIC EGLBoolean eglMakeCurrent(EGLDisplay dpy, EGLSurface draw,
+                                   EGLSurface read, EGLContext ctx) {
+    if (!hooks.init_EGL) {
+        init_hook_info(false, true, true);
+    }
+    if (!hooks.__eglMakeCurrent) {
+        return EGL_FALSE;
+    }
+    before_make_current(ctx);
+    EGLBoolean ret = hooks.__eglMakeCurrent(dpy, draw, read, ctx);
+    if (ret) {
+        after_egl_make_current(dpy, draw, ctx);
+    }
+    return ret;
+}
+
+__PUBLIC EGLBoolean eglDestroyContext(EGLDisplay dpy, EGLContext ctx) {
+    if (!hooks.init_EGL) {
+        init_hook_info(false, true, true);
+    }
+    if (!hooks.__eglDestroyContext) {
+        return EGL_FALSE;
+    }
+    before_destroy_context(ctx);
+    return hooks.__eglDestroyContext(dpy, ctx);
+}
+
+__PUBLIC void glViewport(GLint x, GLint y, GLsizei width, GLsizei height) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glViewport) {
+        return;
+    }
+
+    LOG_TRACE("Trying to change the viewport to %ix%i", width, height);
     hooks.__glViewport(x, y, width, height);
+    gl_state_on_viewport(x, y, width, height);
 
-    GLint old_fbo_id;
-    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &old_fbo_id);
-    if (old_fbo_id == 0) {
-        printf("Default framebuffer bound, resetting window size\n");
-        if (width != window_res_x || height != window_res_y) {
-            printf("Resizing textures to (%i, %i)\n", width, height);
-            window_res_x = width;
-            window_res_y = height;
-            create_textures(&(texture[0]), &(texture[1]),
-                            width, height);
-        }
+    capture_context* context = capture_context_current();
+    if (context && gl_state_current()->draw_framebuffer == 0) {
+        LOG_TRACE("Default framebuffer bound, resetting window size");
+        resize_capture(context, width, height);
     }
 }
 
 __PUBLIC void glBindFramebuffer(GLenum target, GLuint framebuffer) {
-    if (!hooks.init_GLX) {
-        init_hook_info(true, true);
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindFramebuffer) {
+        return;
     }
 
-    printf("Trying to bind framebuffer %i\n", framebuffer);
+    LOG_TRACE("Trying to bind framebuffer %u", framebuffer);
     hooks.__glBindFramebuffer(target, framebuffer);
+    gl_state_on_bind_framebuffer(target, framebuffer);
+}
+
+__PUBLIC void glBindFramebufferEXT(GLenum target, GLuint framebuffer) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindFramebufferEXT) {
+        return;
+    }
+    hooks.__glBindFramebufferEXT(target, framebuffer);
+    gl_state_on_bind_framebuffer(target, framebuffer);
+}
+
+// Viewport 0 is the one glViewport sets, its float bounds are queried again
+// rather than rounded here
+__PUBLIC void glViewportIndexedf(GLuint index, GLfloat x, GLfloat y,
+                                 GLfloat width, GLfloat height) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glViewportIndexedf) {
+        return;
+    }
+    hooks.__glViewportIndexedf(index, x, y, width, height);
+    if (index == 0) {
+        gl_state_invalidate();
+    }
+}
+
+__PUBLIC void glViewportIndexedfv(GLuint index, const GLfloat* v) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glViewportIndexedfv) {
+        return;
+    }
+    hooks.__glViewportIndexedfv(index, v);
+    if (index == 0) {
+        gl_state_invalidate();
+    }
+}
+
+__PUBLIC void glViewportArrayv(GLuint first, GLsizei count,
+                               const GLfloat* v) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glViewportArrayv) {
+        return;
+    }
+    hooks.__glViewportArrayv(first, count, v);
+    if (first == 0 && count > 0) {
+        gl_state_invalidate();
+    }
 }
 
+// The rest of the state the shadow copy in gl_state.h follows
+__PUBLIC void glBindBuffer(GLenum target, GLuint buffer) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindBuffer) {
+        return;
+    }
+    hooks.__glBindBuffer(target, buffer);
+    gl_state_on_bind_buffer(target, buffer);
+}
+
+__PUBLIC void glPixelStorei(GLenum pname, GLint param) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glPixelStorei) {
+        return;
+    }
+    hooks.__glPixelStorei(pname, param);
+    gl_state_on_pixel_store(pname, param);
+}
+
+__PUBLIC void glPixelStoref(GLenum pname, GLfloat param) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glPixelStoref) {
+        return;
+    }
+    hooks.__glPixelStoref(pname, param);
+    gl_state_on_pixel_store(pname, (GLint) param);
+}
+
+__PUBLIC void glActiveTexture(GLenum texture) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glActiveTexture) {
+        return;
+    }
+    hooks.__glActiveTexture(texture);
+    gl_state_on_active_texture(texture);
+}
+
+__PUBLIC void glBindTexture(GLenum target, GLuint texture) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindTexture) {
+        return;
+    }
+    hooks.__glBindTexture(target, texture);
+    gl_state_on_bind_texture(target, texture);
+}
+
+__PUBLIC void glBindTextureUnit(GLuint unit, GLuint texture) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindTextureUnit) {
+        return;
+    }
+    hooks.__glBindTextureUnit(unit, texture);
+    gl_state_on_bind_texture_unit(unit, texture);
+}
+
+__PUBLIC void glBindTextures(GLuint first, GLsizei count,
+                             const GLuint* textures) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindTextures) {
+        return;
+    }
+    hooks.__glBindTextures(first, count, textures);
+    for (GLsizei j = 0; j < count; j++) {
+        gl_state_on_bind_texture_unit(first + j, textures ? textures[j] : 0);
+    }
+}
+
+__PUBLIC void glBindMultiTextureEXT(GLenum texunit, GLenum target,
+                                    GLuint texture) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindMultiTextureEXT) {
+        return;
+    }
+    hooks.__glBindMultiTextureEXT(texunit, target, texture);
+    gl_state_on_bind_multi_texture(texunit, target, texture);
+}
+
+__PUBLIC void glUseProgram(GLuint program) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glUseProgram) {
+        return;
+    }
+    hooks.__glUseProgram(program);
+    gl_state_on_use_program(program);
+}
+
+__PUBLIC void glBindVertexArray(GLuint array) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindVertexArray) {
+        return;
+    }
+    hooks.__glBindVertexArray(array);
+    gl_state_on_bind_vertex_array(array);
+}
+
+// Apple's vertex array objects are named apart from the core ones, the
+// binding is queried again
+__PUBLIC void glBindVertexArrayAPPLE(GLuint array) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindVertexArrayAPPLE) {
+        return;
+    }
+    hooks.__glBindVertexArrayAPPLE(array);
+    gl_state_invalidate();
+}
+
+__PUBLIC void glEnable(GLenum cap) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glEnable) {
+        return;
+    }
+    hooks.__glEnable(cap);
+    gl_state_on_enable(cap, true);
+}
+
+__PUBLIC void glDisable(GLenum cap) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glDisable) {
+        return;
+    }
+    hooks.__glDisable(cap);
+    gl_state_on_enable(cap, false);
+}
+
+// glIsEnabled reports index 0 of indexed capabilities
+__PUBLIC void glEnablei(GLenum target, GLuint index) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glEnablei) {
+        return;
+    }
+    hooks.__glEnablei(target, index);
+    if (index == 0) {
+        gl_state_on_enable(target, true);
+    }
+}
+
+__PUBLIC void glDisablei(GLenum target, GLuint index) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glDisablei) {
+        return;
+    }
+    hooks.__glDisablei(target, index);
+    if (index == 0) {
+        gl_state_on_enable(target, false);
+    }
+}
+
+__PUBLIC void glColorMask(GLboolean red, GLboolean green,
+                          GLboolean blue, GLboolean alpha) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glColorMask) {
+        return;
+    }
+    hooks.__glColorMask(red, green, blue, alpha);
+    gl_state_on_color_mask(red, green, blue, alpha);
+}
+
+__PUBLIC void glColorMaski(GLuint index, GLboolean red, GLboolean green,
+                           GLboolean blue, GLboolean alpha) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glColorMaski) {
+        return;
+    }
+    hooks.__glColorMaski(index, red, green, blue, alpha);
+    if (index == 0) {
+        gl_state_on_color_mask(red, green, blue, alpha);
+    }
+}
+
+__PUBLIC void glPolygonMode(GLenum face, GLenum mode) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glPolygonMode) {
+        return;
+    }
+    hooks.__glPolygonMode(face, mode);
+    gl_state_on_polygon_mode(face, mode);
+}
+
+__PUBLIC void glBindSampler(GLuint unit, GLuint sampler) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindSampler) {
+        return;
+    }
+    hooks.__glBindSampler(unit, sampler);
+    gl_state_on_bind_sampler(unit, sampler);
+}
+
+__PUBLIC void glBindSamplers(GLuint first, GLsizei count,
+                             const GLuint* samplers) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glBindSamplers) {
+        return;
+    }
+    hooks.__glBindSamplers(first, count, samplers);
+    for (GLsizei j = 0; j < count; j++) {
+        gl_state_on_bind_sampler(first + j, samplers ? samplers[j] : 0);
+    }
+}
+
+__PUBLIC void glDeleteFramebuffers(GLsizei n, const GLuint* framebuffers) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glDeleteFramebuffers) {
+        return;
+    }
+    hooks.__glDeleteFramebuffers(n, framebuffers);
+    gl_state_on_delete_framebuffers(n, framebuffers);
+}
+
+__PUBLIC void glDeleteBuffers(GLsizei n, const GLuint* buffers) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glDeleteBuffers) {
+        return;
+    }
+    hooks.__glDeleteBuffers(n, buffers);
+    gl_state_on_delete_buffers(n, buffers);
+}
+
+__PUBLIC void glDeleteTextures(GLsizei n, const GLuint* textures) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glDeleteTextures) {
+        return;
+    }
+    hooks.__glDeleteTextures(n, textures);
+    gl_state_on_delete_textures(n, textures);
+}
+
+__PUBLIC void glDeleteVertexArrays(GLsizei n, const GLuint* arrays) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glDeleteVertexArrays) {
+        return;
+    }
+    hooks.__glDeleteVertexArrays(n, arrays);
+    gl_state_on_delete_vertex_arrays(n, arrays);
+}
+
+__PUBLIC void glDeleteSamplers(GLsizei n, const GLuint* samplers) {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glDeleteSamplers) {
+        return;
+    }
+    hooks.__glDeleteSamplers(n, samplers);
+    gl_state_on_delete_samplers(n, samplers);
+}
+
+__PUBLIC void glPopAttrib() {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glPopAttrib) {
+        return;
+    }
+    hooks.__glPopAttrib();
+    gl_state_invalidate();
+}
+
+__PUBLIC void glPopClientAttrib() {
+    if (!hooks.init_GL) {
+        init_hook_info(false, false, true);
+    }
+    if (!hooks.__glPopClientAttrib) {
+        return;
+    }
+    hooks.__glPopClientAttrib();
+    gl_state_invalidate();
+}
+
+// Every hooked name has a slot of its own in hook_table.h
 void* get_wrapped_func(const char* symbol) {
-    if (!strcmp(symbol, "glXSwapBuffers"))
-        return (void*) &glXSwapBuffers;
-    else if (!strcmp(symbol, "glXGetProcAddressARB"))
-        return (void*) &glXGetProcAddressARB;
-    else if (!strcmp(symbol, "glXMakeCurrent"))
-        return (void*) &glXMakeCurrent;
-    else if (!strcmp(symbol, "glViewport"))
-        return (void*) &glViewport;
-    else if (!strcmp(symbol, "glBindFramebuffer"))
-        return (void*) &glBindFramebuffer;
-    else
-        return NULL;
+    const hook_entry* entry = &(hook_table[hook_table_hash(symbol) &
+                                           (HOOK_TABLE_SIZE - 1)]);
+    if (entry->symbol && !strcmp(entry->symbol, symbol)) {
+        return entry->hook;
+    }
+    return NULL;
 }
 
 __PUBLIC f_glx_ext_func_ptr_t glXGetProcAddressARB(const GLubyte* proc_name) {
     if (!hooks.init_GLX) {
-        init_hook_info(true, true);
+        init_hook_info(true, false, true);
     }
 
-    printf("Calling glXGetProcAddressARB\n");
+    LOG_TRACE("Calling glXGetProcAddressARB for %s", (const char*) proc_name);
 
     void* ret = get_wrapped_func((char*) proc_name);
     if (ret) {
         return ret;
-    } else {
+    } else if (hooks.__glXGetProcAddressARB) {
         return hooks.__glXGetProcAddressARB(proc_name);
     }
+    return NULL;
+}
+
+__PUBLIC f_glx_ext_func_ptr_t glXGetProcAddress(const GLubyte* proc_name) {
+    if (!hooks.init_GLX) {
+        init_hook_info(true, false, true);
+    }
+
+    LOG_TRACE("Calling glXGetProcAddress for %s", (const char*) proc_name);
+
+    void* ret = get_wrapped_func((char*) proc_name);
+    if (ret) {
+        return ret;
+    } else if (hooks.__glXGetProcAddress) {
+        return hooks.__glXGetProcAddress(proc_name);
+    }
+    return NULL;
+}
+
+__PUBLIC __eglMustCastToProperFunctionPointerType eglGetProcAddress(
+    const char* proc_name) {
+    if (!hooks.init_EGL) {
+        init_hook_info(false, true, true);
+    }
+
+    LOG_TRACE("Calling eglGetProcAddress for %s", proc_name);
+
+    void* ret = get_wrapped_func(proc_name);
+    if (ret) {
+        return ret;
+    } else if (hooks.__eglGetProcAddress) {
+        return hooks.__eglGetProcAddress(proc_name);
+    }
+    return NULL;
 }
 
 void* dlsym(void* handle, const char* symbol) {
     if (!hooks.init) {
-        init_hook_info(false, false);
+        init_hook_info(false, false, false);
     }
 
     void* ret = get_wrapped_func(symbol);
@@ -242,7 +1019,7 @@ void* dlsym(void* handle, const char* symbol) {
 
 void* dlvsym(void* handle, const char* symbol, const char* version) {
     if (!hooks.init) {
-        init_hook_info(false, false);
+        init_hook_info(false, false, false);
     }
 
     void* ret = get_wrapped_func(symbol);
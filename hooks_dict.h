@@ -6,6 +6,7 @@
 #include <GL/gl.h>
 #include <GL/glx.h>
 #include <GL/glext.h>
+#include <EGL/egl.h>
 
 typedef void* (*f_dlopen_t)(const char* filename, int flag);
 typedef void* (*f_dlsym_t)(void*, const char*);
@@ -13,29 +14,158 @@ typedef void* (*f_dlvsym_t)(void*, const char*, const char*);
 
 typedef void (*f_glx_swap_buffers_t)(Display* dpy, GLXDrawable drawable);
 typedef void (*f_glx_ext_func_ptr_t)(void);
+typedef f_glx_ext_func_ptr_t(*f_glx_get_proc_address_t)(const GLubyte*);
 typedef Bool(*f_glx_make_current_t)(Display* dpy, GLXDrawable drawable,
                                     GLXContext ctx);
+typedef Bool(*f_glx_make_context_current_t)(Display* dpy, GLXDrawable draw,
+                                            GLXDrawable read,
+                                            GLXContext ctx);
+typedef void (*f_glx_destroy_context_t)(Display* dpy, GLXContext ctx);
+
+typedef EGLBoolean(*f_egl_swap_buffers_t)(EGLDisplay dpy,
+                                          EGLSurface surface);
+typedef EGLBoolean(*f_egl_make_current_t)(EGLDisplay dpy, EGLSurface draw,
+                                          EGLSurface read, EGLContext ctx);
+typedef EGLBoolean(*f_egl_destroy_context_t)(EGLDisplay dpy,
+                                             EGLContext ctx);
+typedef __eglMustCastToProperFunctionPointerType
+(*f_egl_get_proc_address_t)(const char* procname);
+typedef EGLBoolean(*f_egl_query_surface_t)(EGLDisplay dpy,
+                                           EGLSurface surface,
+                                           EGLint attribute, EGLint* value);
+typedef EGLBoolean(*f_egl_query_context_t)(EGLDisplay dpy, EGLContext ctx,
+                                           EGLint attribute, EGLint* value);
 
 typedef void (*f_gl_viewport_t)(GLint x, GLint y, GLsizei width,
                                 GLsizei height);
 typedef void (*f_gl_bind_framebuffer_t)(GLenum target, GLuint framebuffer);
 typedef void (*f_gl_draw_arrays_t)(GLenum mode, GLint first, GLsizei count);
+typedef void (*f_gl_bind_buffer_t)(GLenum target, GLuint buffer);
+typedef void (*f_gl_pixel_storei_t)(GLenum pname, GLint param);
+typedef void (*f_gl_pixel_storef_t)(GLenum pname, GLfloat param);
+typedef void (*f_gl_active_texture_t)(GLenum texture);
+typedef void (*f_gl_bind_texture_t)(GLenum target, GLuint texture);
+typedef void (*f_gl_bind_texture_unit_t)(GLuint unit, GLuint texture);
+typedef void (*f_gl_bind_textures_t)(GLuint first, GLsizei count,
+                                     const GLuint* textures);
+typedef void (*f_gl_use_program_t)(GLuint program);
+typedef void (*f_gl_bind_vertex_array_t)(GLuint array);
+typedef void (*f_gl_enable_t)(GLenum cap);
+typedef void (*f_gl_enablei_t)(GLenum target, GLuint index);
+typedef void (*f_gl_color_mask_t)(GLboolean red, GLboolean green,
+                                  GLboolean blue, GLboolean alpha);
+typedef void (*f_gl_color_maski_t)(GLuint index, GLboolean red,
+                                   GLboolean green, GLboolean blue,
+                                   GLboolean alpha);
+typedef void (*f_gl_bind_multi_texture_t)(GLenum texunit, GLenum target,
+                                          GLuint texture);
+typedef void (*f_gl_viewport_indexedf_t)(GLuint index, GLfloat x,
+                                         GLfloat y, GLfloat width,
+                                         GLfloat height);
+typedef void (*f_gl_viewport_indexedfv_t)(GLuint index, const GLfloat* v);
+typedef void (*f_gl_viewport_arrayv_t)(GLuint first, GLsizei count,
+                                       const GLfloat* v);
+typedef void (*f_gl_polygon_mode_t)(GLenum face, GLenum mode);
+typedef void (*f_gl_bind_sampler_t)(GLuint unit, GLuint sampler);
+typedef void (*f_gl_bind_samplers_t)(GLuint first, GLsizei count,
+                                     const GLuint* samplers);
+typedef void (*f_gl_delete_t)(GLsizei n, const GLuint* names);
+typedef void (*f_gl_pop_attrib_t)(void);
+
+// X(symbol, type) for every entry point hooks.so replaces. HOOKS gets a
+// __<symbol> field holding the real one and get_wrapped_func() hands out
+// ours. The lookup table in hook_table.h is generated from these lists by
+// tools/gen_hook_table.py, which make reruns when they change.
+
+// Resolved with dlsym from libGL
+#define GLX_HOOKS(X) \
+    X(glXSwapBuffers, f_glx_swap_buffers_t) \
+    X(glXGetProcAddressARB, f_glx_get_proc_address_t) \
+    X(glXGetProcAddress, f_glx_get_proc_address_t) \
+    X(glXMakeCurrent, f_glx_make_current_t) \
+    X(glXMakeContextCurrent, f_glx_make_context_current_t) \
+    X(glXDestroyContext, f_glx_destroy_context_t)
+
+// Resolved with dlsym from libEGL
+#define EGL_HOOKS(X) \
+    X(eglSwapBuffers, f_egl_swap_buffers_t) \
+    X(eglMakeCurrent, f_egl_make_current_t) \
+    X(eglDestroyContext, f_egl_destroy_context_t) \
+    X(eglGetProcAddress, f_egl_get_proc_address_t)
+
+// Resolved with dlsym, or glXGetProcAddressARB/eglGetProcAddress past
+// GL 1.x
+#define GL_HOOKS(X) \
+    X(glViewport, f_gl_viewport_t) \
+    X(glBindFramebuffer, f_gl_bind_framebuffer_t) \
+    X(glBindFramebufferEXT, f_gl_bind_framebuffer_t) \
+    X(glViewportIndexedf, f_gl_viewport_indexedf_t) \
+    X(glViewportIndexedfv, f_gl_viewport_indexedfv_t) \
+    X(glViewportArrayv, f_gl_viewport_arrayv_t) \
+    X(glBindBuffer, f_gl_bind_buffer_t) \
+    X(glPixelStorei, f_gl_pixel_storei_t) \
+    X(glPixelStoref, f_gl_pixel_storef_t) \
+    X(glActiveTexture, f_gl_active_texture_t) \
+    X(glBindTexture, f_gl_bind_texture_t) \
+    X(glBindTextureUnit, f_gl_bind_texture_unit_t) \
+    X(glBindTextures, f_gl_bind_textures_t) \
+    X(glBindMultiTextureEXT, f_gl_bind_multi_texture_t) \
+    X(glUseProgram, f_gl_use_program_t) \
+    X(glBindVertexArray, f_gl_bind_vertex_array_t) \
+    X(glBindVertexArrayAPPLE, f_gl_bind_vertex_array_t) \
+    X(glEnable, f_gl_enable_t) \
+    X(glDisable, f_gl_enable_t) \
+    X(glEnablei, f_gl_enablei_t) \
+    X(glDisablei, f_gl_enablei_t) \
+    X(glColorMask, f_gl_color_mask_t) \
+    X(glColorMaski, f_gl_color_maski_t) \
+    X(glPolygonMode, f_gl_polygon_mode_t) \
+    X(glBindSampler, f_gl_bind_sampler_t) \
+    X(glBindSamplers, f_gl_bind_samplers_t) \
+    X(glDeleteFramebuffers, f_gl_delete_t) \
+    X(glDeleteBuffers, f_gl_delete_t) \
+    X(glDeleteTextures, f_gl_delete_t) \
+    X(glDeleteVertexArrays, f_gl_delete_t) \
+    X(glDeleteSamplers, f_gl_delete_t) \
+    X(glPopAttrib, f_gl_pop_attrib_t) \
+    X(glPopClientAttrib, f_gl_pop_attrib_t)
+
+// X(alias, symbol): other names applications look the same hook up by.
+// Only for entry points that behave exactly like the core one,
+// glBindFramebufferEXT for instance takes names that were never generated
+// and is hooked on its own.
+#define HOOK_ALIASES(X) \
+    X(glBindBufferARB, glBindBuffer) \
+    X(glActiveTextureARB, glActiveTexture) \
+    X(glDeleteBuffersARB, glDeleteBuffers) \
+    X(glBindTextureEXT, glBindTexture) \
+    X(glDeleteTexturesEXT, glDeleteTextures) \
+    X(glDeleteFramebuffersEXT, glDeleteFramebuffers) \
+    X(glUseProgramObjectARB, glUseProgram) \
+    X(glEnableIndexedEXT, glEnablei) \
+    X(glDisableIndexedEXT, glDisablei) \
+    X(glColorMaskIndexedEXT, glColorMaski)
 
 typedef struct {
     bool init;
     bool init_GLX;
+    bool init_EGL;
     bool init_GL;
 
     f_dlopen_t f_dlopen;
     f_dlsym_t f_dlsym;
     f_dlvsym_t f_dlvsym;
 
+    bool tried_libGL;
     void* libGL_handle;
+    void* libEGL_handle;
+    // Used but not hooked
+    f_egl_query_surface_t f_egl_query_surface;
+    f_egl_query_context_t f_egl_query_context;
 
-    f_glx_swap_buffers_t __glXSwapBuffers;
-    f_glx_ext_func_ptr_t(*__glXGetProcAddressARB)(const GLubyte*);
-    f_glx_make_current_t __glXMakeCurrent;
-
-    f_gl_viewport_t __glViewport;
-    f_gl_bind_framebuffer_t __glBindFramebuffer;
+#define HOOK_FIELD(symbol, type) type __##symbol;
+    GLX_HOOKS(HOOK_FIELD)
+    EGL_HOOKS(HOOK_FIELD)
+    GL_HOOKS(HOOK_FIELD)
+#undef HOOK_FIELD
 } HOOKS;
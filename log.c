@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+
+typedef struct {
+    log_level level;
+    char message[LOG_MESSAGE_SIZE];
+} log_entry;
+
+// A ring stays on the list for good. When its thread exits it is drained
+// one last time and then handed to the next new thread, so threads that
+// come and go don't grow the list.
+typedef enum {
+    RING_OWNED = 0,
+    RING_EXITED = 1,
+    RING_FREE = 2
+} ring_state;
+
+// Single-producer/single-consumer ring owned by one logging thread. Only
+// the owner advances head and only the drain side advances tail, so
+// writing a message never takes a lock.
+typedef struct log_ring {
+    struct log_ring* next;
+    _Atomic ring_state state;
+    pid_t tid;
+    _Atomic unsigned int head;
+    _Atomic unsigned int tail;
+    _Atomic unsigned int dropped;
+    log_entry entries[LOG_RING_SIZE];
+} log_ring;
+
+log_level log_runtime_level = LOG_LEVEL_WARN;
+
+static _Atomic(log_ring*) rings = NULL;
+static __thread log_ring* thread_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t drain_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* level_names[] = {
+    "trace", "debug", "info", "warn", "error", "off"
+};
+
+__attribute__((constructor))
+static void read_log_level() {
+    const char* value = getenv("DEPTH_UPSAMPLE_LOG_LEVEL");
+    if (!value) {
+        return;
+    }
+    for (int j = LOG_LEVEL_TRACE; j <= LOG_LEVEL_OFF; j++) {
+        if (strcmp(value, level_names[j]) == 0) {
+            log_runtime_level = (log_level) j;
+            return;
+        }
+    }
+}
+
+static void drain_ring(log_ring* ring) {
+    unsigned int head = atomic_load_explicit(&(ring->head),
+                                             memory_order_acquire);
+    unsigned int tail = atomic_load_explicit(&(ring->tail),
+                                             memory_order_relaxed);
+    for (; tail != head; tail++) {
+        log_entry* entry = &(ring->entries[tail % LOG_RING_SIZE]);
+        fprintf(stderr, "[hooks.so %s %d] %s\n", level_names[entry->level],
+                ring->tid, entry->message);
+    }
+    atomic_store_explicit(&(ring->tail), tail, memory_order_release);
+
+    unsigned int dropped = atomic_exchange(&(ring->dropped), 0);
+    if (dropped) {
+        fprintf(stderr, "[hooks.so warn %d] %u log messages dropped\n",
+                ring->tid, dropped);
+    }
+}
+
+void log_flush() {
+    pthread_mutex_lock(&drain_lock);
+    for (log_ring* ring = atomic_load(&rings); ring; ring = ring->next) {
+        // Read before draining, so everything the thread wrote before it
+        // exited is printed before the ring is reused
+        const ring_state state = atomic_load(&(ring->state));
+        drain_ring(ring);
+        if (state == RING_EXITED) {
+            atomic_store(&(ring->state), RING_FREE);
+        }
+    }
+    fflush(stderr);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void* drain_thread(void* unused) {
+    const struct timespec period = { 0, 10 * 1000 * 1000 };
+    while (true) {
+        log_flush();
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+static void release_thread_ring(void* ring) {
+    thread_ring = NULL;
+    atomic_store(&(((log_ring*) ring)->state), RING_EXITED);
+}
+
+static void start_drain_thread() {
+    pthread_key_create(&ring_key, release_thread_ring);
+    pthread_t thread;
+    pthread_create(&thread, NULL, drain_thread, NULL);
+    pthread_detach(thread);
+    atexit(log_flush);
+}
+
+// Takes a ring a thread that exited left behind, or returns NULL
+static log_ring* reuse_ring() {
+    for (log_ring* ring = atomic_load(&rings); ring; ring = ring->next) {
+        ring_state state = RING_FREE;
+        if (atomic_compare_exchange_strong(&(ring->state), &state,
+                                           RING_OWNED)) {
+            return ring;
+        }
+    }
+    return NULL;
+}
+
+static log_ring* get_thread_ring() {
+    if (!thread_ring) {
+        pthread_once(&drain_once, start_drain_thread);
+
+        log_ring* ring = reuse_ring();
+        if (!ring) {
+            ring = (log_ring*) calloc(1, sizeof(log_ring));
+            log_ring* head = atomic_load(&rings);
+            do {
+                ring->next = head;
+            } while (!atomic_compare_exchange_weak(&rings, &head, ring));
+        }
+        ring->tid = (pid_t) syscall(SYS_gettid);
+        thread_ring = ring;
+        // The destructor hands the ring back when this thread exits
+        pthread_setspecific(ring_key, ring);
+    }
+    return thread_ring;
+}
+
+void log_write(const log_level level, const char* format, ...) {
+    log_ring* ring = get_thread_ring();
+    unsigned int head = atomic_load_explicit(&(ring->head),
+                                             memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&(ring->tail),
+                                             memory_order_acquire);
+    if (head - tail >= LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&(ring->dropped), 1, memory_order_relaxed);
+        return;
+    }
+
+    log_entry* entry = &(ring->entries[head % LOG_RING_SIZE]);
+    entry->level = level;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(entry->message, LOG_MESSAGE_SIZE, format, args);
+    va_end(args);
+    atomic_store_explicit(&(ring->head), head + 1, memory_order_release);
+}
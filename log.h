@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+
+typedef enum {
+    LOG_LEVEL_TRACE = 0,
+    LOG_LEVEL_DEBUG = 1,
+    LOG_LEVEL_INFO = 2,
+    LOG_LEVEL_WARN = 3,
+    LOG_LEVEL_ERROR = 4,
+    LOG_LEVEL_OFF = 5
+} log_level;
+
+// Messages below LOG_COMPILE_LEVEL are compiled out entirely. The run-time
+// level comes from DEPTH_UPSAMPLE_LOG_LEVEL (trace, debug, info, warn,
+// error or off) and defaults to warn, so the per-call messages in the GL
+// hooks cost a single predictable branch.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_RING_SIZE 256
+#define LOG_MESSAGE_SIZE 240
+
+extern log_level log_runtime_level;
+
+#define LOG_AT(level, ...)                                               \
+    do {                                                                 \
+        if ((level) >= LOG_COMPILE_LEVEL &&                              \
+                __builtin_expect((level) >= log_runtime_level, 0)) {     \
+            log_write((level), __VA_ARGS__);                             \
+        }                                                                \
+    } while (0)
+
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+void log_write(const log_level level, const char* format, ...)
+__attribute__((format(printf, 2, 3)));
+void log_flush();
@@ -0,0 +1,373 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "miniz.h"
+#include "png_encode.h"
+#include "byte_swap.h"
+#include "config.h"
+#include "log.h"
+
+#define PNG_DEFAULT_THREADS 4
+#define PNG_MAX_THREADS 64
+#define PNG_DEFAULT_STRIP_ROWS 64
+
+typedef struct {
+    const unsigned char* image;
+    int width;
+    int height;
+    int bit_depth;
+    size_t pixel_size;
+    size_t row_size;
+    const png_options* options;
+    int remaining;
+} png_task;
+
+typedef struct png_strip {
+    struct png_strip* next;
+    png_task* task;
+    int first_row;
+    int last_row;
+    bool last;
+    unsigned char* data;
+    size_t length;
+    mz_ulong adler;
+    size_t raw_length;
+} png_strip;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t strip_done = PTHREAD_COND_INITIALIZER;
+static png_strip* queue_head = NULL;
+static png_strip* queue_tail = NULL;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void load_row(unsigned char* dst,
+                     const png_task* task,
+                     const int row) {
+    const unsigned char* src = task->image + (size_t) row * task->row_size;
+    if (task->bit_depth == 16) {
+        swap_bytes16(dst, src, task->row_size / 2);
+    } else {
+        memcpy(dst, src, task->row_size);
+    }
+}
+
+static unsigned char paeth(const int a, const int b, const int c) {
+    const int p = a + b - c;
+    const int pa = abs(p - a);
+    const int pb = abs(p - b);
+    const int pc = abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+static void filter_row(unsigned char* out,
+                       const unsigned char* cur,
+                       const unsigned char* prev,
+                       const size_t row_size,
+                       const size_t bpp,
+                       const png_filter filter) {
+    out[0] = filter;
+    out++;
+    switch (filter) {
+        case PNG_FILTER_NONE:
+            memcpy(out, cur, row_size);
+            break;
+        case PNG_FILTER_SUB:
+            for (size_t j = 0; j < row_size; j++) {
+                out[j] = cur[j] - (j >= bpp ? cur[j - bpp] : 0);
+            }
+            break;
+        case PNG_FILTER_UP:
+            for (size_t j = 0; j < row_size; j++) {
+                out[j] = cur[j] - prev[j];
+            }
+            break;
+        case PNG_FILTER_AVERAGE:
+            for (size_t j = 0; j < row_size; j++) {
+                const int left = j >= bpp ? cur[j - bpp] : 0;
+                out[j] = cur[j] - ((left + prev[j]) >> 1);
+            }
+            break;
+        case PNG_FILTER_PAETH:
+            for (size_t j = 0; j < row_size; j++) {
+                const int left = j >= bpp ? cur[j - bpp] : 0;
+                const int up_left = j >= bpp ? prev[j - bpp] : 0;
+                out[j] = cur[j] - paeth(left, prev[j], up_left);
+            }
+            break;
+    }
+}
+
+static void encode_strip(png_strip* strip) {
+    const png_task* task = strip->task;
+    const size_t row_size = task->row_size;
+    const int rows = strip->last_row - strip->first_row;
+
+    strip->raw_length = rows * (row_size + 1);
+    unsigned char* filtered = (unsigned char*) malloc(strip->raw_length);
+    unsigned char* rows_buffer = (unsigned char*) malloc(2 * row_size);
+    unsigned char* cur = rows_buffer;
+    unsigned char* prev = rows_buffer + row_size;
+
+    // The first row of a strip still filters against the row above it
+    if (strip->first_row > 0) {
+        load_row(prev, task, strip->first_row - 1);
+    } else {
+        memset(prev, 0, row_size);
+    }
+    for (int row = strip->first_row; row < strip->last_row; row++) {
+        load_row(cur, task, row);
+        filter_row(filtered + (row - strip->first_row) * (row_size + 1),
+                   cur, prev, row_size, task->pixel_size,
+                   task->options->filter);
+        unsigned char* tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+    free(rows_buffer);
+
+    strip->adler = mz_adler32(MZ_ADLER32_INIT, filtered, strip->raw_length);
+
+    mz_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    mz_deflateInit2(&stream, task->options->level, MZ_DEFLATED,
+                    -MZ_DEFAULT_WINDOW_BITS, 9, MZ_DEFAULT_STRATEGY);
+    // The sync flush marker adds an empty stored block on top of the bound
+    const size_t capacity = mz_deflateBound(&stream, strip->raw_length) + 16;
+    strip->data = (unsigned char*) malloc(capacity);
+    stream.next_in = filtered;
+    stream.avail_in = strip->raw_length;
+    stream.next_out = strip->data;
+    stream.avail_out = capacity;
+    int status = mz_deflate(&stream, strip->last ? MZ_FINISH : MZ_SYNC_FLUSH);
+    if (status != MZ_OK && status != MZ_STREAM_END) {
+        LOG_ERROR("Deflating rows %i-%i failed (%i)", strip->first_row,
+                  strip->last_row, status);
+    }
+    strip->length = stream.total_out;
+    mz_deflateEnd(&stream);
+    free(filtered);
+}
+
+static void finish_strip(png_strip* strip) {
+    if (--(strip->task->remaining) == 0) {
+        pthread_cond_broadcast(&strip_done);
+    }
+}
+
+static png_strip* pop_strip() {
+    png_strip* strip = queue_head;
+    queue_head = strip->next;
+    if (!queue_head) {
+        queue_tail = NULL;
+    }
+    return strip;
+}
+
+static void* png_worker_thread(void* unused) {
+    pthread_mutex_lock(&queue_lock);
+    while (true) {
+        while (!queue_head) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        png_strip* strip = pop_strip();
+        pthread_mutex_unlock(&queue_lock);
+        encode_strip(strip);
+        pthread_mutex_lock(&queue_lock);
+        finish_strip(strip);
+    }
+    return NULL;
+}
+
+static void start_workers() {
+    int threads = config_get_int("DEPTH_UPSAMPLE_PNG_THREADS",
+                                 PNG_DEFAULT_THREADS);
+    if (threads > PNG_MAX_THREADS) {
+        threads = PNG_MAX_THREADS;
+    }
+    for (int j = 0; j < threads; j++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, png_worker_thread, NULL);
+        pthread_detach(thread);
+    }
+}
+
+void png_encoder_init() {
+    pthread_once(&init_once, start_workers);
+}
+
+void png_default_options(png_options* options) {
+    options->level = config_get_int("DEPTH_UPSAMPLE_PNG_LEVEL",
+                                    MZ_DEFAULT_LEVEL);
+    options->strip_rows = config_get_int("DEPTH_UPSAMPLE_PNG_STRIP_ROWS",
+                                         PNG_DEFAULT_STRIP_ROWS);
+
+    const char* filter = config_get_str("DEPTH_UPSAMPLE_PNG_FILTER", "none");
+    static const char* filter_names[] = {
+        "none", "sub", "up", "average", "paeth"
+    };
+    options->filter = PNG_FILTER_NONE;
+    for (int j = PNG_FILTER_NONE; j <= PNG_FILTER_PAETH; j++) {
+        if (strcmp(filter, filter_names[j]) == 0) {
+            options->filter = (png_filter) j;
+        }
+    }
+}
+
+// Same as zlib's adler32_combine()
+static mz_ulong combine_adler32(const mz_ulong adler1,
+                                const mz_ulong adler2,
+                                const size_t length2) {
+    const unsigned long base = 65521;
+    const unsigned long rem = length2 % base;
+    unsigned long sum1 = adler1 & 0xffff;
+    unsigned long sum2 = (rem * sum1) % base;
+    sum1 += (adler2 & 0xffff) + base - 1;
+    sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + base - rem;
+    if (sum1 >= base) {
+        sum1 -= base;
+    }
+    if (sum1 >= base) {
+        sum1 -= base;
+    }
+    if (sum2 >= (base << 1)) {
+        sum2 -= (base << 1);
+    }
+    if (sum2 >= base) {
+        sum2 -= base;
+    }
+    return sum1 | (sum2 << 16);
+}
+
+static unsigned char* put_u32(unsigned char* out, const mz_uint32 value) {
+    out[0] = (unsigned char)(value >> 24);
+    out[1] = (unsigned char)(value >> 16);
+    out[2] = (unsigned char)(value >> 8);
+    out[3] = (unsigned char) value;
+    return out + 4;
+}
+
+// Writes the chunk length and type, leaving the payload to the caller
+static unsigned char* begin_chunk(unsigned char* out,
+                                  const char* type,
+                                  const mz_uint32 length) {
+    out = put_u32(out, length);
+    memcpy(out, type, 4);
+    return out + 4;
+}
+
+static unsigned char* end_chunk(unsigned char* out,
+                                const unsigned char* chunk_type) {
+    mz_ulong crc = mz_crc32(MZ_CRC32_INIT, chunk_type, out - chunk_type);
+    return put_u32(out, (mz_uint32) crc);
+}
+
+void* png_encode(const unsigned char* image,
+                 const int width,
+                 const int height,
+                 const int channels,
+                 const int bit_depth,
+                 const png_options* options,
+                 size_t* out_length) {
+    static const unsigned char color_types[] = { 0, 0, 4, 2, 6 };
+    static const unsigned char signature[] = {
+        0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+    };
+
+    png_task task;
+    task.image = image;
+    task.width = width;
+    task.height = height;
+    task.bit_depth = bit_depth;
+    task.pixel_size = channels * bit_depth / 8;
+    task.row_size = task.pixel_size * width;
+    task.options = options;
+
+    const int strip_rows = options->strip_rows > 0 ? options->strip_rows :
+                           PNG_DEFAULT_STRIP_ROWS;
+    const int num_strips = height > 0 ? (height + strip_rows - 1) / strip_rows :
+                           1;
+    png_strip* strips = (png_strip*) calloc(num_strips, sizeof(png_strip));
+    for (int j = 0; j < num_strips; j++) {
+        strips[j].task = &task;
+        strips[j].first_row = j * strip_rows;
+        strips[j].last_row = j == num_strips - 1 ? height :
+                             (j + 1) * strip_rows;
+        strips[j].last = j == num_strips - 1;
+    }
+
+    pthread_mutex_lock(&queue_lock);
+    task.remaining = num_strips;
+    for (int j = 0; j < num_strips; j++) {
+        if (queue_tail) {
+            queue_tail->next = &(strips[j]);
+        } else {
+            queue_head = &(strips[j]);
+        }
+        queue_tail = &(strips[j]);
+    }
+    pthread_cond_broadcast(&queue_ready);
+
+    // Help out instead of sleeping, the queue may hold other frames' strips
+    while (task.remaining > 0) {
+        if (queue_head) {
+            png_strip* strip = pop_strip();
+            pthread_mutex_unlock(&queue_lock);
+            encode_strip(strip);
+            pthread_mutex_lock(&queue_lock);
+            finish_strip(strip);
+        } else {
+            pthread_cond_wait(&strip_done, &queue_lock);
+        }
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    size_t idat_length = 2 + 4;
+    mz_ulong adler = MZ_ADLER32_INIT;
+    for (int j = 0; j < num_strips; j++) {
+        idat_length += strips[j].length;
+        adler = combine_adler32(adler, strips[j].adler, strips[j].raw_length);
+    }
+
+    *out_length = sizeof(signature) + (12 + 13) + (12 + idat_length) + 12;
+    unsigned char* png = (unsigned char*) malloc(*out_length);
+    unsigned char* out = png;
+    memcpy(out, signature, sizeof(signature));
+    out += sizeof(signature);
+
+    unsigned char* chunk = out + 4;
+    out = begin_chunk(out, "IHDR", 13);
+    out = put_u32(out, width);
+    out = put_u32(out, height);
+    *out++ = bit_depth;
+    *out++ = color_types[channels];
+    *out++ = 0;
+    *out++ = 0;
+    *out++ = 0;
+    out = end_chunk(out, chunk);
+
+    chunk = out + 4;
+    out = begin_chunk(out, "IDAT", idat_length);
+    // zlib header with FLEVEL matching the compression level
+    *out++ = 0x78;
+    *out++ = options->level <= 1 ? 0x01 : options->level < 6 ? 0x5e :
+             options->level == 6 ? 0x9c : 0xda;
+    for (int j = 0; j < num_strips; j++) {
+        memcpy(out, strips[j].data, strips[j].length);
+        out += strips[j].length;
+        free(strips[j].data);
+    }
+    out = put_u32(out, (mz_uint32) adler);
+    out = end_chunk(out, chunk);
+
+    chunk = out + 4;
+    out = begin_chunk(out, "IEND", 0);
+    out = end_chunk(out, chunk);
+
+    free(strips);
+    return png;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    PNG_FILTER_NONE = 0,
+    PNG_FILTER_SUB = 1,
+    PNG_FILTER_UP = 2,
+    PNG_FILTER_AVERAGE = 3,
+    PNG_FILTER_PAETH = 4
+} png_filter;
+
+typedef struct {
+    int level;
+    png_filter filter;
+    int strip_rows;
+} png_options;
+
+// Splits the image into row strips and deflates each one as an independent
+// raw deflate stream ended with a sync flush, the way pigz does. The
+// streams are byte aligned, so concatenating them under one zlib header,
+// with the combined adler32 behind them, yields a single valid IDAT.
+//
+// Strips are run by a shared pool of DEPTH_UPSAMPLE_PNG_THREADS workers,
+// and the calling thread works through the queue as well. The level,
+// filter and strip height come from DEPTH_UPSAMPLE_PNG_LEVEL,
+// DEPTH_UPSAMPLE_PNG_FILTER (none, sub, up, average or paeth) and
+// DEPTH_UPSAMPLE_PNG_STRIP_ROWS.
+//
+// 16-bit samples are taken in host (little endian) order and written big
+// endian as PNG requires. The returned buffer is freed with free().
+void png_encoder_init();
+void png_default_options(png_options* options);
+void* png_encode(const unsigned char* image,
+                 const int width,
+                 const int height,
+                 const int channels,
+                 const int bit_depth,
+                 const png_options* options,
+                 size_t* out_length);
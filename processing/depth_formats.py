@@ -0,0 +1,47 @@
+#!/usr/bin/env python3
+
+import struct
+import zlib
+
+import cv2
+import numpy as np
+
+# Magic, version, width, height (see depth_encode.h)
+HEADER = struct.Struct('<4sIII')
+DEPTH_SUFFIXES = ('_depth.pgm', '_depth.png', '_depth.raw', '_depth.dpd')
+
+
+def parse_header(buf, magic):
+    found, version, width, height = HEADER.unpack_from(buf)
+    if found != magic:
+        raise ValueError('Expected {} header, found {}'.format(magic, found))
+    return width, height
+
+
+def decode_raw(buf):
+    width, height = parse_header(buf, b'DUPR')
+    return np.frombuffer(buf, dtype='<u2', count=width * height,
+                         offset=HEADER.size).reshape(height, width)
+
+
+def decode_delta(buf):
+    width, height = parse_header(buf, b'DUPD')
+    planes = np.frombuffer(zlib.decompress(buf[HEADER.size:]), dtype=np.uint8)
+    zigzag = (planes[:width * height].astype(np.uint16) << 8) | \
+        planes[width * height:].astype(np.uint16)
+    residuals = (zigzag >> 1) ^ (-(zigzag & 1)).astype(np.uint16)
+    # Undo the left + up - up_left prediction with a 2D prefix sum,
+    # wrapping at 16 bits just like the encoder
+    residuals = residuals.reshape(height, width)
+    return np.cumsum(np.cumsum(residuals, axis=0, dtype=np.uint16),
+                     axis=1, dtype=np.uint16)
+
+
+def read_depth(path):
+    """Returns the raw uint16 depth samples in the order hooks.so wrote them,
+    whatever DEPTH_UPSAMPLE_DEPTH_FORMAT the capture used."""
+    if path.endswith('.raw') or path.endswith('.dpd'):
+        with open(path, 'rb') as f:
+            buf = f.read()
+        return decode_raw(buf) if path.endswith('.raw') else decode_delta(buf)
+    return cv2.imread(path, cv2.IMREAD_UNCHANGED)
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+
+import struct
+from sys import argv
+
+import cv2
+import numpy as np
+
+from depth_formats import decode_delta, decode_raw
+
+# Layouts from frame_archive.h
+RECORD = struct.Struct('<4sIIIQIIQQQQ')
+FOOTER = struct.Struct('<4sIQQQ')
+ALIGNMENT = 4096
+
+COLOR_RGB8 = 0
+COLOR_PNG = 1
+
+DEPTH_PGM = 0
+DEPTH_RAW = 1
+DEPTH_PNG16 = 2
+DEPTH_DELTA = 3
+
+
+def align(offset):
+    return (offset + ALIGNMENT - 1) // ALIGNMENT * ALIGNMENT
+
+
+class Frame(object):
+    def __init__(self, archive, fields):
+        (_, self.ID, self.width, self.height, self.timestamp,
+         self.color_format, self.depth_format,
+         self.color_offset, self.color_size,
+         self.depth_offset, self.depth_size) = fields
+        self._data = archive.data
+
+    def color_bytes(self):
+        return self._data[self.color_offset:
+                          self.color_offset + self.color_size]
+
+    def depth_bytes(self):
+        return self._data[self.depth_offset:
+                          self.depth_offset + self.depth_size]
+
+    def color(self):
+        """(height, width, 3) uint8 RGB, bottom row first like the
+        framebuffer. Raw frames are a view into the mapped file."""
+        if self.color_format == COLOR_RGB8:
+            return self.color_bytes().reshape(self.height, self.width, 3)
+        return cv2.cvtColor(cv2.imdecode(self.color_bytes(), cv2.IMREAD_COLOR),
+                            cv2.COLOR_BGR2RGB)
+
+    def depth(self):
+        """(height, width) uint16 depth. Raw frames are a view into the
+        mapped file."""
+        if self.depth_format == DEPTH_RAW:
+            return decode_raw(self.depth_bytes())
+        elif self.depth_format == DEPTH_DELTA:
+            return decode_delta(self.depth_bytes().tobytes())
+        return cv2.imdecode(self.depth_bytes(), cv2.IMREAD_UNCHANGED)
+
+
+class FrameArchive(object):
+    """Random access to the frames of a frames.dua archive written by
+    hooks.so with DEPTH_UPSAMPLE_OUTPUT=archive. The file is memory mapped
+    and raw chunks are returned without copying. Archives whose index was
+    never written (the game crashed or was killed) are recovered by walking
+    the records, the same way frame_archive_recover() does."""
+
+    def __init__(self, path):
+        self.data = np.memmap(path, dtype=np.uint8, mode='r')
+        if self.data[:4].tobytes() != b'DUPA':
+            raise ValueError('{} is not a frame archive'.format(path))
+        self.frames = self._read_index()
+        if self.frames is None:
+            self.frames = self._recover()
+        self._by_id = {frame.ID: frame for frame in self.frames}
+
+    def _read_index(self):
+        if len(self.data) < ALIGNMENT + FOOTER.size:
+            return None
+        magic, _, count, index_offset, _ = FOOTER.unpack(
+            self.data[-FOOTER.size:].tobytes())
+        if magic != b'DUPI' or \
+                index_offset + count * RECORD.size + FOOTER.size != \
+                len(self.data):
+            return None
+        index = self.data[index_offset:index_offset + count * RECORD.size]
+        return [Frame(self, RECORD.unpack_from(index, j * RECORD.size))
+                for j in range(count)]
+
+    def _recover(self):
+        frames = []
+        offset = ALIGNMENT
+        while offset + RECORD.size <= len(self.data):
+            fields = RECORD.unpack(
+                self.data[offset:offset + RECORD.size].tobytes())
+            frame = Frame(self, fields)
+            if fields[0] != b'DUPF' or \
+                    frame.color_offset != offset + ALIGNMENT or \
+                    frame.depth_offset != \
+                    align(frame.color_offset + frame.color_size) or \
+                    frame.depth_offset + frame.depth_size > len(self.data):
+                break
+            frames.append(frame)
+            offset = align(frame.depth_offset + frame.depth_size)
+        return frames
+
+    def __len__(self):
+        return len(self.frames)
+
+    def __getitem__(self, j):
+        return self.frames[j]
+
+    def ids(self):
+        return [frame.ID for frame in self.frames]
+
+    def frame(self, ID):
+        return self._by_id[ID]
+
+
+if __name__ == '__main__':
+    assert len(argv) == 2
+    archive = FrameArchive(argv[1])
+    for frame in archive:
+        print('{} {}x{} t={} color={} bytes depth={} bytes'.format(
+            frame.ID, frame.width, frame.height, frame.timestamp,
+            frame.color_size, frame.depth_size))
@@ -0,0 +1,150 @@
+#!/usr/bin/env python3
+
+import mmap
+import os
+import struct
+import time
+from sys import argv
+
+import numpy as np
+
+# Layouts from frame_share.h
+HEADER = struct.Struct('<4sIIIQQQQQ')
+SLOT = struct.Struct('<QQQIIIIQQQ')
+SEQUENCE = struct.Struct('<Q')
+CLOSED_OFFSET = 12
+DEFAULT_NAME = '/depth_upsample'
+VERSION = 1
+FRAME_HALF = 1
+
+
+class SharedFrame(object):
+    """One frame of the ring. color and depth are views straight into the
+    shared memory, which the game keeps overwriting: they only hold this
+    frame if valid() is still true after they have been used, or use
+    copy()."""
+
+    def __init__(self, share, offset, fields):
+        (self.sequence, self.ticket, self.timestamp, self.ID, self.width,
+         self.height, flags, color_offset, depth_offset, _) = fields
+        self.half = bool(flags & FRAME_HALF)
+        self._share = share
+        self._offset = offset
+        # (height, width, 3) uint8 RGB and (height, width) uint16, bottom
+        # row first like the framebuffer
+        self.color = np.frombuffer(
+            share.data, dtype=np.uint8, count=self.width * self.height * 3,
+            offset=offset + color_offset).reshape(self.height, self.width, 3)
+        self.depth = np.frombuffer(
+            share.data, dtype=np.uint16, count=self.width * self.height,
+            offset=offset + depth_offset).reshape(self.height, self.width)
+
+    def valid(self):
+        return self._share._sequence(self._offset) == self.sequence
+
+    def copy(self):
+        """(color, depth) copies, or None if the slot was rewritten while
+        copying."""
+        color, depth = self.color.copy(), self.depth.copy()
+        return (color, depth) if self.valid() else None
+
+
+class FrameShare(object):
+    """Reads the frames hooks.so publishes with DEPTH_UPSAMPLE_SHM (or
+    DEPTH_UPSAMPLE_OUTPUT=shm) as they are captured, the same way
+    frame_share_reader.c does. The sequence of a slot is read before and
+    after its fields, an odd or changed sequence means it was being
+    written. Plain loads are enough on x86, whose stores aren't reordered
+    with each other."""
+
+    def __init__(self, name=DEFAULT_NAME):
+        path = os.path.join('/dev/shm', name.lstrip('/'))
+        with open(path, 'rb') as shm:
+            self.data = mmap.mmap(shm.fileno(), 0, access=mmap.ACCESS_READ)
+        (magic, version, self.slot_count, _, self.slot_size,
+         self.slots_offset, _, self.pid, _) = HEADER.unpack_from(self.data)
+        if magic != b'DUPS' or version != VERSION:
+            raise ValueError('{} is not a frame ring'.format(path))
+        self.last_ticket = 0
+        # Frames overwritten or skipped since the first one returned
+        self.missed = 0
+
+    def _sequence(self, offset):
+        return SEQUENCE.unpack_from(self.data, offset)[0]
+
+    def _read_slot(self, j):
+        offset = self.slots_offset + j * self.slot_size
+        fields = SLOT.unpack_from(self.data, offset)
+        sequence = fields[0]
+        if sequence == 0 or sequence & 1 or \
+                self._sequence(offset) != sequence:
+            return None
+        return SharedFrame(self, offset, fields)
+
+    def closed(self):
+        """True once the game has exited, a new FrameShare follows the
+        next one."""
+        return struct.unpack_from('<I', self.data, CLOSED_OFFSET)[0] != 0
+
+    def next(self):
+        """The oldest frame published after the last one returned, or None
+        if there isn't one yet."""
+        for _ in range(self.slot_count + 1):
+            frames = [frame for frame in map(self._read_slot,
+                                             range(self.slot_count))
+                      if frame and frame.ticket > self.last_ticket]
+            if not frames:
+                return None
+            frame = min(frames, key=lambda frame: frame.ticket)
+            if frame.valid():
+                if self.last_ticket:
+                    self.missed += frame.ticket - self.last_ticket - 1
+                self.last_ticket = frame.ticket
+                return frame
+        return None
+
+    def latest(self):
+        """The newest frame in the ring, skipping everything before it."""
+        frames = [frame for frame in map(self._read_slot,
+                                         range(self.slot_count)) if frame]
+        if not frames:
+            return None
+        frame = max(frames, key=lambda frame: frame.ticket)
+        self.last_ticket = max(self.last_ticket, frame.ticket)
+        return frame
+
+    def frames(self, poll_s=0.001):
+        """Yields frames in publish order until the game exits."""
+        while True:
+            frame = self.next()
+            if frame:
+                yield frame
+            elif self.closed():
+                return
+            else:
+                time.sleep(poll_s)
+
+
+def wait_for_share(name=DEFAULT_NAME, poll_s=0.01):
+    """Waits for a game to start publishing under name."""
+    while True:
+        try:
+            return FrameShare(name)
+        except (OSError, ValueError, struct.error):
+            time.sleep(poll_s)
+
+
+if __name__ == '__main__':
+    share = wait_for_share(argv[1] if len(argv) > 1 else DEFAULT_NAME)
+    start = time.time()
+    count = 0
+    for frame in share.frames():
+        color, depth = frame.color.mean(), frame.depth.mean()
+        count += 1
+        print('{} {}x{}{} t={} mean color={:.1f} depth={:.1f}{}'.format(
+            frame.ID, frame.width, frame.height,
+            ' half' if frame.half else '', frame.timestamp, color, depth,
+            '' if frame.valid() else ' (overwritten)'))
+    elapsed = time.time() - start
+    print('{} frames in {:.1f} s, {} missed'.format(count, elapsed,
+                                                   share.missed))
@@ -3,7 +3,7 @@
 import cv2
 import numpy as np
 from numpy import uint32, float32, sqrt
-from os.path import abspath
+from os.path import abspath, dirname, exists, join
 from os import listdir
 from sys import argv
 
@@ -13,15 +13,16 @@ from pycuda.compiler import SourceModule
 
 import h5py
 
+from depth_formats import DEPTH_SUFFIXES, read_depth
+from frame_archive import FrameArchive
 
-def read_depth_img(name):
-    return cv2.flip(cv2.imread('../depth_upsample_data/{}'.format(name),
-                               cv2.IMREAD_UNCHANGED) / (2 ** 16), 0)
 
+def read_depth_img(path):
+    return cv2.flip(read_depth(path) / (2 ** 16), 0)
 
-def read_color_img(name):
-    return cv2.flip(cv2.imread('../depth_upsample_data/{}'.format(name),
-                               cv2.IMREAD_COLOR) / (2 ** 8), 0)
+
+def read_color_img(path):
+    return cv2.flip(cv2.imread(path, cv2.IMREAD_COLOR) / (2 ** 8), 0)
 
 
 def show_image(img, label='Depth Image', wait_period=0):
@@ -122,14 +123,69 @@ def get_image_filenumbers_in_dir(directory):
     file_set = set(listdir(directory))
     file_names = []
     for filename in listdir(directory):
-        if filename.endswith("_color.png"):
+        if filename.endswith("_color.png") and \
+                not filename.endswith("_half_color.png"):
             number = filename[:-10]
             print("File number: {}".format(number))
-            if number + "_depth.pgm" in file_set:
-                file_names.append(number)
+            for suffix in DEPTH_SUFFIXES:
+                if number + suffix in file_set:
+                    file_names.append((number, number + suffix))
+                    break
     return file_names
 
 
+def read_duplicates(directory):
+    """IDs hooks.so tagged as near-duplicates with DEPTH_UPSAMPLE_DEDUP=tag,
+    one "<ID> <kept ID> <distance>" line each in duplicates.txt"""
+    path = join(directory, 'duplicates.txt')
+    if not exists(path):
+        return set()
+    with open(path) as f:
+        return {int(line.split()[0]) for line in f if line.strip()}
+
+
+def archive_frame_images(frame):
+    color = cv2.cvtColor(frame.color(), cv2.COLOR_RGB2BGR)
+    return (cv2.flip(frame.depth() / (2 ** 16), 0),
+            cv2.flip(color / (2 ** 8), 0))
+
+
+def iterate_frames(path):
+    """Yields (depth, color, half_depth, half_color) from either a capture
+    session directory (e.g. ../depth_upsample_data/latest) or a frames.dua
+    archive, flipped upright and scaled to [0, 1). The half resolution pair
+    is the one the hook rendered with DEPTH_UPSAMPLE_GPU_DOWNSAMPLE=both,
+    or (None, None) if it wasn't captured. Frames tagged as near-duplicates
+    are skipped."""
+    duplicates = read_duplicates(dirname(path) if path.endswith('.dua')
+                                 else path)
+    if path.endswith('.dua'):
+        half_path = path[:-len('.dua')] + '_half.dua'
+        half = FrameArchive(half_path) if exists(half_path) else None
+        half_ids = set(half.ids()) if half else set()
+        for frame in FrameArchive(path):
+            if frame.ID in duplicates:
+                continue
+            if frame.ID in half_ids:
+                half_pair = archive_frame_images(half.frame(frame.ID))
+            else:
+                half_pair = (None, None)
+            yield archive_frame_images(frame) + half_pair
+    else:
+        for i, depth_name in get_image_filenumbers_in_dir(path):
+            if int(i) in duplicates:
+                continue
+            half_color = join(path, '{}_half_color.png'.format(i))
+            half_depth = join(path, depth_name.replace(i, i + '_half', 1))
+            half_pair = (None, None)
+            if exists(half_color) and exists(half_depth):
+                half_pair = (read_depth_img(half_depth),
+                             read_color_img(half_color))
+            yield (read_depth_img(join(path, depth_name)),
+                   read_color_img(join(path, '{}_color.png'.format(i)))) + \
+                half_pair
+
+
 if __name__ == '__main__':
     assert len(argv) == 2
 
@@ -145,11 +201,15 @@ if __name__ == '__main__':
 
     num_results_training, num_results_testing = 0, 0
     # for i in range(210, 1320, 30):
-    for i in get_image_filenumbers_in_dir(argv[1]):
-        img_depth = read_depth_img('{}_depth.pgm'.format(i))
-        img_color = read_color_img('{}_color.png'.format(i)).astype(float32)
-        downsampled_depth = downsample(img_depth)
-        downsampled_color = downsample(img_color).astype(float32)
+    for img_depth, img_color, half_depth, half_color in \
+            iterate_frames(argv[1]):
+        img_color = img_color.astype(float32)
+        # The hook can render the same nearest-sample pair on the GPU
+        if half_depth is None:
+            half_depth = downsample(img_depth)
+            half_color = downsample(img_color)
+        downsampled_depth = half_depth
+        downsampled_color = half_color.astype(float32)
         downsampled_depth = \
             np.reshape(downsampled_depth,
                        (downsampled_depth.shape[0],
@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+
+"""Collects the training shards hooks.so writes with
+DEPTH_UPSAMPLE_OUTPUT=samples into the output.hdf5 layout process_data.py
+produces, without going through any images."""
+
+from glob import glob
+from os.path import join
+from sys import argv
+
+import h5py
+import numpy as np
+
+
+def shard_paths(directory, split, kind):
+    return sorted(glob(join(directory,
+                            'samples_*_*_{}_{}.npy'.format(split, kind))))
+
+
+def load_split(directory, split):
+    """Returns (features, targets) of one split, with features shaped
+    (N, 7, 7, 4) and targets (N, 2, 2, 3)."""
+    features = [np.load(path, mmap_mode='r')
+                for path in shard_paths(directory, split, 'features')]
+    targets = [np.load(path, mmap_mode='r')
+               for path in shard_paths(directory, split, 'targets')]
+    if not features:
+        return (np.zeros((0, 7, 7, 4), dtype=np.float32),
+                np.zeros((0, 2, 2, 3), dtype=np.float32))
+    return np.concatenate(features), np.concatenate(targets)
+
+
+def write_hdf5(directory, output='output.hdf5'):
+    with h5py.File(output, 'w') as f:
+        for split in ('train', 'test'):
+            features, targets = load_split(directory, split)
+            group = f.create_group(split)
+            group.create_dataset('features', data=features)
+            group.create_dataset('predictions', data=targets)
+            print('{}: {} samples'.format(split, features.shape[0]))
+
+
+if __name__ == '__main__':
+    assert len(argv) == 2
+    write_hdf5(argv[1])
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "sample_extract.h"
+#include "frame_queue.h"
+#include "config.h"
+#include "log.h"
+#include "trace.h"
+
+static void allocate_set(sample_set* set, const size_t capacity) {
+    set->features = (char*) malloc(NPY_HEADER_SIZE + capacity *
+                                   SAMPLE_PATCH_FEATURES * sizeof(float));
+    set->targets = (char*) malloc(NPY_HEADER_SIZE + capacity *
+                                  SAMPLE_TARGET_VALUES * sizeof(float));
+    set->count = 0;
+}
+
+void sample_shard_init(sample_shard* shard,
+                       frame_writer* writer,
+                       const char* output_dir,
+                       const int thread) {
+    memset(shard, 0, sizeof(sample_shard));
+    pthread_mutex_init(&(shard->lock), NULL);
+    shard->writer = writer;
+    shard->output_dir = output_dir;
+    shard->thread = thread;
+    const int capacity = config_get_int("DEPTH_UPSAMPLE_SHARD_SIZE",
+                                        SAMPLE_DEFAULT_SHARD_SIZE);
+    shard->capacity = capacity < 1 ? 1 : capacity;
+}
+
+// Fills the header space in front of a float32 array of count rows of the
+// given shape, padded with spaces to NPY_HEADER_SIZE as the format wants
+static void write_npy_header(char* buffer,
+                             const size_t count,
+                             const char* shape) {
+    char dict[NPY_HEADER_SIZE];
+    const int length = snprintf(dict, sizeof(dict),
+                                "{'descr': '<f4', 'fortran_order': False, "
+                                "'shape': (%zu, %s), }", count, shape);
+    const uint16_t header_length = NPY_HEADER_SIZE - 10;
+    memcpy(buffer, "\x93NUMPY\x01\x00", 8);
+    memcpy(buffer + 8, &header_length, sizeof(header_length));
+    memset(buffer + 10, ' ', header_length);
+    memcpy(buffer + 10, dict, length);
+    buffer[NPY_HEADER_SIZE - 1] = '\n';
+}
+
+static void submit_array(sample_shard* shard,
+                         char* buffer,
+                         const size_t count,
+                         const size_t values,
+                         const char* shape,
+                         const char* name) {
+    write_npy_header(buffer, count, shape);
+
+    write_job job;
+    memset(&job, 0, sizeof(job));
+    job.owned[0] = buffer;
+    job.num_segments = 1;
+    write_segment* segment = &(job.segments[0]);
+    segment->fd = -1;
+    snprintf(segment->path, sizeof(segment->path), "%ssamples_%i_%u_%s.npy",
+             shard->output_dir, shard->thread, shard->shards, name);
+    segment->data = buffer;
+    segment->length = NPY_HEADER_SIZE + count * values * sizeof(float);
+    segment->offset = 0;
+    frame_writer_submit(shard->writer, &job);
+}
+
+// Hands both arrays of the set to the frame writer, which frees them.
+// The set is left without buffers, the next sample allocates new ones.
+static void flush_set(sample_shard* shard,
+                      sample_set* set,
+                      const char* name) {
+    if (set->count == 0) {
+        free(set->features);
+        free(set->targets);
+        set->features = NULL;
+        set->targets = NULL;
+        return;
+    }
+    char features_name[32];
+    char targets_name[32];
+    snprintf(features_name, sizeof(features_name), "%s_features", name);
+    snprintf(targets_name, sizeof(targets_name), "%s_targets", name);
+    submit_array(shard, set->features, set->count, SAMPLE_PATCH_FEATURES,
+                 "7, 7, 4", features_name);
+    submit_array(shard, set->targets, set->count, SAMPLE_TARGET_VALUES,
+                 "2, 2, 3", targets_name);
+    shard->shards++;
+    LOG_DEBUG("Wrote a %s shard of %zu samples", name, set->count);
+    set->features = NULL;
+    set->targets = NULL;
+    set->count = 0;
+}
+
+void sample_shard_flush(sample_shard* shard) {
+    pthread_mutex_lock(&(shard->lock));
+    flush_set(shard, &(shard->train), "train");
+    flush_set(shard, &(shard->test), "test");
+    free(shard->low_res);
+    shard->low_res = NULL;
+    shard->low_res_capacity = 0;
+    pthread_mutex_unlock(&(shard->lock));
+}
+
+// Same hash as rand() in patches.cu
+static float hash(const float x, const float y) {
+    const float a = sinf(x * 12.9898f + y * 78.233f) * 43758.5453f;
+    return a - floorf(a);
+}
+
+// Builds the half resolution rows x cols x 4 image process_data.py feeds
+// the kernel: flipped upright, BGR scaled to [0, 1) and depth^32, taking
+// every other pixel like downsample()
+static void build_low_res(float* low_res,
+                          const unsigned char* color,
+                          const uint16_t* depth,
+                          const int width,
+                          const int height,
+                          const int rows,
+                          const int cols) {
+    for (int r = 0; r < rows; r++) {
+        const int src_row = height - 1 - 2 * r;
+        const unsigned char* color_row = color + (size_t) src_row * width * 3;
+        const uint16_t* depth_row = depth + (size_t) src_row * width;
+        float* out = low_res + (size_t) r * cols * 4;
+        for (int c = 0; c < cols; c++) {
+            const unsigned char* pixel = color_row + 2 * c * 3;
+            out[0] = pixel[2] / 256.0f;
+            out[1] = pixel[1] / 256.0f;
+            out[2] = pixel[0] / 256.0f;
+            double d = depth_row[2 * c] / 65536.0;
+            for (int j = 0; j < 5; j++) {
+                d *= d;
+            }
+            out[3] = (float) d;
+            out += 4;
+        }
+    }
+}
+
+static void extract_sample(sample_shard* shard,
+                           const float* low_res,
+                           const unsigned char* color,
+                           const int width,
+                           const int height,
+                           const int rows,
+                           const int cols,
+                           const int center_i,
+                           const int center_j) {
+    const int global_id = center_i * cols + center_j;
+    int ordering[3];
+    for (int a = 0; a < 3; a++) {
+        ordering[a] = (global_id % 3 + a) % 3;
+    }
+    const float brightness = 1.0f + hash(center_i, center_j) * 0.2f;
+
+    sample_set* set = hash(center_j, center_i) < 0.1f ? &(shard->test) :
+                      &(shard->train);
+    if (!set->features) {
+        allocate_set(set, shard->capacity);
+    }
+    float* features = (float*) (set->features + NPY_HEADER_SIZE) +
+                      set->count * SAMPLE_PATCH_FEATURES;
+    float* targets = (float*) (set->targets + NPY_HEADER_SIZE) +
+                     set->count * SAMPLE_TARGET_VALUES;
+
+    for (int offset_i = 0; offset_i < 2; offset_i++) {
+        const int src_row = height - 1 - (2 * center_i + offset_i);
+        for (int offset_j = 0; offset_j < 2; offset_j++) {
+            // RGB in memory, so BGR channel k is byte 2 - k
+            const unsigned char* pixel = color +
+                                         ((size_t) src_row * width +
+                                          2 * center_j + offset_j) * 3;
+            for (int k = 0; k < 3; k++) {
+                *(targets++) = pixel[2 - ordering[k]] / 256.0f * brightness;
+            }
+        }
+    }
+
+    // The kernel's bound: it checks the row against both sizes and never
+    // the column, so a column past the edge reads on into the next row.
+    // Past the last row, where the kernel reads outside the image, the
+    // sample is zero like any other out of range one.
+    for (int offset_i = -3; offset_i <= 3; offset_i++) {
+        for (int offset_j = -3; offset_j <= 3; offset_j++) {
+            const int i = center_i + offset_i;
+            const int j = center_j + offset_j;
+            const size_t index = (size_t) i * cols + j;
+            if (i < 0 || j < 0 || i >= rows || i >= cols ||
+                    index >= (size_t) rows * cols) {
+                memset(features, 0, 4 * sizeof(float));
+            } else {
+                const float* pixel = low_res + index * 4;
+                features[0] = pixel[ordering[0]] * brightness;
+                features[1] = pixel[ordering[1]] * brightness;
+                features[2] = pixel[ordering[2]] * brightness;
+                features[3] = pixel[3];
+            }
+            features += 4;
+        }
+    }
+
+    if (++(set->count) == shard->capacity) {
+        flush_set(shard, set, set == &(shard->test) ? "test" : "train");
+    }
+}
+
+void sample_extract(sample_shard* shard,
+                    const unsigned char* color,
+                    const unsigned char* depth,
+                    const int width,
+                    const int height) {
+    TRACE_SCOPE("sample_extract");
+    // Sized like the half frames and cv2.resize(fx=0.5)
+    const int rows = half_size(height);
+    const int cols = half_size(width);
+    const size_t low_res_size = (size_t) rows * cols * 4;
+
+    pthread_mutex_lock(&(shard->lock));
+    if (shard->low_res_capacity < low_res_size) {
+        free(shard->low_res);
+        shard->low_res = (float*) malloc(low_res_size * sizeof(float));
+        shard->low_res_capacity = low_res_size;
+    }
+    build_low_res(shard->low_res, color, (const uint16_t*) depth,
+                  width, height, rows, cols);
+
+    // The kernel runs 16x16 blocks over the half resolution image and
+    // skips any partial block at the edges. A rounded up half size has a
+    // last center whose 2x2 target would be past the frame, those aren't
+    // sampled either.
+    const int center_rows = (height / 2) / SAMPLE_BLOCK_SIZE *
+                            SAMPLE_BLOCK_SIZE;
+    const int center_cols = (width / 2) / SAMPLE_BLOCK_SIZE *
+                            SAMPLE_BLOCK_SIZE;
+    for (int i = 0; i < center_rows; i++) {
+        for (int j = 0; j < center_cols; j++) {
+            extract_sample(shard, shard->low_res, color, width, height,
+                           rows, cols, i, j);
+        }
+    }
+    pthread_mutex_unlock(&(shard->lock));
+}
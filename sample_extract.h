@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "frame_writer.h"
+
+#define SAMPLE_PATCH_FEATURES (7 * 7 * 4)
+#define SAMPLE_TARGET_VALUES (2 * 2 * 3)
+#define SAMPLE_DEFAULT_SHARD_SIZE 65536
+#define SAMPLE_BLOCK_SIZE 16
+#define NPY_HEADER_SIZE 128
+
+// Samples are stored behind room for the .npy header, so a full shard is
+// handed to the frame writer as one buffer without copying
+typedef struct {
+    char* features;
+    char* targets;
+    size_t count;
+} sample_set;
+
+// Training samples of one consumer thread. Every sample is what the
+// image_hash kernel in processing/patches.cu produces: a 7x7 patch of the
+// half resolution BGR color plus depth^32, and the 2x2 block of full
+// resolution BGR color it upsamples to, both scaled by the same random
+// brightness and channel rotation. About 10% of them go to the test set.
+// Once DEPTH_UPSAMPLE_SHARD_SIZE samples of a set have accumulated they
+// are written as float32 .npy files,
+// samples_<thread>_<shard>_{train,test}_{features,targets}.npy, which
+// processing/samples.py turns into the usual HDF5 file.
+typedef struct {
+    pthread_mutex_t lock;
+    frame_writer* writer;
+    const char* output_dir;
+    int thread;
+    unsigned int shards;
+    size_t capacity;
+    sample_set train;
+    sample_set test;
+    float* low_res;
+    size_t low_res_capacity;
+} sample_shard;
+
+void sample_shard_init(sample_shard* shard,
+                       frame_writer* writer,
+                       const char* output_dir,
+                       const int thread);
+// color is packed RGB and depth 16-bit, both bottom row first as read back
+void sample_extract(sample_shard* shard,
+                    const unsigned char* color,
+                    const unsigned char* depth,
+                    const int width,
+                    const int height);
+// Writes out whatever has accumulated, for the end of the session
+void sample_shard_flush(sample_shard* shard);
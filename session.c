@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "session.h"
+#include "config.h"
+#include "log.h"
+
+typedef struct {
+    char root[SESSION_PATH_SIZE];
+    char current[SESSION_PATH_SIZE];
+    int keep;
+    uint64_t max_bytes;
+} cleanup_policy;
+
+typedef struct {
+    char name[SESSION_PATH_SIZE];
+    uint64_t bytes;
+    // Held by another process when the scan saw it
+    bool locked;
+} session_entry;
+
+// Locks the SESSION_LOCK_FILE in path without waiting, creating it if
+// create is set. Returns the descriptor holding the lock, or -1 with errno
+// EWOULDBLOCK if another process holds it.
+static int lock_session(const char* path, const bool create) {
+    char lock_path[2 * SESSION_PATH_SIZE + sizeof(SESSION_LOCK_FILE)];
+    snprintf(lock_path, sizeof(lock_path), "%s/%s", path,
+             SESSION_LOCK_FILE);
+    const int fd = open(lock_path,
+                        O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    if (fd < 0) {
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB)) {
+        const int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+bool session_create(const char* root, const int pid, char* dir,
+                    const size_t size, int* lock) {
+    if (mkdir(root, 0700) && access(root, W_OK)) {
+        LOG_ERROR("Can't create %s", root);
+        return false;
+    }
+
+    char name[64];
+    const time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    const size_t length = strftime(name, sizeof(name),
+                                   SESSION_PREFIX "%Y%m%d_%H%M%S", &local);
+    snprintf(name + length, sizeof(name) - length, "_%d", pid);
+    snprintf(dir, size, "%s%s/", root, name);
+
+    // Made under a name cleanup doesn't look at, and only renamed once it
+    // is locked, so no other process ever sees it unlocked
+    char temp_dir[SESSION_PATH_SIZE + sizeof(name)];
+    snprintf(temp_dir, sizeof(temp_dir), "%s.%s", root, name);
+    if (mkdir(temp_dir, 0700)) {
+        LOG_ERROR("Can't create session directory %s", dir);
+        return false;
+    }
+    *lock = lock_session(temp_dir, true);
+    if (*lock < 0 || rename(temp_dir, dir)) {
+        LOG_ERROR("Can't create session directory %s", dir);
+        if (*lock >= 0) {
+            close(*lock);
+            *lock = -1;
+        }
+        char lock_path[sizeof(temp_dir) + sizeof(SESSION_LOCK_FILE)];
+        snprintf(lock_path, sizeof(lock_path), "%s/%s", temp_dir,
+                 SESSION_LOCK_FILE);
+        unlink(lock_path);
+        rmdir(temp_dir);
+        return false;
+    }
+    LOG_INFO("Writing this session to %s", dir);
+
+    // Swap the link in atomically so readers never see it missing
+    char link_path[SESSION_PATH_SIZE];
+    char temp_path[SESSION_PATH_SIZE + 16];
+    snprintf(link_path, sizeof(link_path), "%s%s", root, SESSION_LATEST_LINK);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", link_path, pid);
+    if (symlink(name, temp_path) || rename(temp_path, link_path)) {
+        LOG_WARN("Can't point %s at the new session", link_path);
+        unlink(temp_path);
+    }
+    return true;
+}
+
+// Adds the blocks of everything under the directory fd to bytes and
+// closes fd. Each cleanup thread has its own total, so concurrent scans
+// don't mix.
+static void add_tree_size(const int fd, uint64_t* bytes) {
+    DIR* dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 ||
+                strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+            continue;
+        }
+        *bytes += (uint64_t) st.st_blocks * 512;
+        if (S_ISDIR(st.st_mode)) {
+            const int child = openat(dirfd(dir), entry->d_name,
+                                     O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                                     O_CLOEXEC);
+            if (child >= 0) {
+                add_tree_size(child, bytes);
+            }
+        }
+    }
+    closedir(dir);
+}
+
+static uint64_t tree_size(const char* path) {
+    uint64_t bytes = 0;
+    const int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                        O_CLOEXEC);
+    if (fd >= 0) {
+        add_tree_size(fd, &bytes);
+    }
+    return bytes;
+}
+
+static int remove_entry(const char* path, const struct stat* st,
+                        int type, struct FTW* ftw) {
+    if (remove(path)) {
+        LOG_DEBUG("Can't delete %s", path);
+    }
+    return 0;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    return strcmp(((const session_entry*) a)->name,
+                  ((const session_entry*) b)->name);
+}
+
+static void delete_tree(const char* path) {
+    LOG_DEBUG("Deleting %s", path);
+    nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// Returns true if another process holds the lock of the session at path.
+// Sessions from before there were locks have no lock file.
+static bool session_locked(const char* path) {
+    const int lock = lock_session(path, false);
+    if (lock >= 0) {
+        close(lock);
+        return false;
+    }
+    return errno == EWOULDBLOCK;
+}
+
+// A session_create() that crashed between mkdir() and rename() leaves its
+// hidden directory behind. Nothing renames it after
+// SESSION_STALE_TEMP_SECONDS, so it goes unless someone still holds it.
+static void delete_stale_temp(const char* path) {
+    struct stat st;
+    if (lstat(path, &st) || !S_ISDIR(st.st_mode) ||
+            time(NULL) - st.st_mtime < SESSION_STALE_TEMP_SECONDS) {
+        return;
+    }
+    const int lock = lock_session(path, false);
+    if (lock < 0 && errno == EWOULDBLOCK) {
+        return;
+    }
+    delete_tree(path);
+    if (lock >= 0) {
+        close(lock);
+    }
+}
+
+static void* cleanup_thread(void* policy_ptr) {
+    cleanup_policy* policy = (cleanup_policy*) policy_ptr;
+
+    // Stay out of the way of the game and the capture threads
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    setpriority(PRIO_PROCESS, 0, 19);
+
+    DIR* dir = opendir(policy->root);
+    if (!dir) {
+        free(policy);
+        return NULL;
+    }
+
+    session_entry* sessions = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    char path[2 * SESSION_PATH_SIZE];
+    struct dirent* ret;
+    size_t unlocked = 0;
+    while ((ret = readdir(dir)) != NULL) {
+        snprintf(path, sizeof(path), "%s%s", policy->root, ret->d_name);
+        if (ret->d_name[0] == '.' &&
+                strncmp(ret->d_name + 1, SESSION_PREFIX,
+                        strlen(SESSION_PREFIX)) == 0) {
+            delete_stale_temp(path);
+        } else if (strncmp(ret->d_name, SESSION_PREFIX,
+                           strlen(SESSION_PREFIX)) == 0) {
+            if (strcmp(ret->d_name, policy->current) == 0) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity ? 2 * capacity : 16;
+                sessions = (session_entry*) realloc(
+                               sessions, capacity * sizeof(session_entry));
+            }
+            snprintf(sessions[count].name, SESSION_PATH_SIZE, "%s",
+                     ret->d_name);
+            sessions[count].bytes = policy->max_bytes ? tree_size(path) : 0;
+            sessions[count].locked = session_locked(path);
+            unlocked += !sessions[count].locked;
+            count++;
+        }
+    }
+    closedir(dir);
+
+    // Names start with the creation time, so this sorts oldest first
+    qsort(sessions, count, sizeof(session_entry), compare_entries);
+    uint64_t total = 0;
+    for (size_t j = 0; j < count; j++) {
+        total += sessions[j].bytes;
+    }
+
+    // Sessions other processes are writing can't be deleted, so they
+    // don't count against keep either. unlocked is what is left of the
+    // rest, the current session comes on top.
+    size_t deleted = 0;
+    for (size_t j = 0; j < count; j++) {
+        const bool too_many = policy->keep > 0 &&
+                              unlocked + 1 > (size_t) policy->keep;
+        const bool too_big = policy->max_bytes && total > policy->max_bytes;
+        if (!too_many && !too_big) {
+            break;
+        }
+        if (sessions[j].locked) {
+            continue;
+        }
+        unlocked--;
+        snprintf(path, sizeof(path), "%s%s", policy->root,
+                 sessions[j].name);
+        // Sessions from before there were locks have no lock file
+        const int lock = lock_session(path, false);
+        if (lock < 0 && errno == EWOULDBLOCK) {
+            LOG_DEBUG("Keeping %s, another process is writing it", path);
+            continue;
+        }
+        delete_tree(path);
+        if (lock >= 0) {
+            close(lock);
+        }
+        total -= sessions[j].bytes;
+        deleted++;
+    }
+    LOG_INFO("Deleted %zu old capture sessions", deleted);
+
+    free(sessions);
+    free(policy);
+    return NULL;
+}
+
+void session_start_cleanup(const char* root, const char* current) {
+    cleanup_policy* policy = (cleanup_policy*) malloc(sizeof(cleanup_policy));
+    snprintf(policy->root, sizeof(policy->root), "%s", root);
+    // Only the last path component of the current session is compared
+    const size_t root_length = strlen(root);
+    snprintf(policy->current, sizeof(policy->current), "%s",
+             current + root_length);
+    const size_t length = strlen(policy->current);
+    if (length && policy->current[length - 1] == '/') {
+        policy->current[length - 1] = '\0';
+    }
+    policy->keep = config_get_int("DEPTH_UPSAMPLE_KEEP_SESSIONS",
+                                  SESSION_DEFAULT_KEEP);
+    policy->max_bytes = (uint64_t) (config_get_double(
+                                        "DEPTH_UPSAMPLE_KEEP_GB", 0) *
+                                    (1ull << 30));
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, cleanup_thread, policy)) {
+        LOG_WARN("Can't start the session cleanup thread");
+        free(policy);
+        return;
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#define SESSION_PREFIX "session_"
+#define SESSION_LATEST_LINK "latest"
+#define SESSION_DEFAULT_KEEP 5
+#define SESSION_PATH_SIZE 256
+#define SESSION_LOCK_FILE ".lock"
+// Hidden .session_* directories are only there while session_create()
+// runs, one this old was left by a crash
+#define SESSION_STALE_TEMP_SECONDS 3600
+
+// Every run writes into its own DEPTH_UPSAMPLE_DIR/session_<time>_<pid>/
+// directory, with DEPTH_UPSAMPLE_DIR/latest pointing at it, so startup
+// only has to create one directory however much an earlier run left
+// behind. dir ends with a '/'. pid is the captured process, which isn't
+// this one when the collector daemon writes for a game. lock is set to a
+// descriptor holding an flock on the session's SESSION_LOCK_FILE, which
+// keeps the session out of every process's cleanup until it is closed.
+bool session_create(const char* root, const int pid, char* dir,
+                    size_t size, int* lock);
+
+// Deletes old sessions on an idle-priority background thread, oldest
+// first, until at most DEPTH_UPSAMPLE_KEEP_SESSIONS (default 5, 0 keeps
+// all) remain including the current one and, if DEPTH_UPSAMPLE_KEEP_GB is
+// set, they fit in that many GB. Sessions another process still holds the
+// lock of are never deleted and don't count against the limit. Besides
+// sessions, only hidden directories a crashed session_create() left behind
+// are deleted from root.
+void session_start_cleanup(const char* root, const char* current);
@@ -0,0 +1,175 @@
+// Runs every swap_bytes16() and pack_bgra_to_rgb() kernel this CPU has on
+// random data of random widths, out of place and in place, and compares
+// each with the scalar loop. The kernels are static, so byte_swap.c is
+// built into this file.
+//
+//   check_byte_swap [rounds] [seed]
+//
+// Exits non-zero on the first mismatch.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "byte_swap.c"
+
+#define CHECK_DEFAULT_ROUNDS 2000
+// Widths up to this cover every vector width and tail length
+#define CHECK_SMALL_WIDTH 256
+#define CHECK_MAX_WIDTH 8192
+// Bytes past the end of dst that must stay untouched
+#define CHECK_GUARD 64
+#define CHECK_GUARD_BYTE 0xA5
+
+typedef size_t (*kernel_fn)(unsigned char* dst,
+                            const unsigned char* src,
+                            const size_t count);
+typedef void (*scalar_fn)(unsigned char* dst,
+                          const unsigned char* src,
+                          const size_t count);
+
+typedef struct {
+    const char* name;
+    kernel_fn run;
+    // __builtin_cpu_supports() name, NULL if the build target has it
+    const char* feature;
+    // Bytes read and written per pixel
+    size_t in_size;
+    size_t out_size;
+    scalar_fn scalar;
+} kernel;
+
+// The dispatchers themselves, whatever they picked
+static size_t swap_bytes16_dispatch(unsigned char* dst,
+                                    const unsigned char* src,
+                                    const size_t count) {
+    swap_bytes16(dst, src, count);
+    return count;
+}
+
+static size_t pack_bgra_to_rgb_dispatch(unsigned char* dst,
+                                        const unsigned char* src,
+                                        const size_t count) {
+    pack_bgra_to_rgb(dst, src, count);
+    return count;
+}
+
+static const kernel kernels[] = {
+#if defined(BYTE_SWAP_X86)
+    {"swap_bytes16_avx2", swap_bytes16_avx2, "avx2", 2, 2,
+     swap_bytes16_scalar},
+    {"swap_bytes16_sse2", swap_bytes16_sse2, NULL, 2, 2,
+     swap_bytes16_scalar},
+    {"pack_bgra_to_rgb_avx2", pack_bgra_to_rgb_avx2, "avx2", 4, 3,
+     pack_bgra_to_rgb_scalar},
+    {"pack_bgra_to_rgb_ssse3", pack_bgra_to_rgb_ssse3, "ssse3", 4, 3,
+     pack_bgra_to_rgb_scalar},
+#elif defined(__ARM_NEON)
+    {"swap_bytes16_neon", swap_bytes16_neon, NULL, 2, 2,
+     swap_bytes16_scalar},
+    {"pack_bgra_to_rgb_neon", pack_bgra_to_rgb_neon, NULL, 4, 3,
+     pack_bgra_to_rgb_scalar},
+#endif
+    {"swap_bytes16", swap_bytes16_dispatch, NULL, 2, 2,
+     swap_bytes16_scalar},
+    {"pack_bgra_to_rgb", pack_bgra_to_rgb_dispatch, NULL, 4, 3,
+     pack_bgra_to_rgb_scalar},
+};
+
+static bool supported(const kernel* k) {
+#if defined(BYTE_SWAP_X86)
+    if (k->feature) {
+        // __builtin_cpu_supports() only takes string literals
+        return strcmp(k->feature, "avx2") == 0 ?
+               __builtin_cpu_supports("avx2") :
+               __builtin_cpu_supports("ssse3");
+    }
+#endif
+    return !k->feature;
+}
+
+// Runs the kernel like the dispatchers do, finishing its tail with the
+// scalar loop
+static void run_kernel(const kernel* k, unsigned char* dst,
+                       const unsigned char* src, const size_t count) {
+    const size_t done = k->run(dst, src, count);
+    k->scalar(dst + k->out_size * done, src + k->in_size * done,
+              count - done);
+}
+
+static bool check(const kernel* k, const size_t count,
+                  const size_t offset, unsigned char* src,
+                  unsigned char* dst, unsigned char* expected,
+                  unsigned char* in_place) {
+    const size_t in_bytes = k->in_size * count;
+    const size_t out_bytes = k->out_size * count;
+    for (size_t j = 0; j < in_bytes; j++) {
+        src[offset + j] = (unsigned char) rand();
+    }
+    k->scalar(expected, src + offset, count);
+
+    memset(dst, CHECK_GUARD_BYTE, offset + out_bytes + CHECK_GUARD);
+    run_kernel(k, dst + offset, src + offset, count);
+    bool ok = memcmp(dst + offset, expected, out_bytes) == 0;
+    for (size_t j = 0; j < CHECK_GUARD; j++) {
+        ok = ok && dst[offset + out_bytes + j] == CHECK_GUARD_BYTE;
+    }
+    for (size_t j = 0; j < offset; j++) {
+        ok = ok && dst[j] == CHECK_GUARD_BYTE;
+    }
+    if (!ok) {
+        fprintf(stderr, "%s: %zu pixels at offset %zu differ\n", k->name,
+                count, offset);
+        return false;
+    }
+
+    memcpy(in_place + offset, src + offset, in_bytes);
+    run_kernel(k, in_place + offset, in_place + offset, count);
+    if (memcmp(in_place + offset, expected, out_bytes) != 0) {
+        fprintf(stderr, "%s: %zu pixels at offset %zu differ in place\n",
+                k->name, count, offset);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const long rounds = argc > 1 ? atol(argv[1]) : CHECK_DEFAULT_ROUNDS;
+    const unsigned int seed = argc > 2 ? (unsigned int) atol(argv[2]) : 1;
+    srand(seed);
+
+    // Room for the widest pixels, an unaligned start and the guard
+    const size_t size = 4 * CHECK_MAX_WIDTH + 32 + CHECK_GUARD;
+    unsigned char* src = (unsigned char*) malloc(size);
+    unsigned char* dst = (unsigned char*) malloc(size);
+    unsigned char* expected = (unsigned char*) malloc(size);
+    unsigned char* in_place = (unsigned char*) malloc(size);
+
+    const size_t kernel_count = sizeof(kernels) / sizeof(kernels[0]);
+    int failed = 0;
+    for (size_t k = 0; k < kernel_count; k++) {
+        if (!supported(&kernels[k])) {
+            printf("%-24s skipped, not supported here\n", kernels[k].name);
+            continue;
+        }
+        bool ok = true;
+        for (size_t count = 0; count <= CHECK_SMALL_WIDTH && ok; count++) {
+            ok = check(&kernels[k], count, count % 32, src, dst, expected,
+                       in_place);
+        }
+        for (long round = 0; round < rounds && ok; round++) {
+            const size_t count = (size_t) rand() % (CHECK_MAX_WIDTH + 1);
+            ok = check(&kernels[k], count, (size_t) rand() % 32, src, dst,
+                       expected, in_place);
+        }
+        printf("%-24s %s\n", kernels[k].name, ok ? "ok" : "FAILED");
+        failed += !ok;
+    }
+
+    free(src);
+    free(dst);
+    free(expected);
+    free(in_place);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+
+"""Generates hook_table.h, the perfect hash table get_wrapped_func() looks
+symbols up in, from the GLX_HOOKS, EGL_HOOKS, GL_HOOKS and HOOK_ALIASES
+lists in hooks_dict.h.
+
+Every hooked name lands in a slot of its own, so a lookup is one hash of
+the name and at most one strcmp, however many hooks there are."""
+
+import re
+from sys import argv, exit
+
+FNV_OFFSET = 2166136261
+FNV_PRIME = 16777619
+# Slots per hooked name, most names that aren't hooked then hash to an
+# empty slot and don't even need the strcmp
+LOAD = 8
+MAX_SEEDS = 1 << 20
+
+
+def macro_entries(source, name):
+    match = re.search(r'#define {}\(X\)((?:.*\\\n)*.*)'.format(name), source)
+    if not match:
+        exit('{} not found'.format(name))
+    return re.findall(r'X\((\w+),\s*(\w+)\)', match.group(1))
+
+
+def fnv1a(symbol, seed):
+    value = seed
+    for char in symbol.encode():
+        value = ((value ^ char) * FNV_PRIME) & 0xffffffff
+    return value
+
+
+def find_seed(symbols, size):
+    for seed in range(FNV_OFFSET, FNV_OFFSET + MAX_SEEDS):
+        slots = {fnv1a(symbol, seed) & (size - 1) for symbol in symbols}
+        if len(slots) == len(symbols):
+            return seed
+    exit('No perfect hash for {} symbols in {} slots'.format(len(symbols),
+                                                            size))
+
+
+def main():
+    source = open(argv[1] if len(argv) > 1 else 'hooks_dict.h').read()
+    # Name looked up -> function handed out
+    entries = [(symbol, symbol) for symbol, _ in
+               macro_entries(source, 'GLX_HOOKS') +
+               macro_entries(source, 'EGL_HOOKS') +
+               macro_entries(source, 'GL_HOOKS')]
+    entries += macro_entries(source, 'HOOK_ALIASES')
+
+    size = 1
+    while size < LOAD * len(entries):
+        size *= 2
+    seed = find_seed([symbol for symbol, _ in entries], size)
+
+    print('// Generated by tools/gen_hook_table.py from hooks_dict.h, '
+          'don\'t edit')
+    print('#pragma once')
+    print()
+    print('#include <stdint.h>')
+    print()
+    print('#define HOOK_TABLE_SEED {}u'.format(seed))
+    print('#define HOOK_TABLE_SIZE {}'.format(size))
+    print('#define HOOK_TABLE_ENTRIES {}'.format(len(entries)))
+    print()
+    # hooks.c checks every name against hooks_dict.h with this at compile
+    # time, so a stale table doesn't build
+    print('// X(name, hook) for every name in the table')
+    print('#define HOOK_TABLE_NAMES(X) \\')
+    print(' \\\n'.join('    X({}, {})'.format(symbol, hook)
+                        for symbol, hook in entries))
+    print()
+    print('typedef struct {')
+    print('    const char* symbol;')
+    print('    void* hook;')
+    print('} hook_entry;')
+    print()
+    print('// 32 bit FNV-1a starting from the seed')
+    print('static inline uint32_t hook_table_hash(const char* symbol) {')
+    print('    uint32_t value = HOOK_TABLE_SEED;')
+    print('    for (; *symbol; symbol++) {')
+    print('        value = (value ^ (unsigned char) *symbol) * '
+          '{}u;'.format(FNV_PRIME))
+    print('    }')
+    print('    return value;')
+    print('}')
+    print()
+    print('static const hook_entry hook_table[HOOK_TABLE_SIZE] = {')
+    slots = sorted((fnv1a(symbol, seed) & (size - 1), symbol, hook)
+                   for symbol, hook in entries)
+    for slot, symbol, hook in slots:
+        print('    [{}] = {{"{}", (void*) &{}}},'.format(slot, symbol, hook))
+    print('};')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,204 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+#include "config.h"
+
+typedef struct {
+    const char* name;
+    int tid;
+    uint64_t start;
+    uint64_t duration;
+} trace_event;
+
+// Each thread appends to its own buffer and publishes the new count with a
+// release store, so the exit handler can read every buffer without locks.
+typedef struct trace_buffer {
+    struct trace_buffer* next;
+    int tid;
+    _Atomic unsigned int count;
+    unsigned int dropped;
+    trace_event events[TRACE_EVENTS_PER_THREAD];
+} trace_buffer;
+
+bool trace_enabled = false;
+
+static const char* trace_path = NULL;
+static _Atomic(trace_buffer*) buffers = NULL;
+static __thread trace_buffer* thread_buffer = NULL;
+
+uint64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static trace_buffer* get_thread_buffer() {
+    if (!thread_buffer) {
+        trace_buffer* buffer = (trace_buffer*) calloc(1, sizeof(trace_buffer));
+        buffer->tid = (int) syscall(SYS_gettid);
+        trace_buffer* head = atomic_load(&buffers);
+        do {
+            buffer->next = head;
+        } while (!atomic_compare_exchange_weak(&buffers, &head, buffer));
+        thread_buffer = buffer;
+    }
+    return thread_buffer;
+}
+
+void trace_record(const char* name,
+                  const int tid,
+                  const uint64_t start,
+                  const uint64_t duration) {
+    trace_buffer* buffer = get_thread_buffer();
+    unsigned int count = atomic_load_explicit(&(buffer->count),
+                                              memory_order_relaxed);
+    if (count == TRACE_EVENTS_PER_THREAD) {
+        buffer->dropped++;
+        return;
+    }
+
+    trace_event* event = &(buffer->events[count]);
+    event->name = name;
+    event->tid = tid < 0 ? buffer->tid : tid;
+    event->start = start;
+    event->duration = duration;
+    atomic_store_explicit(&(buffer->count), count + 1, memory_order_release);
+}
+
+static int compare_durations(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static void write_chrome_trace() {
+    FILE* fp = fopen(trace_path, "w");
+    if (!fp) {
+        fprintf(stderr, "Can't open trace file %s\n", trace_path);
+        return;
+    }
+
+    const int pid = (int) getpid();
+    fprintf(fp, "{\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"name\":\"GPU\"}}", pid, TRACE_GPU_TID);
+    for (trace_buffer* buffer = atomic_load(&buffers); buffer;
+            buffer = buffer->next) {
+        unsigned int count = atomic_load_explicit(&(buffer->count),
+                                                  memory_order_acquire);
+        for (unsigned int j = 0; j < count; j++) {
+            trace_event* event = &(buffer->events[j]);
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+                    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    event->name, pid, event->tid, event->start / 1000.0,
+                    event->duration / 1000.0);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+}
+
+// Gathers every duration recorded under the same scope name across all
+// threads and computes percentiles.
+int trace_collect_stats(trace_stats* stats, const int max_stats) {
+    size_t total = 0;
+    for (trace_buffer* buffer = atomic_load(&buffers); buffer;
+            buffer = buffer->next) {
+        total += atomic_load(&(buffer->count));
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    const char** names = (const char**) malloc(total * sizeof(char*));
+    uint64_t* durations = (uint64_t*) malloc(total * sizeof(uint64_t));
+    size_t num_names = 0;
+
+    for (trace_buffer* buffer = atomic_load(&buffers); buffer;
+            buffer = buffer->next) {
+        unsigned int count = atomic_load(&(buffer->count));
+        for (unsigned int j = 0; j < count; j++) {
+            const char* name = buffer->events[j].name;
+            size_t k;
+            for (k = 0; k < num_names && strcmp(names[k], name) != 0; k++);
+            if (k == num_names) {
+                names[num_names++] = name;
+            }
+        }
+    }
+
+    for (size_t k = 0; k < num_names && (int) k < max_stats; k++) {
+        size_t n = 0;
+        uint64_t sum = 0;
+        for (trace_buffer* buffer = atomic_load(&buffers); buffer;
+                buffer = buffer->next) {
+            unsigned int count = atomic_load(&(buffer->count));
+            for (unsigned int j = 0; j < count; j++) {
+                if (strcmp(buffer->events[j].name, names[k]) == 0) {
+                    durations[n++] = buffer->events[j].duration;
+                    sum += buffer->events[j].duration;
+                }
+            }
+        }
+        qsort(durations, n, sizeof(uint64_t), compare_durations);
+        stats[k].name = names[k];
+        stats[k].count = n;
+        stats[k].p50_us = durations[n / 2] / 1000.0;
+        stats[k].p99_us = durations[n * 99 / 100] / 1000.0;
+        stats[k].max_us = durations[n - 1] / 1000.0;
+        stats[k].total_us = sum / 1000.0;
+    }
+
+    free(names);
+    free(durations);
+    return (int) num_names;
+}
+
+static void print_summary() {
+    trace_stats stats[TRACE_MAX_SCOPES];
+    int num_stats = trace_collect_stats(stats, TRACE_MAX_SCOPES);
+    if (num_stats == 0) {
+        return;
+    }
+    if (num_stats > TRACE_MAX_SCOPES) {
+        num_stats = TRACE_MAX_SCOPES;
+    }
+
+    fprintf(stderr, "%-24s %10s %12s %12s %12s\n",
+            "scope", "count", "p50 (us)", "p99 (us)", "max (us)");
+    for (int k = 0; k < num_stats; k++) {
+        fprintf(stderr, "%-24s %10zu %12.1f %12.1f %12.1f\n", stats[k].name,
+                stats[k].count, stats[k].p50_us, stats[k].p99_us,
+                stats[k].max_us);
+    }
+
+    unsigned int dropped = 0;
+    for (trace_buffer* buffer = atomic_load(&buffers); buffer;
+            buffer = buffer->next) {
+        dropped += buffer->dropped;
+    }
+    if (dropped) {
+        fprintf(stderr, "%u trace events dropped, buffers were full\n",
+                dropped);
+    }
+}
+
+static void finish_trace() {
+    write_chrome_trace();
+    print_summary();
+}
+
+__attribute__((constructor))
+static void init_trace() {
+    trace_path = config_get_str("DEPTH_UPSAMPLE_TRACE", NULL);
+    if (trace_path) {
+        trace_enabled = true;
+        atexit(finish_trace);
+    }
+}
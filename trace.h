@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_EVENTS_PER_THREAD 65536
+#define TRACE_GPU_TID 0
+#define TRACE_MAX_SCOPES 64
+
+// Scoped CPU timers, enabled by pointing DEPTH_UPSAMPLE_TRACE at the
+// Chrome trace-event JSON file to write at exit. A p50/p99 summary per
+// scope is printed to stderr at the same time. When tracing is off a scope
+// is one load and one branch on each side.
+extern bool trace_enabled;
+
+typedef struct {
+    const char* name;
+    uint64_t start;
+} trace_scope;
+
+typedef struct {
+    const char* name;
+    size_t count;
+    double p50_us;
+    double p99_us;
+    double max_us;
+    double total_us;
+} trace_stats;
+
+uint64_t trace_now_ns();
+void trace_record(const char* name,
+                  const int tid,
+                  const uint64_t start,
+                  const uint64_t duration);
+
+// Summary of every scope recorded so far, in the order they were first
+// seen. Returns the number of scopes, of which at most max_stats are
+// filled in.
+int trace_collect_stats(trace_stats* stats, const int max_stats);
+
+static inline void trace_scope_end(trace_scope* scope) {
+    if (scope->start) {
+        trace_record(scope->name, -1, scope->start,
+                     trace_now_ns() - scope->start);
+    }
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(scope_name)                                          \
+    trace_scope TRACE_CONCAT(trace_scope_, __LINE__)                     \
+    __attribute__((cleanup(trace_scope_end))) = {                        \
+        (scope_name), trace_enabled ? trace_now_ns() : 0                 \
+    }